@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_HAL
+
+#include "LatencyHistogram.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <utils/Trace.h>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+LatencyHistogram::LatencyHistogram(const std::string &name) : mName(name) {
+    reset();
+}
+
+void LatencyHistogram::record(int64_t latencyUs) {
+    int bucket = 0;
+
+    if (latencyUs < 0)
+        latencyUs = 0;
+    while (bucket < LATENCY_HISTOGRAM_BUCKETS - 1 && (latencyUs >> (bucket + 1)) > 0)
+        bucket++;
+
+    mBuckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    mCount.fetch_add(1, std::memory_order_relaxed);
+    mSumUs.fetch_add(latencyUs, std::memory_order_relaxed);
+
+    int64_t max = mMaxUs.load(std::memory_order_relaxed);
+    while (latencyUs > max &&
+           !mMaxUs.compare_exchange_weak(max, latencyUs, std::memory_order_relaxed)) {
+    }
+}
+
+void LatencyHistogram::reset() {
+    for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++)
+        mBuckets[i].store(0, std::memory_order_relaxed);
+    mCount.store(0, std::memory_order_relaxed);
+    mSumUs.store(0, std::memory_order_relaxed);
+    mMaxUs.store(0, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::dump(int fd) const {
+    uint64_t count = mCount.load(std::memory_order_relaxed);
+    int64_t sum = mSumUs.load(std::memory_order_relaxed);
+
+    dprintf(fd, "%s: count %" PRIu64 " avg %" PRId64 " us max %" PRId64 " us\n", mName.c_str(),
+            count, count ? sum / (int64_t)count : 0, mMaxUs.load(std::memory_order_relaxed));
+    for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+        uint64_t samples = mBuckets[i].load(std::memory_order_relaxed);
+
+        if (!samples)
+            continue;
+        if (i == LATENCY_HISTOGRAM_BUCKETS - 1)
+            dprintf(fd, "  >= %" PRId64 " us: %" PRIu64 "\n", (int64_t)1 << i, samples);
+        else
+            dprintf(fd, "  < %" PRId64 " us: %" PRIu64 "\n", (int64_t)1 << (i + 1), samples);
+    }
+}
+
+ScopedLatencyTrace::ScopedLatencyTrace(LatencyHistogram *histogram, const char *traceName)
+    : mHistogram(histogram), mStart(std::chrono::steady_clock::now()) {
+    ATRACE_BEGIN(traceName);
+}
+
+ScopedLatencyTrace::~ScopedLatencyTrace() {
+    ATRACE_END();
+    mHistogram->record(std::chrono::duration_cast<std::chrono::microseconds>(
+                               std::chrono::steady_clock::now() - mStart)
+                               .count());
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+#define LATENCY_HISTOGRAM_BUCKETS 24
+
+/*
+ * LatencyHistogram keeps a power of two histogram of latencies in microseconds. Bucket i holds
+ * samples in [2^i, 2^(i+1)) us, with bucket 0 also holding 0 and the last bucket holding
+ * everything above. Recording is lock free so it can be used from any HAL thread.
+ */
+class LatencyHistogram {
+  public:
+    explicit LatencyHistogram(const std::string &name);
+    void record(int64_t latencyUs);
+    // Prints the histogram in a human readable form to fd.
+    void dump(int fd) const;
+    void reset();
+    const std::string &name() const { return mName; }
+    uint64_t count() const { return mCount.load(std::memory_order_relaxed); }
+    int64_t sumUs() const { return mSumUs.load(std::memory_order_relaxed); }
+    int64_t maxUs() const { return mMaxUs.load(std::memory_order_relaxed); }
+
+  private:
+    const std::string mName;
+    std::atomic<uint64_t> mBuckets[LATENCY_HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> mCount;
+    std::atomic<int64_t> mSumUs;
+    std::atomic<int64_t> mMaxUs;
+};
+
+/*
+ * ScopedLatencyTrace emits an atrace slice named traceName for its lifetime and records the
+ * elapsed time into histogram when it goes out of scope.
+ */
+class ScopedLatencyTrace {
+  public:
+    ScopedLatencyTrace(LatencyHistogram *histogram, const char *traceName);
+    ~ScopedLatencyTrace();
+
+  private:
+    LatencyHistogram *mHistogram;
+    std::chrono::steady_clock::time_point mStart;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,309 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.aidl-service"
+
+#include "UeventDispatcher.h"
+
+#include <android-base/properties.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <utils/Log.h>
+
+#include <algorithm>
+
+#include "UeventSocketFilter.h"
+#include "UsbLog.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+using ::android::base::unique_fd;
+
+static bool startsWith(const std::string &str, const std::string &prefix) {
+    return !str.compare(0, prefix.length(), prefix);
+}
+
+const std::string *Uevent::get(const std::string &key) const {
+    for (const auto &field : env) {
+        if (field.first == key)
+            return &field.second;
+    }
+    return NULL;
+}
+
+// Returns whether the KEY=VALUE form of field starts with prefix
+static bool fieldStartsWith(const std::pair<std::string, std::string> &field,
+                            const std::string &prefix) {
+    size_t keyLen = field.first.length();
+
+    if (prefix.length() <= keyLen)
+        return startsWith(field.first, prefix);
+    return startsWith(prefix, field.first) && prefix[keyLen] == '=' &&
+           !field.second.compare(0, prefix.length() - keyLen - 1, prefix, keyLen + 1);
+}
+
+bool UeventFilter::inScope(const Uevent &uevent) const {
+    return devpathPrefixes.empty() ||
+           std::any_of(devpathPrefixes.begin(), devpathPrefixes.end(),
+                       [&uevent](const std::string &prefix) {
+                           return startsWith(uevent.devpath, prefix);
+                       });
+}
+
+bool UeventFilter::selects(const Uevent &uevent) const {
+    if (fieldPrefixes.empty() && !predicate)
+        return true;
+    for (const std::string &prefix : fieldPrefixes) {
+        for (const auto &field : uevent.env) {
+            if (fieldStartsWith(field, prefix))
+                return true;
+        }
+    }
+    return predicate && predicate(uevent);
+}
+
+UeventSubscription::UeventSubscription(UeventFilter filter)
+    : mFilter(std::move(filter)),
+      mEventFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      mLock(PTHREAD_MUTEX_INITIALIZER),
+      mDropped(0) {
+    if (mEventFd.get() == -1)
+        ALOGE("uevent subscription eventfd failed; errno=%d", errno);
+}
+
+void UeventSubscription::push(const Uevent &uevent) {
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&mLock);
+    if (mQueue.size() >= UEVENT_SUBSCRIPTION_MAX_QUEUED) {
+        mQueue.pop_front();
+        mDropped++;
+    }
+    mQueue.push_back(uevent);
+    pthread_mutex_unlock(&mLock);
+
+    if (write(mEventFd.get(), &one, sizeof(one)) != sizeof(one))
+        ALOGE("uevent subscription signal failed; errno=%d", errno);
+}
+
+void UeventSubscription::addDropped(uint64_t count) {
+    pthread_mutex_lock(&mLock);
+    mDropped += count;
+    pthread_mutex_unlock(&mLock);
+}
+
+uint64_t UeventSubscription::dropped() {
+    uint64_t dropped;
+
+    pthread_mutex_lock(&mLock);
+    dropped = mDropped;
+    pthread_mutex_unlock(&mLock);
+    return dropped;
+}
+
+int UeventSubscription::drain(const std::function<void(Uevent &)> &handler) {
+    std::deque<Uevent> queue;
+    uint64_t signals;
+
+    if (read(mEventFd.get(), &signals, sizeof(signals)) == -1 && errno != EAGAIN)
+        ALOGE("uevent subscription read failed; errno=%d", errno);
+
+    pthread_mutex_lock(&mLock);
+    queue.swap(mQueue);
+    pthread_mutex_unlock(&mLock);
+
+    for (Uevent &uevent : queue)
+        handler(uevent);
+    return queue.size();
+}
+
+UeventDispatcher &UeventDispatcher::getInstance() {
+    static UeventDispatcher *sInstance = new UeventDispatcher();
+
+    return *sInstance;
+}
+
+MetricCounter &UeventDispatcher::filterFallbackCounter() {
+    static MetricCounter sCounter("uevent_filter_fallbacks");
+
+    return sCounter;
+}
+
+MetricCounter &UeventDispatcher::filterMissCounter() {
+    static MetricCounter sCounter("uevent_filter_misses");
+
+    return sCounter;
+}
+
+UeventDispatcher::UeventDispatcher()
+    : mFromKernel(true),
+      mUeventFd(openUeventSocket(&mFromKernel)),
+      mLock(PTHREAD_MUTEX_INITIALIZER),
+      mAuditScopes(false),
+      mReceiver(mFromKernel) {
+    if (mUeventFd.get() == -1)
+        return;
+
+    if (pthread_create(&mThread, NULL, dispatchThread, this)) {
+        ALOGE("pthread creation failed %d", errno);
+        mUeventFd.reset();
+    }
+}
+
+std::shared_ptr<UeventSubscription> UeventDispatcher::subscribe(UeventFilter filter) {
+    if (mUeventFd.get() == -1)
+        return NULL;
+
+    auto subscription = std::make_shared<UeventSubscription>(std::move(filter));
+    if (subscription->fd().get() == -1)
+        return NULL;
+
+    pthread_mutex_lock(&mLock);
+    mSubscriptions.push_back(subscription);
+    updateSocketFilterLocked();
+    pthread_mutex_unlock(&mLock);
+    return subscription;
+}
+
+void UeventDispatcher::unsubscribe(const std::shared_ptr<UeventSubscription> &subscription) {
+    pthread_mutex_lock(&mLock);
+    mSubscriptions.erase(
+        std::remove(mSubscriptions.begin(), mSubscriptions.end(), subscription),
+        mSubscriptions.end());
+    updateSocketFilterLocked();
+    pthread_mutex_unlock(&mLock);
+}
+
+void UeventDispatcher::updateSocketFilterLocked() {
+    std::vector<std::string> prefixes;
+    std::vector<struct sock_filter> prog;
+    bool filter = !mSubscriptions.empty();
+
+    for (const auto &subscription : mSubscriptions) {
+        // A subscription without a devpath scope needs every uevent
+        if (subscription->mFilter.devpathPrefixes.empty())
+            filter = false;
+        prefixes.insert(prefixes.end(), subscription->mFilter.devpathPrefixes.begin(),
+                        subscription->mFilter.devpathPrefixes.end());
+    }
+    reduceDevpathPrefixes(&prefixes);
+
+    mAuditScopes =
+        filter && ::android::base::GetBoolProperty(UEVENT_FILTER_DISABLE_PROPERTY, false);
+    if (mAuditScopes) {
+        ALOGW("uevent socket filter disabled, auditing %zu devpaths", prefixes.size());
+        filter = false;
+    }
+    if (filter && !buildUeventSocketFilter(prefixes, &prog)) {
+        ALOGE("uevent socket filter for %zu devpaths dropped, receiving every uevent",
+              prefixes.size());
+        filterFallbackCounter().add();
+        filter = false;
+    }
+
+    if (filter) {
+        struct sock_fprog fprog = {.len = static_cast<unsigned short>(prog.size()),
+                                   .filter = prog.data()};
+
+        if (setsockopt(mUeventFd.get(), SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)))
+            ALOGE("uevent SO_ATTACH_FILTER failed; errno=%d", errno);
+        else
+            ALOGI("uevent socket filter attached for %zu devpaths", prefixes.size());
+    } else if (setsockopt(mUeventFd.get(), SOL_SOCKET, SO_DETACH_FILTER, NULL, 0) &&
+               errno != ENOENT) {
+        ALOGE("uevent SO_DETACH_FILTER failed; errno=%d", errno);
+    }
+}
+
+void UeventDispatcher::dispatch(char *msg) {
+    Uevent uevent;
+    char *cp = msg;
+    char *at = strchr(cp, '@');
+
+    if (at) {
+        uevent.action.assign(cp, at - cp);
+        uevent.devpath.assign(at + 1);
+    }
+    while (*cp++) {
+    }
+    while (*cp) {
+        char *eq = strchr(cp, '=');
+        size_t len = strlen(cp);
+
+        if (eq)
+            uevent.env.emplace_back(std::string(cp, eq - cp), std::string(eq + 1));
+        cp += len + 1;
+    }
+
+    pthread_mutex_lock(&mLock);
+    for (const auto &subscription : mSubscriptions) {
+        const UeventFilter &filter = subscription->mFilter;
+
+        if (!filter.inScope(uevent)) {
+            // Only a subscription selecting by fields tells a uevent it relies on was missed
+            if (mAuditScopes && (!filter.fieldPrefixes.empty() || filter.predicate) &&
+                filter.selects(uevent)) {
+                filterMissCounter().add();
+                USB_LOGI_RATELIMITED("uevent filter would drop %s@%s", uevent.action.c_str(),
+                                     uevent.devpath.c_str());
+            }
+        } else if (filter.selects(uevent)) {
+            subscription->push(uevent);
+        }
+    }
+    pthread_mutex_unlock(&mLock);
+}
+
+void *UeventDispatcher::dispatchThread(void *param) {
+    UeventDispatcher *dispatcher = static_cast<UeventDispatcher *>(param);
+    struct pollfd pfd = {.fd = dispatcher->mUeventFd.get(), .events = POLLIN};
+
+    pthread_setname_np(pthread_self(), "usb-uevent");
+    while (true) {
+        if (poll(&pfd, 1, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            ALOGE("uevent poll failed; errno=%d", errno);
+            break;
+        }
+
+        uint64_t dropped = dispatcher->mReceiver.dropped();
+        dispatcher->mReceiver.drain(dispatcher->mUeventFd.get(),
+                                    [dispatcher](char *msg) { dispatcher->dispatch(msg); });
+
+        // Every subscriber may have missed a uevent the socket dropped
+        dropped = dispatcher->mReceiver.dropped() - dropped;
+        if (dropped) {
+            pthread_mutex_lock(&dispatcher->mLock);
+            for (const auto &subscription : dispatcher->mSubscriptions)
+                subscription->addDropped(dropped);
+            pthread_mutex_unlock(&dispatcher->mLock);
+        }
+    }
+
+    return NULL;
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/unique_fd.h>
+#include <pthread.h>
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "UeventReceiver.h"
+#include "UsbMetrics.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+/*
+ * Property disabling the kernel side socket filter, e.g. to check whether a devpath the HAL relies
+ * on is missing from a filter. While it is set, uevents a subscription selects outside its devpath
+ * scope, which the filter would have dropped, are logged and counted.
+ */
+#define UEVENT_FILTER_DISABLE_PROPERTY "vendor.usb.ueventfilterdisable"
+
+// Uevents a subscription queues before the oldest ones are dropped
+#define UEVENT_SUBSCRIPTION_MAX_QUEUED 256
+
+// A uevent parsed once by the dispatcher
+struct Uevent {
+    std::string action;
+    std::string devpath;
+    // KEY=VALUE fields in the order the kernel sent them
+    std::vector<std::pair<std::string, std::string>> env;
+
+    // Returns the value of key, or NULL when the uevent does not carry it
+    const std::string *get(const std::string &key) const;
+};
+
+/*
+ * Selects the uevents delivered to a subscription. devpathPrefixes scopes the filter: when set,
+ * only uevents whose devpath starts with one of them are considered, and the dispatcher uses them
+ * to let the kernel drop every other uevent before it reaches the process. Within that scope a
+ * uevent matches when one of its KEY=VALUE fields starts with one of fieldPrefixes or when
+ * predicate returns true; with neither set every uevent in scope matches.
+ */
+struct UeventFilter {
+    std::vector<std::string> devpathPrefixes;
+    std::vector<std::string> fieldPrefixes;
+    std::function<bool(const Uevent &)> predicate;
+
+    bool matches(const Uevent &uevent) const { return inScope(uevent) && selects(uevent); }
+    // Whether the devpath of uevent starts with one of devpathPrefixes, or no scope is set
+    bool inScope(const Uevent &uevent) const;
+    // Whether fieldPrefixes or predicate select uevent, regardless of its devpath
+    bool selects(const Uevent &uevent) const;
+};
+
+/*
+ * A consumer's view of the shared uevent socket. Matching uevents are queued by the dispatcher
+ * thread and fd() becomes readable; the consumer drains the queue from its own epoll loop.
+ */
+class UeventSubscription {
+  public:
+    explicit UeventSubscription(UeventFilter filter);
+    // eventfd signalled whenever uevents are queued
+    const ::android::base::unique_fd &fd() const { return mEventFd; }
+    // Pops every queued uevent and passes it to handler. Returns the number handled.
+    int drain(const std::function<void(Uevent &)> &handler);
+    // Uevents this subscription lost to queue or socket overflow
+    uint64_t dropped();
+
+  private:
+    friend class UeventDispatcher;
+    void push(const Uevent &uevent);
+    void addDropped(uint64_t count);
+
+    const UeventFilter mFilter;
+    ::android::base::unique_fd mEventFd;
+    pthread_mutex_t mLock;
+    std::deque<Uevent> mQueue;
+    uint64_t mDropped;
+};
+
+/*
+ * Opens the nonblocking socket the dispatcher receives uevents from and sets fromKernel. Defined
+ * in UeventSocket.cpp, which opens the kernel uevent socket; the test harness links its own
+ * definition returning a local socket it writes recorded uevents to.
+ */
+::android::base::unique_fd openUeventSocket(bool *fromKernel);
+
+/*
+ * UeventDispatcher owns the only kernel uevent socket of the process. Its thread receives every
+ * uevent once, parses it and hands it to the subscriptions whose filter matches, so that the Usb
+ * HAL and UsbDataSessionMonitor do not each get a copy of every uevent on the system.
+ */
+class UeventDispatcher {
+  public:
+    static UeventDispatcher &getInstance();
+    // Returns NULL when the uevent socket could not be opened.
+    std::shared_ptr<UeventSubscription> subscribe(UeventFilter filter);
+    void unsubscribe(const std::shared_ptr<UeventSubscription> &subscription);
+    // Times the socket filter did not fit cBPF and every uevent was received instead
+    static MetricCounter &filterFallbackCounter();
+    // Uevents selected outside their subscription's scope while the socket filter is disabled
+    static MetricCounter &filterMissCounter();
+
+  private:
+    UeventDispatcher();
+    static void *dispatchThread(void *param);
+    void dispatch(char *msg);
+    // Attaches a socket filter for the union of the subscriptions' devpath scopes. Needs mLock.
+    void updateSocketFilterLocked();
+
+    // Whether mUeventFd is the kernel uevent socket, whose senders are checked
+    bool mFromKernel;
+    ::android::base::unique_fd mUeventFd;
+    pthread_t mThread;
+    pthread_mutex_t mLock;
+    std::vector<std::shared_ptr<UeventSubscription>> mSubscriptions;
+    // Set while UEVENT_FILTER_DISABLE_PROPERTY lets out of scope uevents through, under mLock
+    bool mAuditScopes;
+    UeventReceiver mReceiver;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
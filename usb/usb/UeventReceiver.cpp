@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.aidl-service"
+
+#include "UeventReceiver.h"
+
+#include <errno.h>
+#include <string.h>
+#include <utils/Log.h>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+// Room for the two terminating NULs appended to every message
+#define UEVENT_RECEIVER_BUF_LEN (UEVENT_MAX_MSG_LEN + 2)
+
+UeventReceiver::UeventReceiver(bool checkSender)
+    : mBuffers(UEVENT_RECEIVER_BATCH * UEVENT_RECEIVER_BUF_LEN),
+      mCheckSender(checkSender),
+      mDropped(0) {
+    for (int i = 0; i < UEVENT_RECEIVER_BATCH; i++) {
+        mIovs[i].iov_base = &mBuffers[i * UEVENT_RECEIVER_BUF_LEN];
+        mIovs[i].iov_len = UEVENT_MAX_MSG_LEN;
+    }
+}
+
+int UeventReceiver::drain(int fd, const std::function<void(char *msg)> &handler) {
+    int handled = 0;
+
+    for (;;) {
+        int n;
+
+        memset(mMsgs, 0, sizeof(mMsgs));
+        for (int i = 0; i < UEVENT_RECEIVER_BATCH; i++) {
+            mMsgs[i].msg_hdr.msg_name = &mAddrs[i];
+            mMsgs[i].msg_hdr.msg_namelen = sizeof(mAddrs[i]);
+            mMsgs[i].msg_hdr.msg_iov = &mIovs[i];
+            mMsgs[i].msg_hdr.msg_iovlen = 1;
+            mMsgs[i].msg_hdr.msg_control = mControls[i];
+            mMsgs[i].msg_hdr.msg_controllen = sizeof(mControls[i]);
+        }
+
+        n = recvmmsg(fd, mMsgs, UEVENT_RECEIVER_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == ENOBUFS) {
+                // The kernel dropped uevents, keep draining what is left
+                ALOGW("uevent socket overflow, uevents were lost");
+                mDropped++;
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                ALOGE("uevent recvmmsg failed; errno=%d", errno);
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct msghdr *hdr = &mMsgs[i].msg_hdr;
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+            char *msg = static_cast<char *>(mIovs[i].iov_base);
+            unsigned int len = mMsgs[i].msg_len;
+
+            if (hdr->msg_flags & MSG_TRUNC) {
+                ALOGW("uevent larger than %d bytes discarded", UEVENT_MAX_MSG_LEN);
+                mDropped++;
+                continue;
+            }
+            if (mCheckSender &&
+                (cmsg == NULL || cmsg->cmsg_type != SCM_CREDENTIALS ||
+                 reinterpret_cast<struct ucred *>(CMSG_DATA(cmsg))->uid != 0)) {
+                continue;
+            }
+            if (mCheckSender && (mAddrs[i].nl_groups == 0 || mAddrs[i].nl_pid != 0)) {
+                continue;
+            }
+
+            msg[len] = '\0';
+            msg[len + 1] = '\0';
+            handler(msg);
+            handled++;
+        }
+
+        // A short batch means the socket has been drained
+        if (n < UEVENT_RECEIVER_BATCH)
+            break;
+    }
+
+    return handled;
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <linux/netlink.h>
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+// Number of uevents pulled from the socket per recvmmsg call
+#define UEVENT_RECEIVER_BATCH 16
+/*
+ * Largest uevent the kernel emits: the "ACTION@DEVPATH" header, bounded by PATH_MAX, followed by
+ * the environment, bounded by UEVENT_BUFFER_SIZE (2048).
+ */
+#define UEVENT_MAX_MSG_LEN (4096 + 2048)
+
+/*
+ * UeventReceiver drains every uevent pending on a nonblocking kernel uevent socket with
+ * recvmmsg into a preallocated set of buffers, so that a burst of uevents costs one epoll
+ * wakeup instead of one per message. It applies the same sender checks as
+ * uevent_kernel_multicast_recv: messages not multicast by the kernel or not sent with root
+ * credentials are ignored.
+ */
+class UeventReceiver {
+  public:
+    // checkSender is false only for the local socket of the test harness
+    explicit UeventReceiver(bool checkSender = true);
+    /*
+     * Receives all pending uevents from fd and calls handler for each of them. The message
+     * passed to handler holds the NUL separated uevent fields and is terminated by an empty
+     * field. Returns the number of uevents handled.
+     */
+    int drain(int fd, const std::function<void(char *msg)> &handler);
+    // Uevents lost to truncation or to receive buffer overflow since construction
+    uint64_t dropped() const { return mDropped; }
+
+  private:
+    std::vector<char> mBuffers;
+    struct mmsghdr mMsgs[UEVENT_RECEIVER_BATCH];
+    struct iovec mIovs[UEVENT_RECEIVER_BATCH];
+    struct sockaddr_nl mAddrs[UEVENT_RECEIVER_BATCH];
+    char mControls[UEVENT_RECEIVER_BATCH][CMSG_SPACE(sizeof(struct ucred))];
+    const bool mCheckSender;
+    uint64_t mDropped;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.aidl-service"
+
+#include <cutils/uevent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <utils/Log.h>
+
+#include "UeventDispatcher.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+::android::base::unique_fd openUeventSocket(bool *fromKernel) {
+    ::android::base::unique_fd fd(uevent_open_socket(64 * 1024, true));
+
+    if (fd.get() == -1) {
+        ALOGE("uevent_open_socket failed; errno=%d", errno);
+        return fd;
+    }
+    fcntl(fd.get(), F_SETFL, O_NONBLOCK);
+    *fromKernel = true;
+    return fd;
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.aidl-service"
+
+#include "UeventSocketFilter.h"
+
+#include <utils/Log.h>
+
+#include <algorithm>
+#include <cstdint>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+void reduceDevpathPrefixes(std::vector<std::string> *prefixes) {
+    std::vector<std::string> reduced;
+
+    // Sorted, every prefix covering others directly precedes them
+    std::sort(prefixes->begin(), prefixes->end());
+    for (std::string &prefix : *prefixes) {
+        if (!reduced.empty() && !prefix.compare(0, reduced.back().length(), reduced.back()))
+            continue;
+        reduced.push_back(std::move(prefix));
+    }
+    prefixes->swap(reduced);
+}
+
+/*
+ * cBPF has no loops, so the header is compared at fixed offsets: one block per action, and
+ * within it one block per prefix at the offset right after "ACTION@". Conditional jumps only
+ * reach 255 instructions ahead, so an action mismatch goes through a BPF_JA trampoline to the
+ * next action block. Loads past the end of a short message abort the program, which drops the
+ * message.
+ */
+class UeventSocketFilterBuilder {
+  public:
+    bool build(const std::vector<std::string> &prefixes, std::vector<struct sock_filter> *prog) {
+        for (const char *action : UEVENT_ACTIONS) {
+            std::string header = std::string(action) + "@";
+            size_t trampoline;
+
+            resolve(compare(header, 0));
+            // The last comparison of the header jumps over the trampoline on a match
+            mProg.back().jt = 1;
+            trampoline = mProg.size();
+            mProg.push_back(BPF_STMT(BPF_JMP | BPF_JA, 0));
+            for (const std::string &prefix : prefixes) {
+                size_t nextPrefix = compare(prefix, header.length());
+
+                mProg.push_back(BPF_STMT(BPF_RET | BPF_K, 0xffffffff));
+                resolve(nextPrefix);
+            }
+            // The action matched but none of the devpaths did
+            mProg.push_back(BPF_STMT(BPF_RET | BPF_K, 0));
+            mProg[trampoline].k = mProg.size() - trampoline - 1;
+        }
+        mProg.push_back(BPF_STMT(BPF_RET | BPF_K, 0));
+
+        if (mProg.size() > BPF_MAXINSNS || mOutOfRange) {
+            ALOGE("uevent socket filter of %zu instructions does not fit cBPF%s", mProg.size(),
+                  mOutOfRange ? ", a jump exceeds 255 instructions" : "");
+            return false;
+        }
+        *prog = std::move(mProg);
+        return true;
+    }
+
+  private:
+    /*
+     * Emits the comparison of str against the message at offset. Returns a fixup group whose
+     * jumps are taken on mismatch and are pointed at the next instruction by resolve().
+     */
+    size_t compare(const std::string &str, size_t offset) {
+        size_t group = mFixups.size();
+
+        mFixups.emplace_back();
+        for (size_t i = 0; i < str.length();) {
+            size_t remaining = str.length() - i;
+            size_t width = remaining >= 4 ? 4 : remaining >= 2 ? 2 : 1;
+            uint32_t value = 0;
+
+            // BPF_ABS loads are converted from network byte order
+            for (size_t j = 0; j < width; j++)
+                value = (value << 8) | static_cast<uint8_t>(str[i + j]);
+            mProg.push_back(BPF_STMT(BPF_LD | BPF_ABS |
+                                     (width == 4 ? BPF_W : width == 2 ? BPF_H : BPF_B),
+                                     static_cast<uint32_t>(offset + i)));
+            mFixups[group].push_back(mProg.size());
+            mProg.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, value, 0, 0));
+            i += width;
+        }
+        return group;
+    }
+
+    void resolve(size_t group) {
+        for (size_t jump : mFixups[group]) {
+            size_t offset = mProg.size() - jump - 1;
+
+            if (offset > UINT8_MAX)
+                mOutOfRange = true;
+            mProg[jump].jf = offset;
+        }
+    }
+
+    std::vector<struct sock_filter> mProg;
+    std::vector<std::vector<size_t>> mFixups;
+    bool mOutOfRange = false;
+};
+
+bool buildUeventSocketFilter(const std::vector<std::string> &prefixes,
+                             std::vector<struct sock_filter> *prog) {
+    return UeventSocketFilterBuilder().build(prefixes, prog);
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
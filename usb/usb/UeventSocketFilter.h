@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <linux/filter.h>
+
+#include <string>
+#include <vector>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+// Uevent actions the kernel emits, see kobject_actions[] in lib/kobject_uevent.c
+#define UEVENT_ACTIONS {"add", "remove", "change", "move", "online", "offline", "bind", "unbind"}
+
+/*
+ * Sorts prefixes and drops the ones another prefix already covers, e.g. a udc devpath below the
+ * usb controller devpath, as the socket filter accepts them anyway.
+ */
+void reduceDevpathPrefixes(std::vector<std::string> *prefixes);
+
+/*
+ * Builds a classic BPF program for the uevent socket accepting the uevents whose "ACTION@DEVPATH"
+ * header has a devpath starting with one of prefixes. Returns false when the program does not fit
+ * cBPF, in which case the caller receives every uevent.
+ */
+bool buildUeventSocketFilter(const std::vector<std::string> &prefixes,
+                             std::vector<struct sock_filter> *prog);
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -15,33 +15,45 @@
  */
 
 #define LOG_TAG "android.hardware.usb.aidl-service"
+#define ATRACE_TAG ATRACE_TAG_HAL
 
 #include <android-base/logging.h>
 #include <android-base/parseint.h>
 #include <android-base/properties.h>
 #include <android-base/strings.h>
+#include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <climits>
 #include <cstring>
 #include <dirent.h>
+#include <inttypes.h>
 #include <private/android_filesystem_config.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <usbhost/usbhost.h>
-#include <regex>
 #include <thread>
 #include <unordered_map>
 
-#include <cutils/uevent.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <sys/timerfd.h>
 #include <utils/Errors.h>
 #include <utils/StrongPointer.h>
+#include <utils/Trace.h>
 #include <utils/Vector.h>
 
+#include "LatencyHistogram.h"
+#include "UeventDispatcher.h"
 #include "Usb.h"
+#include "UsbHubMatcher.h"
+#include "UsbLog.h"
+#include "UsbMetrics.h"
+#include "UsbSysfs.h"
+#include "UsbSysfsParser.h"
 
 #include <aidl/android/frameworks/stats/IStats.h>
 #include <android_hardware_usb_flags.h>
@@ -52,12 +64,13 @@
 namespace usb_flags = android::hardware::usb::flags;
 
 using aidl::android::frameworks::stats::IStats;
+using android::base::GetBoolProperty;
+using android::base::GetIntProperty;
 using android::base::GetProperty;
 using android::base::Join;
+using android::base::ParseInt;
 using android::base::ParseUint;
-using android::base::Tokenize;
 using android::base::Trim;
-using android::hardware::google::pixel::getStatsService;
 using android::hardware::google::pixel::PixelAtoms::VendorUsbPortOverheat;
 using android::hardware::google::pixel::reportUsbPortOverheat;
 using android::hardware::google::pixel::usb::getI2cClientPath;
@@ -71,39 +84,45 @@ namespace usb {
 #define NUM_HSI2C_PATHS 2
 
 // Set by the signal handler to destroy the thread
-volatile bool destroyThread;
-volatile bool destroyDisplayPortThread;
+std::atomic<bool> destroyThread;
 
 string enabledPath;
 constexpr char *kHsi2cPaths[] = { (char *) "/sys/devices/platform/108d0000.hsi2c",
                                   (char *) "/sys/devices/platform/10cb0000.hsi2c" };
 constexpr char kTcpcDevName[] = "i2c-max77759tcpc";
 constexpr char kI2cClientId[] = "0025";
-constexpr char kDisplayPortDrmPath[] = "/sys/devices/platform/110f0000.drmdp/drm-displayport/";
-constexpr char kDisplayPortUsbPath[] = "/sys/class/typec/port0-partner/";
+static const string kDisplayPortDrmPath =
+    sysfsPath("/sys/devices/platform/110f0000.drmdp/drm-displayport/");
+static const string kDisplayPortUsbPath = sysfsPath("/sys/class/typec/port0-partner/");
 constexpr char kComplianceWarningsPath[] = "device/non_compliant_reasons";
-constexpr char kComplianceWarningBC12[] = "bc12";
-constexpr char kComplianceWarningDebugAccessory[] = "debug-accessory";
-constexpr char kComplianceWarningMissingRp[] = "missing_rp";
-constexpr char kComplianceWarningOther[] = "other";
-constexpr char kComplianceWarningInputPowerLimited[] = "input_power_limited";
 constexpr char kContaminantDetectionPath[] = "contaminant_detection";
 constexpr char kStatusPath[] = "contaminant_detection_status";
 constexpr char kSinkLimitEnable[] = "usb_limit_sink_enable";
 constexpr char kSourceLimitEnable[] = "usb_limit_source_enable";
 constexpr char kSinkLimitCurrent[] = "usb_limit_sink_current";
-constexpr char kTypecPath[] = "/sys/class/typec";
+static const string kTypecPath = sysfsPath("/sys/class/typec");
 constexpr char kDisableContatminantDetection[] = "vendor.usb.contaminantdisable";
-constexpr char kOverheatStatsPath[] = "/sys/devices/platform/google,usbc_port_cooling_dev/";
-constexpr char kOverheatStatsDev[] = "DRIVER=google,usbc_port_cooling_dev";
+constexpr char kRoleSwapRetryInitialMs[] = "vendor.usb.role_swap_retry_initial_ms";
+constexpr char kRoleSwapRetryMaxAttempts[] = "vendor.usb.role_swap_retry_max_attempts";
+constexpr char kRoleSwapConfirmTimeoutMs[] = "vendor.usb.role_swap_confirm_timeout_ms";
+static const string kOverheatStatsPath =
+    sysfsPath("/sys/devices/platform/google,usbc_port_cooling_dev/");
+constexpr char kOverheatStatsDriver[] = "google,usbc_port_cooling_dev";
 constexpr char kThermalZoneForTrip[] = "VIRTUAL-USB-THROTTLING";
 constexpr char kThermalZoneForTempReadPrimary[] = "usb_pwr_therm2";
 constexpr char kThermalZoneForTempReadSecondary1[] = "usb_pwr_therm";
 constexpr char kThermalZoneForTempReadSecondary2[] = "qi_therm";
-constexpr char kPogoUsbActive[] = "/sys/devices/platform/google,pogo/pogo_usb_active";
-constexpr char kPogoEnableUsb[] = "/sys/devices/platform/google,pogo/enable_usb";
-constexpr char kPowerSupplyUsbType[] = "/sys/class/power_supply/usb/usb_type";
+static const string kPogoUsbActive = sysfsPath("/sys/devices/platform/google,pogo/pogo_usb_active");
+static const string kPogoEnableUsb = sysfsPath("/sys/devices/platform/google,pogo/enable_usb");
+static const string kPowerSupplyUsbType = sysfsPath("/sys/class/power_supply/usb/usb_type");
 constexpr char kIrqHpdCount[] = "irq_hpd_count";
+/*
+ * Devices outside the tcpc whose uevents handleUevent() acts on, when present: the usb power
+ * supply, the overheat cooling device and the pogo transport
+ */
+static const char *const kUeventDevicePaths[] = {
+    "/sys/class/power_supply/usb", "/sys/devices/platform/google,usbc_port_cooling_dev",
+    "/sys/devices/platform/google,pogo"};
 constexpr char kUdcUeventRegex[] =
     "/devices/platform/11210000.usb/11210000.dwc3/udc/11210000.dwc3";
 constexpr char kUdcStatePath[] =
@@ -114,12 +133,168 @@ constexpr char kHost1StatePath[] = "/sys/bus/usb/devices/usb1/1-0:1.0/usb1-port1
 constexpr char kHost2UeventRegex[] =
     "/devices/platform/11210000.usb/11210000.dwc3/xhci-hcd-exynos.[0-9].auto/usb2/2-0:1.0";
 constexpr char kHost2StatePath[] = "/sys/bus/usb/devices/usb2/2-0:1.0/usb2-port1/state";
+// Devpath of the devices enumerated by the dwc3 host controller
+constexpr char kUsbHostDevpathPrefix[] = "/devices/platform/11210000.usb/";
 constexpr char kDataRolePath[] = "/sys/devices/platform/11210000.usb/new_data_role";
 constexpr int kSamplingIntervalSec = 5;
 void queryVersionHelper(android::hardware::usb::Usb *usb,
                         std::vector<PortStatus> *currentPortStatus);
 AltModeData::DisplayPortAltModeData constructAltModeData(string hpd, string pin_assignment,
                                                          string link_status, string vdo);
+void *displayPortPollWork(void *param);
+
+// Latency histograms of the hotplug pipeline, printed by the "latency" shell command
+static LatencyHistogram sUeventLatency("uevent_event");
+static LatencyHistogram sSysfsReadLatency("sysfs_read");
+static LatencyHistogram sRoleSwitchWaitLatency("switchMode_wait");
+static LatencyHistogram sDisplayPortDebounceLatency("displayport_debounce");
+// Time from the first to the last event of a DisplayPort debounce burst
+static LatencyHistogram sDisplayPortSettleLatency("displayport_settle");
+static LatencyHistogram sCallbackLatency("callback");
+static LatencyHistogram sCallbackQueueLatency("callback_queue");
+static LatencyHistogram sPortLockHold("mLock_hold");
+static LatencyHistogram sDisplayPortLockHold("mDisplayPortLock_hold");
+// Time from partner bind to the first HPD written to the drm
+static LatencyHistogram sDisplayPortHpdLatency("displayport_hpd");
+// Time taken by the sysfs write batches of enableUsbData
+static LatencyHistogram sUsbDataBatchLatency("enableUsbData_batch");
+// Time IUsb operations run on the executor, and wait for it
+static LatencyHistogram sExecutorLatency("executor");
+static LatencyHistogram sExecutorQueueLatency("executor_queue");
+static LatencyHistogram *const kLatencyHistograms[] = {
+    &sUeventLatency, &sSysfsReadLatency, &sRoleSwitchWaitLatency, &sDisplayPortDebounceLatency,
+    &sDisplayPortSettleLatency, &sDisplayPortHpdLatency, &sCallbackLatency,
+    &sCallbackQueueLatency, &sPortLockHold, &sDisplayPortLockHold, &sUsbDataBatchLatency,
+    &sExecutorLatency, &sExecutorQueueLatency};
+static MetricCounter sUeventCount("uevents");
+// Uevents lost because they exceeded UEVENT_MAX_MSG_LEN or the socket receive buffer overflowed
+static MetricCounter sUeventDropped("uevents_dropped");
+// queryVersionHelper() sweeps of the port status
+static MetricCounter sPortRefreshCount("port_refreshes");
+// Times the DisplayPort handler thread was (re)armed for a partner
+static MetricCounter sDisplayPortArmCount("displayport_arms");
+// IStats reports lost to a full queue or a missing Stats service
+static MetricCounter sStatsReportDropped("stats_reports_dropped");
+// Overheat reports skipped because a cooling device statistic could not be read or parsed
+static MetricCounter sOverheatDataErrors("overheat_data_errors");
+// Sink current limit changes made by the thermal controller
+static MetricCounter sThermalLimitSteps("thermal_limit_steps");
+// Temperature samples taken by the thermal controller
+static MetricCounter sThermalSamples("thermal_samples");
+// IUsb operations rejected because their executor lane was full
+static MetricCounter sExecutorRejected("executor_rejected");
+// IUsbCallback notifications dropped because the callback queue was full
+static MetricCounter sCallbackDropped("callbacks_dropped");
+// Registry behind the "metrics" shell command and the optional IStats push. The order defines
+// the layout of the pushed atom.
+static UsbMetrics sMetrics({&sUeventCount, &sUeventDropped, &sPortRefreshCount,
+                            &sDisplayPortArmCount, &sStatsReportDropped, &sOverheatDataErrors,
+                            &sThermalLimitSteps, &sThermalSamples,
+                            &LogRateLimiter::suppressedCounter(), &sExecutorRejected,
+                            &UeventDispatcher::filterFallbackCounter(),
+                            &UeventDispatcher::filterMissCounter(), &sCallbackDropped,
+                            &UsbHubMatcher::devicesSeenCounter(),
+                            &UsbHubMatcher::devicesMatchedCounter()},
+                           {std::begin(kLatencyHistograms), std::end(kLatencyHistograms)});
+
+static void recordElapsedHelper(LatencyHistogram *histogram,
+                                std::chrono::steady_clock::time_point start) {
+    histogram->record(std::chrono::duration_cast<std::chrono::microseconds>(
+                          std::chrono::steady_clock::now() - start).count());
+}
+
+/*
+ * Sysfs read used by the port status refresh. Each read shows up as its own atrace slice named
+ * after the attribute and is accounted in sSysfsReadLatency.
+ */
+static bool readSysfsTraced(const string &path, string *contents) {
+    ScopedLatencyTrace trace(&sSysfsReadLatency, path.c_str());
+    return ReadFileToString(path, contents);
+}
+
+// Longest role attribute value, e.g. "[source] sink" or "host [device]"
+#define TYPEC_ROLE_MAX_LEN 32
+
+/*
+ * Sysfs nodes of a Type-C port, built once when the port is discovered. The role attributes of
+ * the port are kept open so that the status refresh rereads them with pread; readRoleTraced()
+ * reopens them under sTypeCPortsLock. The partner directory comes and goes with the partner, so
+ * only its paths are kept.
+ */
+struct TypeCPortPaths {
+    string dataRole;
+    string powerRole;
+    string portType;
+    string complianceWarnings;
+    string partner;
+    string partnerAccessoryMode;
+    string partnerSupportsPd;
+    mutable ::android::base::unique_fd dataRoleFd;
+    mutable ::android::base::unique_fd powerRoleFd;
+};
+
+/*
+ * Entries are only created for ports present under /sys/class/typec and are kept once created. A
+ * port can be unregistered and registered again, e.g. when the tcpc driver reloads, which leaves
+ * its cached role fds pointing at dead nodes until readRoleTraced() reopens them.
+ */
+static pthread_mutex_t sTypeCPortsLock = PTHREAD_MUTEX_INITIALIZER;
+static std::unordered_map<string, std::unique_ptr<TypeCPortPaths>> sTypeCPorts;
+
+// Returns NULL when portName is not a port under /sys/class/typec
+static const TypeCPortPaths *getTypeCPortPaths(const string &portName) {
+    TypeCPortPaths *paths = NULL;
+
+    pthread_mutex_lock(&sTypeCPortsLock);
+    auto it = sTypeCPorts.find(portName);
+    if (it != sTypeCPorts.end()) {
+        paths = it->second.get();
+    } else if (!portName.empty() && portName.find('/') == string::npos && portName[0] != '.' &&
+               !access((kTypecPath + "/" + portName).c_str(), F_OK)) {
+        string port = kTypecPath + "/" + portName;
+        std::unique_ptr<TypeCPortPaths> &entry = sTypeCPorts[portName];
+
+        entry = std::make_unique<TypeCPortPaths>();
+        entry->dataRole = port + "/data_role";
+        entry->powerRole = port + "/power_role";
+        entry->portType = port + "/port_type";
+        entry->complianceWarnings = port + "/" + kComplianceWarningsPath;
+        entry->partner = port + "-partner";
+        entry->partnerAccessoryMode = entry->partner + "/accessory_mode";
+        entry->partnerSupportsPd = entry->partner + "/supports_usb_power_delivery";
+        entry->dataRoleFd.reset(open(entry->dataRole.c_str(), O_RDONLY | O_CLOEXEC));
+        entry->powerRoleFd.reset(open(entry->powerRole.c_str(), O_RDONLY | O_CLOEXEC));
+        paths = entry.get();
+    }
+    pthread_mutex_unlock(&sTypeCPortsLock);
+
+    return paths;
+}
+
+/*
+ * Rereads the role attribute kept open in fd into buf. fd is reopened from path when it is not
+ * open or pread fails, e.g. with ENODEV after the port was registered again. Returns false when
+ * the attribute could not be read.
+ */
+static bool readRoleTraced(::android::base::unique_fd *fd, const string &path, char *buf,
+                           size_t len) {
+    ScopedLatencyTrace trace(&sSysfsReadLatency, path.c_str());
+    ssize_t n = -1;
+
+    pthread_mutex_lock(&sTypeCPortsLock);
+    if (fd->get() >= 0)
+        n = TEMP_FAILURE_RETRY(pread(fd->get(), buf, len - 1, 0));
+    if (n < 0) {
+        fd->reset(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        if (fd->get() >= 0)
+            n = TEMP_FAILURE_RETRY(pread(fd->get(), buf, len - 1, 0));
+    }
+    pthread_mutex_unlock(&sTypeCPortsLock);
+    if (n < 0)
+        return false;
+    buf[n] = '\0';
+    return true;
+}
 
 #define CTRL_TRANSFER_TIMEOUT_MSEC 1000
 #define GL852G_VENDOR_ID 0x05e3
@@ -129,9 +304,47 @@ AltModeData::DisplayPortAltModeData constructAltModeData(string hpd, string pin_
 // GL852G port 1 and port 2 JK level default settings
 #define GL852G_VENDOR_CMD_VALUE_DEFAULT 0x0008
 #define GL852G_VENDOR_CMD_INDEX_DEFAULT 0x0407
+static const UsbHubId kUsbHubIds[] = {{GL852G_VENDOR_ID, GL852G_PRODUCT_ID1},
+                                      {GL852G_VENDOR_ID, GL852G_PRODUCT_ID2}};
+constexpr char kUsbHubDefaultProfileName[] = "gl852g-jk";
+
+/*
+ * Operation classes of the IUsb methods. Each port gets an executor lane per class, so operations
+ * of one class are ordered while a slow one never delays those of another class.
+ */
+constexpr char kLaneRole[] = "role";
+constexpr char kLaneData[] = "data";
+constexpr char kLanePower[] = "power";
+constexpr char kLaneContaminant[] = "contaminant";
+constexpr char kLaneStatus[] = "status";
+
+/*
+ * Callers reject a portName that is not a Type-C port before submitting, so names passed over
+ * binder never create lanes of their own.
+ */
+static string executorLaneHelper(const string &portName, const char *operationClass) {
+    return portName + ":" + operationClass;
+}
 
 ScopedAStatus Usb::enableUsbData(const string& in_portName, bool in_enable,
         int64_t in_transactionId) {
+    if (getTypeCPortPaths(in_portName) == NULL ||
+        !mExecutor.submit(executorLaneHelper(in_portName, kLaneData), "enableUsbData",
+                          [this, in_portName, in_enable, in_transactionId] {
+        executeEnableUsbData(in_portName, in_enable, in_transactionId);
+    })) {
+        mCallbackDispatcher.post("notifyEnableUsbDataStatus",
+                                 [=](const shared_ptr<IUsbCallback> &callback) {
+            return callback->notifyEnableUsbDataStatus(in_portName, in_enable, Status::ERROR,
+                                                       in_transactionId);
+        });
+    }
+
+    return ScopedAStatus::ok();
+}
+
+void Usb::executeEnableUsbData(const string& in_portName, bool in_enable,
+        int64_t in_transactionId) {
     bool result = true;
     std::vector<PortStatus> currentPortStatus;
     string displayPortPartnerPath;
@@ -139,33 +352,33 @@ ScopedAStatus Usb::enableUsbData(const string& in_portName, bool in_enable,
     ALOGI("Userspace turn %s USB data signaling. opID:%ld", in_enable ? "on" : "off",
             in_transactionId);
 
+    /*
+     * The data path writes are required and rolled back together when one fails, so the port is
+     * never left half disabled. DisplayPort Alt Mode is best effort as before.
+     */
     if (in_enable) {
         if (!mUsbDataEnabled) {
-            if (!WriteStringToFile("1", USB_DATA_PATH)) {
-                ALOGE("Not able to turn on usb connection notification");
-                result = false;
-            }
-
-            if (!WriteStringToFile(kGadgetName, PULLUP_PATH)) {
-                ALOGE("Gadget cannot be pulled up");
-                result = false;
-            }
-
-            if (!WriteStringToFile("1", DISPLAYPORT_ACTIVE_PATH)) {
-                ALOGE("Failed to enable DisplayPort Alt Mode on port");
-            } else {
-                ALOGI("Successfully enabled DisplayPort Alt Mode on port");
-            }
+            SysfsWriteBatch batch("enableUsbData(on)");
+            size_t portStep, partnerStep = SIZE_MAX;
 
+            batch.add(sysfsPath(USB_DATA_PATH), "1", 0, "0");
+            batch.add(sysfsPath(PULLUP_PATH), kGadgetName, SYSFS_WRITE_UNCACHED, "none");
+            portStep = batch.add(sysfsPath(DISPLAYPORT_ACTIVE_PATH), "1", SYSFS_WRITE_OPTIONAL);
             if (getDisplayPortUsbPathHelper(&displayPortPartnerPath) == Status::SUCCESS) {
                 size_t pos = displayPortPartnerPath.find("/displayport");
                 if (pos != string::npos) {
                     displayPortPartnerPath = displayPortPartnerPath.substr(0, pos) + "/mode1/active";
                 }
-                if (!WriteStringToFile("1", displayPortPartnerPath)) {
-                    ALOGE("Failed to enable DisplayPort Alt Mode on partner at %s",
-                            displayPortPartnerPath.c_str());
-                } else {
+                partnerStep = batch.add(displayPortPartnerPath, "1",
+                                        SYSFS_WRITE_OPTIONAL | SYSFS_WRITE_UNCACHED);
+            }
+
+            result = batch.commit();
+            sUsbDataBatchLatency.record(batch.elapsedUs());
+            if (result) {
+                ALOGI("%s DisplayPort Alt Mode on port",
+                      batch.succeeded(portStep) ? "Successfully enabled" : "Failed to enable");
+                if (partnerStep != SIZE_MAX && batch.succeeded(partnerStep)) {
                     ALOGI("Successfully enabled DisplayPort Alt Mode on partner at %s",
                             displayPortPartnerPath.c_str());
                     setupDisplayPortPoll();
@@ -173,68 +386,67 @@ ScopedAStatus Usb::enableUsbData(const string& in_portName, bool in_enable,
             }
         }
     } else {
-        if (!WriteStringToFile("1", ID_PATH)) {
-            ALOGE("Not able to turn off host mode");
-            result = false;
-        }
-
-        if (!WriteStringToFile("0", VBUS_PATH)) {
-            ALOGE("Not able to set Vbus state");
-            result = false;
-        }
-
-        if (!WriteStringToFile("0", USB_DATA_PATH)) {
-            ALOGE("Not able to turn off usb connection notification");
-            result = false;
-        }
-
-        if (!WriteStringToFile("none", PULLUP_PATH)) {
-            ALOGE("Gadget cannot be pulled down");
-            result = false;
-        }
+        SysfsWriteBatch batch("enableUsbData(off)");
+        size_t portStep, partnerStep = SIZE_MAX;
 
+        batch.add(sysfsPath(ID_PATH), "1");
+        batch.add(sysfsPath(VBUS_PATH), "0");
+        batch.add(sysfsPath(USB_DATA_PATH), "0", 0, "1");
+        batch.add(sysfsPath(PULLUP_PATH), "none", SYSFS_WRITE_UNCACHED);
         if (getDisplayPortUsbPathHelper(&displayPortPartnerPath) == Status::SUCCESS) {
             size_t pos = displayPortPartnerPath.find("/displayport");
             if (pos != string::npos) {
                 displayPortPartnerPath = displayPortPartnerPath.substr(0, pos) + "/mode1/active";
             }
-            if (!WriteStringToFile("0", displayPortPartnerPath)) {
-                ALOGE("Failed to disable DisplayPort Alt Mode on partner at %s",
-                        displayPortPartnerPath.c_str());
-            } else {
+            partnerStep = batch.add(displayPortPartnerPath, "0",
+                                    SYSFS_WRITE_OPTIONAL | SYSFS_WRITE_UNCACHED);
+        }
+        portStep = batch.add(sysfsPath(DISPLAYPORT_ACTIVE_PATH), "0", SYSFS_WRITE_OPTIONAL);
+
+        result = batch.commit();
+        sUsbDataBatchLatency.record(batch.elapsedUs());
+        if (result) {
+            if (partnerStep != SIZE_MAX && batch.succeeded(partnerStep)) {
                 ALOGI("Successfully disabled DisplayPort Alt Mode on partner at %s",
                         displayPortPartnerPath.c_str());
                 shutdownDisplayPortPoll(true);
             }
-        }
-
-        if (!WriteStringToFile("0", DISPLAYPORT_ACTIVE_PATH)) {
-            ALOGE("Failed to disable DisplayPort Alt Mode on port");
-        } else {
-            ALOGI("Successfully disabled DisplayPort Alt Mode on port");
+            ALOGI("%s DisplayPort Alt Mode on port",
+                  batch.succeeded(portStep) ? "Successfully disabled" : "Failed to disable");
         }
     }
 
     if (result) {
         mUsbDataEnabled = in_enable;
     }
-    pthread_mutex_lock(&mLock);
-    if (mCallback != NULL) {
-        ScopedAStatus ret = mCallback->notifyEnableUsbDataStatus(
+    mCallbackDispatcher.post("notifyEnableUsbDataStatus",
+                             [=](const shared_ptr<IUsbCallback> &callback) {
+        return callback->notifyEnableUsbDataStatus(
             in_portName, in_enable, result ? Status::SUCCESS : Status::ERROR, in_transactionId);
-        if (!ret.isOk())
-            ALOGE("notifyEnableUsbDataStatus error %s", ret.getDescription().c_str());
-    } else {
-        ALOGE("Not notifying the userspace. Callback is not set");
-    }
-    pthread_mutex_unlock(&mLock);
+    });
     queryVersionHelper(this, &currentPortStatus);
 
-    return ScopedAStatus::ok();
 }
 
 ScopedAStatus Usb::enableUsbDataWhileDocked(const string& in_portName,
         int64_t in_transactionId) {
+    if (getTypeCPortPaths(in_portName) == NULL ||
+        !mExecutor.submit(executorLaneHelper(in_portName, kLaneData), "enableUsbDataWhileDocked",
+                          [this, in_portName, in_transactionId] {
+        executeEnableUsbDataWhileDocked(in_portName, in_transactionId);
+    })) {
+        mCallbackDispatcher.post("notifyEnableUsbDataWhileDockedStatus",
+                                 [=](const shared_ptr<IUsbCallback> &callback) {
+            return callback->notifyEnableUsbDataWhileDockedStatus(in_portName, Status::ERROR,
+                                                                  in_transactionId);
+        });
+    }
+
+    return ScopedAStatus::ok();
+}
+
+void Usb::executeEnableUsbDataWhileDocked(const string& in_portName,
+        int64_t in_transactionId) {
     bool success = true;
     bool notSupported = true;
     std::vector<PortStatus> currentPortStatus;
@@ -242,7 +454,7 @@ ScopedAStatus Usb::enableUsbDataWhileDocked(const string& in_portName,
     ALOGI("Userspace enableUsbDataWhileDocked  opID:%ld", in_transactionId);
 
     int flags = O_RDONLY;
-    ::android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(kPogoEnableUsb, flags)));
+    ::android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(kPogoEnableUsb.c_str(), flags)));
     if (fd != -1) {
         notSupported = false;
         success = WriteStringToFile("1", kPogoEnableUsb);
@@ -251,45 +463,49 @@ ScopedAStatus Usb::enableUsbDataWhileDocked(const string& in_portName,
         }
     }
 
-    pthread_mutex_lock(&mLock);
-    if (mCallback != NULL) {
-        ScopedAStatus ret = mCallback->notifyEnableUsbDataWhileDockedStatus(
+    mCallbackDispatcher.post("notifyEnableUsbDataWhileDockedStatus",
+                             [=](const shared_ptr<IUsbCallback> &callback) {
+        return callback->notifyEnableUsbDataWhileDockedStatus(
                 in_portName, notSupported ? Status::NOT_SUPPORTED :
                 success ? Status::SUCCESS : Status::ERROR, in_transactionId);
-        if (!ret.isOk())
-            ALOGE("notifyEnableUsbDataStatus error %s", ret.getDescription().c_str());
-    } else {
-        ALOGE("Not notifying the userspace. Callback is not set");
-    }
-    pthread_mutex_unlock(&mLock);
+    });
     queryVersionHelper(this, &currentPortStatus);
 
-    return ScopedAStatus::ok();
 }
 
 ScopedAStatus Usb::resetUsbPort(const std::string& in_portName, int64_t in_transactionId) {
+    if (getTypeCPortPaths(in_portName) == NULL ||
+        !mExecutor.submit(executorLaneHelper(in_portName, kLaneData), "resetUsbPort",
+                          [this, in_portName, in_transactionId] {
+        executeResetUsbPort(in_portName, in_transactionId);
+    })) {
+        mCallbackDispatcher.post("notifyResetUsbPortStatus",
+                                 [=](const shared_ptr<IUsbCallback> &callback) {
+            return callback->notifyResetUsbPortStatus(in_portName, Status::ERROR,
+                                                      in_transactionId);
+        });
+    }
+
+    return ::ndk::ScopedAStatus::ok();
+}
+
+void Usb::executeResetUsbPort(const std::string& in_portName, int64_t in_transactionId) {
     bool result = true;
     std::vector<PortStatus> currentPortStatus;
 
     ALOGI("Userspace reset USB Port. opID:%ld", in_transactionId);
 
-    if (!WriteStringToFile("none", PULLUP_PATH)) {
+    if (!WriteStringToFile("none", sysfsPath(PULLUP_PATH))) {
         ALOGI("Gadget cannot be pulled down");
         result = false;
     }
 
-    pthread_mutex_lock(&mLock);
-    if (mCallback != NULL) {
-        ::ndk::ScopedAStatus ret = mCallback->notifyResetUsbPortStatus(
+    mCallbackDispatcher.post("notifyResetUsbPortStatus",
+                             [=](const shared_ptr<IUsbCallback> &callback) {
+        return callback->notifyResetUsbPortStatus(
             in_portName, result ? Status::SUCCESS : Status::ERROR, in_transactionId);
-        if (!ret.isOk())
-            ALOGE("notifyTransactionStatus error %s", ret.getDescription().c_str());
-    } else {
-        ALOGE("Not notifying the userspace. Callback is not set");
-    }
-    pthread_mutex_unlock(&mLock);
+    });
 
-    return ::ndk::ScopedAStatus::ok();
 }
 
 Status queryMoistureDetectionStatus(android::hardware::usb::Usb *usb,
@@ -305,7 +521,7 @@ Status queryMoistureDetectionStatus(android::hardware::usb::Usb *usb,
 
     if (usb->mI2cClientPath.empty()) {
         for (int i = 0; i < NUM_HSI2C_PATHS; i++) {
-            usb->mI2cClientPath = getI2cClientPath(kHsi2cPaths[i], kTcpcDevName, kI2cClientId);
+            usb->mI2cClientPath = getI2cClientPath(sysfsPath(kHsi2cPaths[i]), kTcpcDevName, kI2cClientId);
             if (usb->mI2cClientPath.empty()) {
                 ALOGE("%s: Unable to locate i2c bus node", __func__);
             } else {
@@ -339,55 +555,47 @@ Status queryMoistureDetectionStatus(android::hardware::usb::Usb *usb,
         }
     }
 
-    ALOGI("ContaminantDetectionStatus:%d ContaminantProtectionStatus:%d",
-            (*currentPortStatus)[0].contaminantDetectionStatus,
-            (*currentPortStatus)[0].contaminantProtectionStatus);
+    USB_LOGI_RATELIMITED("ContaminantDetectionStatus:%d ContaminantProtectionStatus:%d",
+                         (*currentPortStatus)[0].contaminantDetectionStatus,
+                         (*currentPortStatus)[0].contaminantProtectionStatus);
 
     return Status::SUCCESS;
 }
 
 Status queryNonCompliantChargerStatus(std::vector<PortStatus> *currentPortStatus) {
-    string reasons, path;
+    string reasons;
 
     for (int i = 0; i < currentPortStatus->size(); i++) {
+        std::vector<ComplianceWarning> &warnings = (*currentPortStatus)[i].complianceWarnings;
+
         (*currentPortStatus)[i].supportsComplianceWarnings = true;
-        path = string(kTypecPath) + "/" + (*currentPortStatus)[i].portName + "/" +
-                string(kComplianceWarningsPath);
-        if (ReadFileToString(path.c_str(), &reasons)) {
-            std::vector<string> reasonsList = Tokenize(reasons.c_str(), "[], \n\0");
-            for (string reason : reasonsList) {
-                if (!strncmp(reason.c_str(), kComplianceWarningDebugAccessory,
-                            strlen(kComplianceWarningDebugAccessory))) {
-                    (*currentPortStatus)[i].complianceWarnings.push_back(ComplianceWarning::DEBUG_ACCESSORY);
-                    continue;
-                }
-                if (!strncmp(reason.c_str(), kComplianceWarningBC12,
-                            strlen(kComplianceWarningBC12))) {
-                    (*currentPortStatus)[i].complianceWarnings.push_back(ComplianceWarning::BC_1_2);
-                    continue;
-                }
-                if (!strncmp(reason.c_str(), kComplianceWarningMissingRp,
-                            strlen(kComplianceWarningMissingRp))) {
-                    (*currentPortStatus)[i].complianceWarnings.push_back(ComplianceWarning::MISSING_RP);
-                    continue;
-                }
-                if (!strncmp(reason.c_str(), kComplianceWarningOther,
-                             strlen(kComplianceWarningOther)) ||
-                    !strncmp(reason.c_str(), kComplianceWarningInputPowerLimited,
-                             strlen(kComplianceWarningInputPowerLimited))) {
-                    if (usb_flags::enable_usb_data_compliance_warning() &&
-                        usb_flags::enable_input_power_limited_warning()) {
-                        ALOGI("Report through INPUT_POWER_LIMITED warning");
-                        (*currentPortStatus)[i].complianceWarnings.push_back(
-                            ComplianceWarning::INPUT_POWER_LIMITED);
-                        continue;
-                    } else {
-                        (*currentPortStatus)[i].complianceWarnings.push_back(
-                            ComplianceWarning::OTHER);
-                        continue;
-                    }
+        const TypeCPortPaths *paths = getTypeCPortPaths((*currentPortStatus)[i].portName);
+        if (paths != NULL && ReadFileToString(paths->complianceWarnings.c_str(), &reasons)) {
+            forEachSysfsToken(reasons, [&warnings](std::string_view reason) {
+                switch (parseNonCompliantReason(reason)) {
+                    case NonCompliantReason::DEBUG_ACCESSORY:
+                        warnings.push_back(ComplianceWarning::DEBUG_ACCESSORY);
+                        break;
+                    case NonCompliantReason::BC12:
+                        warnings.push_back(ComplianceWarning::BC_1_2);
+                        break;
+                    case NonCompliantReason::MISSING_RP:
+                        warnings.push_back(ComplianceWarning::MISSING_RP);
+                        break;
+                    case NonCompliantReason::OTHER:
+                    case NonCompliantReason::INPUT_POWER_LIMITED:
+                        if (usb_flags::enable_usb_data_compliance_warning() &&
+                            usb_flags::enable_input_power_limited_warning()) {
+                            ALOGI("Report through INPUT_POWER_LIMITED warning");
+                            warnings.push_back(ComplianceWarning::INPUT_POWER_LIMITED);
+                        } else {
+                            warnings.push_back(ComplianceWarning::OTHER);
+                        }
+                        break;
+                    case NonCompliantReason::UNKNOWN:
+                        break;
                 }
-            }
+            });
             if ((*currentPortStatus)[i].complianceWarnings.size() > 0 &&
                  (*currentPortStatus)[i].currentPowerRole == PortPowerRole::NONE) {
                 (*currentPortStatus)[i].currentMode = PortMode::UFP;
@@ -401,21 +609,23 @@ Status queryNonCompliantChargerStatus(std::vector<PortStatus> *currentPortStatus
 }
 
 string appendRoleNodeHelper(const string &portName, PortRole::Tag tag) {
-    string node("/sys/class/typec/" + portName);
+    const TypeCPortPaths *paths = getTypeCPortPaths(portName);
 
+    if (paths == NULL)
+        return "";
     switch (tag) {
         case PortRole::dataRole:
-            return node + "/data_role";
+            return paths->dataRole;
         case PortRole::powerRole:
-            return node + "/power_role";
+            return paths->powerRole;
         case PortRole::mode:
-            return node + "/port_type";
+            return paths->portType;
         default:
             return "";
     }
 }
 
-string convertRoletoString(PortRole role) {
+const char *convertRoletoString(PortRole role) {
     if (role.getTag() == PortRole::powerRole) {
         if (role.get<PortRole::powerRole>() == PortPowerRole::SOURCE)
             return "source";
@@ -435,14 +645,93 @@ string convertRoletoString(PortRole role) {
     return "none";
 }
 
-void extractRole(string *roleName) {
-    std::size_t first, last;
+/*
+ * Returns true when the bracketed value of a role attribute, e.g. "[host] device", matches
+ * role.
+ */
+static bool roleAttributeMatches(const char *contents, const string &role) {
+    std::string_view value(contents);
+
+    return value.find('[') != std::string_view::npos && selectedSysfsValue(value) == role;
+}
+
+/*
+ * Writes role to the data_role or power_role attribute at path. A write that fails with
+ * EAGAIN or EBUSY, which the typec class returns while a previous swap is still running, is
+ * retried with an exponential backoff timed by a timerfd. Success is reported as soon as the
+ * attribute reflects the new role; the attribute is watched with EPOLLPRI since the typec class
+ * notifies it on every role change.
+ */
+static bool writeRoleHelper(const string &path, const string &role) {
+    int delayMs = GetIntProperty(kRoleSwapRetryInitialMs, ROLE_SWAP_RETRY_INITIAL_MS);
+    int maxAttempts = GetIntProperty(kRoleSwapRetryMaxAttempts, ROLE_SWAP_RETRY_MAX_ATTEMPTS);
+    int confirmMs = GetIntProperty(kRoleSwapConfirmTimeoutMs, ROLE_SWAP_CONFIRM_TIMEOUT_MS);
+    char contents[64];
+    struct timespec start;
+    ssize_t ret;
+
+    unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDWR | O_CLOEXEC)));
+    if (fd.get() == -1) {
+        ALOGE("open %s failed; errno=%d", path.c_str(), errno);
+        return false;
+    }
+
+    for (int attempt = 0;; attempt++) {
+        ret = TEMP_FAILURE_RETRY(pwrite(fd.get(), role.c_str(), role.length(), 0));
+        if (ret == (ssize_t)role.length())
+            break;
+        if ((errno != EAGAIN && errno != EBUSY) || attempt >= maxAttempts) {
+            ALOGE("failed to write %s to %s; errno=%d", role.c_str(), path.c_str(), errno);
+            return false;
+        }
+
+        ALOGI("role switch busy, retry in %d ms", delayMs);
+        unique_fd timerFd(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC));
+        struct itimerspec ts = itimerspec();
+        uint64_t expirations;
+
+        ts.it_value.tv_sec = delayMs / 1000;
+        ts.it_value.tv_nsec = (delayMs % 1000) * 1000000;
+        if (timerFd.get() == -1 || timerfd_settime(timerFd.get(), 0, &ts, NULL) == -1 ||
+            TEMP_FAILURE_RETRY(read(timerFd.get(), &expirations, sizeof(expirations))) <= 0) {
+            ALOGE("role switch backoff timer failed; errno=%d", errno);
+            return false;
+        }
+        delayMs *= 2;
+    }
+
+    unique_fd epollFd(epoll_create1(EPOLL_CLOEXEC));
+    struct epoll_event ev;
+
+    ev.events = EPOLLPRI;
+    ev.data.fd = fd.get();
+    if (epollFd.get() == -1 || epoll_ctl(epollFd.get(), EPOLL_CTL_ADD, fd.get(), &ev) == -1) {
+        ALOGE("epoll setup for %s failed; errno=%d", path.c_str(), errno);
+        return false;
+    }
 
-    first = roleName->find("[");
-    last = roleName->find("]");
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (true) {
+        struct timespec now;
+        int remainingMs;
+
+        ret = TEMP_FAILURE_RETRY(pread(fd.get(), contents, sizeof(contents) - 1, 0));
+        if (ret > 0) {
+            contents[ret] = '\0';
+            if (roleAttributeMatches(contents, role)) {
+                ALOGI("written: %s", role.c_str());
+                return true;
+            }
+        }
 
-    if (first != string::npos && last != string::npos) {
-        *roleName = roleName->substr(first + 1, last - first - 1);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        remainingMs = confirmMs - ((now.tv_sec - start.tv_sec) * 1000 +
+                                   (now.tv_nsec - start.tv_nsec) / 1000000);
+        if (remainingMs <= 0 ||
+            TEMP_FAILURE_RETRY(epoll_wait(epollFd.get(), &ev, 1, remainingMs)) <= 0) {
+            ALOGE("Role switch failed, %s reads %s", path.c_str(), ret > 0 ? contents : "");
+            return false;
+        }
     }
 }
 
@@ -465,11 +754,14 @@ void switchToDrp(const string &portName) {
     }
 }
 
-bool switchMode(const string &portName, const PortRole &in_role, struct Usb *usb) {
+/*
+ * Writes the requested port type and returns without waiting for the port to settle.
+ * Completion is tracked by Usb::mPendingRoleSwitch.
+ */
+bool switchMode(const string &portName, const PortRole &in_role) {
     string filename = appendRoleNodeHelper(string(portName.c_str()), in_role.getTag());
-    string written;
     FILE *fp;
-    bool roleSwitch = false;
+    int ret = EOF;
 
     if (filename == "") {
         ALOGE("Fatal: invalid node type");
@@ -478,44 +770,16 @@ bool switchMode(const string &portName, const PortRole &in_role, struct Usb *usb
 
     fp = fopen(filename.c_str(), "w");
     if (fp != NULL) {
-        // Hold the lock here to prevent loosing connected signals
-        // as once the file is written the partner added signal
-        // can arrive anytime.
-        pthread_mutex_lock(&usb->mPartnerLock);
-        usb->mPartnerUp = false;
-        int ret = fputs(convertRoletoString(in_role).c_str(), fp);
+        ret = fputs(convertRoletoString(in_role), fp);
         fclose(fp);
-
-        if (ret != EOF) {
-            struct timespec to;
-            struct timespec now;
-
-        wait_again:
-            clock_gettime(CLOCK_MONOTONIC, &now);
-            to.tv_sec = now.tv_sec + PORT_TYPE_TIMEOUT;
-            to.tv_nsec = now.tv_nsec;
-
-            int err = pthread_cond_timedwait(&usb->mPartnerCV, &usb->mPartnerLock, &to);
-            // There are no uevent signals which implies role swap timed out.
-            if (err == ETIMEDOUT) {
-                ALOGI("uevents wait timedout");
-                // Validity check.
-            } else if (!usb->mPartnerUp) {
-                goto wait_again;
-                // Role switch succeeded since usb->mPartnerUp is true.
-            } else {
-                roleSwitch = true;
-            }
-        } else {
-            ALOGI("Role switch failed while wrting to file");
-        }
-        pthread_mutex_unlock(&usb->mPartnerLock);
     }
 
-    if (!roleSwitch)
-        switchToDrp(string(portName.c_str()));
+    if (ret == EOF) {
+        ALOGI("Role switch failed while wrting to file");
+        return false;
+    }
 
-    return roleSwitch;
+    return true;
 }
 
 void updatePortStatus(android::hardware::usb::Usb *usb) {
@@ -524,68 +788,226 @@ void updatePortStatus(android::hardware::usb::Usb *usb) {
     queryVersionHelper(usb, &currentPortStatus);
 }
 
-static int usbDeviceRemoved(const char *devname, void* client_data) {
-    return 0;
+Status Usb::loadUsbHubProfiles(string *error) {
+    std::vector<UsbHubProfile> profiles;
+    string config;
+    bool malformed;
+
+    // A missing file only leaves the built-in profiles
+    malformed = ReadFileToString(USB_HUB_PROFILES_PATH, &config) &&
+                !parseUsbHubProfiles(config, &profiles, error);
+    if (malformed) {
+        pthread_mutex_lock(&mUsbHubProfilesLock);
+        bool loaded = !mUsbHubProfiles.empty();
+        pthread_mutex_unlock(&mUsbHubProfilesLock);
+        if (loaded)
+            return Status::ERROR;
+    }
+
+    // The vendor cmd only applies to USB Hubs of Genesys Logic, Inc. by default.
+    // The request field of vendor cmd is fixed to 0xe3.
+    for (const UsbHubId &id : kUsbHubIds) {
+        bool configured = false;
+
+        for (const UsbHubProfile &profile : profiles) {
+            if (profile.id.vendorId == id.vendorId && profile.id.productId == id.productId)
+                configured = true;
+        }
+        if (!configured) {
+            profiles.push_back({kUsbHubDefaultProfileName, id,
+                                {{USB_DIR_OUT | USB_TYPE_VENDOR, GL852G_VENDOR_CMD_REQ,
+                                  static_cast<uint16_t>(mUsbHubVendorCmdValue),
+                                  static_cast<uint16_t>(mUsbHubVendorCmdIndex)}}});
+        }
+    }
+
+    pthread_mutex_lock(&mUsbHubProfilesLock);
+    mUsbHubProfiles = std::move(profiles);
+    pthread_mutex_unlock(&mUsbHubProfilesLock);
+    return malformed ? Status::ERROR : Status::SUCCESS;
 }
 
-static int usbDeviceAdded(const char *devname, void* client_data) {
-    uint16_t vendorId, productId;
-    struct usb_device *device;
-    ::aidl::android::hardware::usb::Usb *usb;
-    int value, index;
+bool Usb::findUsbHubProfile(UsbHubId id, UsbHubProfile *profile) {
+    bool found = false;
 
-    device = usb_device_open(devname);
-    if (!device) {
-        ALOGE("usb_device_open failed\n");
-        return 0;
+    pthread_mutex_lock(&mUsbHubProfilesLock);
+    for (const UsbHubProfile &entry : mUsbHubProfiles) {
+        if (entry.id.vendorId == id.vendorId && entry.id.productId == id.productId) {
+            if (profile)
+                *profile = entry;
+            found = true;
+            break;
+        }
     }
+    pthread_mutex_unlock(&mUsbHubProfilesLock);
+    return found;
+}
 
-    usb = (::aidl::android::hardware::usb::Usb *)client_data;
-    value = usb->mUsbHubVendorCmdValue;
-    index = usb->mUsbHubVendorCmdIndex;
+void Usb::recordUsbHubProfile(const string &name, bool success, int64_t elapsedUs) {
+    pthread_mutex_lock(&mUsbHubProfilesLock);
+    UsbHubProfileStats &stats = mUsbHubProfileStats[name];
+    if (success)
+        stats.applied++;
+    else
+        stats.failed++;
+    stats.lastUs = elapsedUs;
+    stats.maxUs = std::max(stats.maxUs, elapsedUs);
+    pthread_mutex_unlock(&mUsbHubProfilesLock);
+}
 
-    // The vendor cmd only applies to USB Hubs of Genesys Logic, Inc.
-    // The request field of vendor cmd is fixed to 0xe3.
-    vendorId = usb_device_get_vendor_id(device);
-    productId = usb_device_get_product_id(device);
-    if (vendorId == GL852G_VENDOR_ID &&
-        (productId == GL852G_PRODUCT_ID1 || productId == GL852G_PRODUCT_ID2)) {
-        int ret = usb_device_control_transfer(device,
-            USB_DIR_OUT | USB_TYPE_VENDOR, GL852G_VENDOR_CMD_REQ, value, index,
-            NULL, 0, CTRL_TRANSFER_TIMEOUT_MSEC);
-        ALOGI("USB hub vendor cmd %s (wValue 0x%x, wIndex 0x%x, return %d)\n",
-                ret? "failed" : "succeeded", value, index, ret);
+/*
+ * Applies the profile of a matched hub. Runs on a thread of its own so the retries and the
+ * control transfer timeouts never delay the matching of other devices.
+ */
+static void usbHubMatched(::aidl::android::hardware::usb::Usb *usb, const string &devname,
+                          UsbHubId id) {
+    struct usb_device *device = NULL;
+    UsbHubProfile profile;
+    bool success = true;
+
+    // The profiles may have been reloaded since the match
+    if (!usb->findUsbHubProfile(id, &profile))
+        return;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < USB_HUB_OPEN_RETRIES && !device; i++) {
+        if (i)
+            usleep(USB_HUB_OPEN_RETRY_MS * 1000);
+        device = usb_device_open(devname.c_str());
+    }
+    if (!device) {
+        ALOGE("usb_device_open %s failed\n", devname.c_str());
+        usb->recordUsbHubProfile(profile.name, false, 0);
+        return;
     }
 
+    for (const UsbHubCommand &command : profile.commands) {
+        int ret = usb_device_control_transfer(device, command.requestType, command.request,
+                                              command.value, command.index, NULL, 0,
+                                              CTRL_TRANSFER_TIMEOUT_MSEC);
+        if (ret) {
+            ALOGE("USB hub %s cmd failed (bRequest 0x%x, wValue 0x%x, wIndex 0x%x, return %d)\n",
+                  profile.name.c_str(), command.request, command.value, command.index, ret);
+            success = false;
+        }
+    }
     usb_device_close(device);
 
-    return 0;
+    int64_t elapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    usb->recordUsbHubProfile(profile.name, success, elapsedUs);
+    ALOGI("USB hub %04x:%04x profile %s %s, %zu cmds in %" PRId64 " us\n", id.vendorId,
+          id.productId, profile.name.c_str(), success ? "succeeded" : "failed",
+          profile.commands.size(), elapsedUs);
 }
 
 void *usbHostWork(void *param) {
-    struct usb_host_context *ctx;
+    ::aidl::android::hardware::usb::Usb *usb = (::aidl::android::hardware::usb::Usb *)param;
+    string error;
 
     ALOGI("creating USB host thread\n");
 
-    ctx = usb_host_init();
-    if (!ctx) {
-        ALOGE("usb_host_init failed\n");
+    if (usb->loadUsbHubProfiles(&error) != Status::SUCCESS)
+        ALOGE("malformed %s, using built-in hub profiles: %s", USB_HUB_PROFILES_PATH,
+              error.c_str());
+
+    UsbHubMatcher matcher({kUsbHostDevpathPrefix},
+                          [usb](UsbHubId id) { return usb->findUsbHubProfile(id, NULL); },
+                          [usb](const string &devname, UsbHubId id) {
+                              usbHubMatched(usb, devname, id);
+                          });
+    // This only returns if the uevent subscription fails
+    matcher.run();
+
+    return NULL;
+}
+
+// Returns the CRITICAL trip of the trip zone, falling back to USB_THERMAL_TRIP_PROPERTY
+static int thermalTripDeciCHelper() {
+    string zonePath = findThermalZonePath(kThermalZoneForTrip);
+    int tripDeciC;
+
+    if (!zonePath.empty() && readThermalZoneDeciC(zonePath + "trip_point_0_temp", &tripDeciC))
+        return tripDeciC;
+    return GetIntProperty(USB_THERMAL_TRIP_PROPERTY, 0);
+}
+
+/*
+ * Closed loop USB thermal controller, started when USB_THERMAL_CONTROL_PROPERTY is set. Samples
+ * the hottest of the overheat read zones at the interval the controller picks and steps the sink
+ * current limit ahead of the CRITICAL trip handled by mOverheat.
+ */
+void *usbThermalWork(void *param) {
+    ::aidl::android::hardware::usb::Usb *usb = (::aidl::android::hardware::usb::Usb *)param;
+    std::vector<string> tempPaths;
+    int tripDeciC;
+
+    pthread_setname_np(pthread_self(), "usb-thermal");
+    tripDeciC = thermalTripDeciCHelper();
+    if (tripDeciC <= 0) {
+        ALOGE("usb thermal: no trip temperature, controller disabled");
         return NULL;
     }
+    for (const char *zone : {kThermalZoneForTempReadPrimary, kThermalZoneForTempReadSecondary1,
+                             kThermalZoneForTempReadSecondary2}) {
+        string zonePath = findThermalZonePath(zone);
+        if (!zonePath.empty())
+            tempPaths.push_back(zonePath + "temp");
+    }
+    if (tempPaths.empty()) {
+        ALOGE("usb thermal: no temperature zone, controller disabled");
+        return NULL;
+    }
+
+    UsbThermalController controller(defaultUsbThermalConfig(tripDeciC));
+    usb->mThermalTripDeciC = tripDeciC;
+    ALOGI("usb thermal: controller started, trip %d dC", tripDeciC);
 
-    // This will never return, it will keep monitoring USB sysfs inotify events
-    usb_host_run(ctx, usbDeviceAdded, usbDeviceRemoved, NULL, param);
+    while (true) {
+        int temperatureDeciC = INT_MIN;
+        int sampleMs = controller.config().normalSampleMs;
+
+        for (const string &path : tempPaths) {
+            int zoneDeciC;
+            if (readThermalZoneDeciC(path, &zoneDeciC))
+                temperatureDeciC = std::max(temperatureDeciC, zoneDeciC);
+        }
+
+        if (temperatureDeciC != INT_MIN) {
+            UsbThermalController::Decision decision =
+                    controller.update(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                              std::chrono::steady_clock::now().time_since_epoch())
+                                              .count(),
+                                      temperatureDeciC);
+
+            sThermalSamples.add();
+            usb->mThermalTemperatureDeciC = temperatureDeciC;
+            usb->mThermalSlopeDeciCPerMin = decision.slopeDeciCPerMin;
+            usb->mThermalLevel = decision.level;
+            usb->mThermalSampleMs = decision.nextSampleMs;
+            if (decision.changed) {
+                ALOGI("usb thermal: %d dC slope %d dC/min, level %d", temperatureDeciC,
+                      decision.slopeDeciCPerMin, decision.level);
+            }
+            usb->applyThermalSinkLimit(decision.sinkCurrentMa);
+            sampleMs = decision.nextSampleMs;
+        }
+        usleep(sampleMs * 1000);
+    }
 
     return NULL;
 }
 
 Usb::Usb()
-    : mLock(PTHREAD_MUTEX_INITIALIZER),
+    : mCallbackDispatcher(&sCallbackLatency, &sCallbackQueueLatency, &sCallbackDropped),
+      mStatsReporter(&sStatsReportDropped),
+      mExecutor(&sExecutorLatency, &sExecutorQueueLatency, &sExecutorRejected),
+      mLock(PTHREAD_MUTEX_INITIALIZER),
       mRoleSwitchLock(PTHREAD_MUTEX_INITIALIZER),
-      mPartnerLock(PTHREAD_MUTEX_INITIALIZER),
-      mPartnerUp(false),
-      mUsbDataSessionMonitor(kUdcUeventRegex, kUdcStatePath, kHost1UeventRegex, kHost1StatePath,
-                             kHost2UeventRegex, kHost2StatePath, kDataRolePath,
+      mPortStateLock(PTHREAD_MUTEX_INITIALIZER),
+      mUsbDataSessionMonitor(kUdcUeventRegex, sysfsPath(kUdcStatePath), kHost1UeventRegex,
+                             sysfsPath(kHost1StatePath), kHost2UeventRegex,
+                             sysfsPath(kHost2StatePath), sysfsPath(kDataRolePath),
                              std::bind(&updatePortStatus, this)),
       mOverheat(ZoneInfo(TemperatureType::USB_PORT, kThermalZoneForTrip,
                          ThrottlingSeverity::CRITICAL),
@@ -597,31 +1019,35 @@ Usb::Usb()
                           ThrottlingSeverity::NONE)}, kSamplingIntervalSec),
       mUsbDataEnabled(true),
       mI2cClientPath(""),
-      mDisplayPortPollRunning(false),
-      mDisplayPortPollStarting(false),
-      mDisplayPortCVLock(PTHREAD_MUTEX_INITIALIZER),
+      mDisplayPortArmed(false),
+      mDisplayPortFirstSetupDone(false),
+      mDisplayPortRequests(0),
+      mDisplayPortRequestLock(PTHREAD_MUTEX_INITIALIZER),
+      mDisplayPortHpdLatencyLastMs(0),
+      mDisplayPortHpdLatencyMaxMs(0),
+      mDisplayPortHpdLatencyCount(0),
+      mDisplayPortEarlyUpdateCount(0),
+      mDisplayPortStormBackoffCount(0),
+      mDisplayPortDebounceWindowMs(DISPLAYPORT_STATUS_DEBOUNCE_MS),
+      mPartnerAltModesValid(false),
+      mPartnerAltModesTracked(false),
+      mPartnerPresent(false),
+      mPartnerAltModesLock(PTHREAD_MUTEX_INITIALIZER),
       mDisplayPortLock(PTHREAD_MUTEX_INITIALIZER),
+      mPowerTransferLimited(false),
+      mThermalSinkLimitMa(-1),
+      mThermalTemperatureDeciC(0),
+      mThermalSlopeDeciCPerMin(0),
+      mThermalLevel(0),
+      mThermalSampleMs(0),
+      mThermalTripDeciC(0),
       mUsbHubVendorCmdValue(GL852G_VENDOR_CMD_VALUE_DEFAULT),
-      mUsbHubVendorCmdIndex(GL852G_VENDOR_CMD_INDEX_DEFAULT) {
-    pthread_condattr_t attr;
-    if (pthread_condattr_init(&attr)) {
-        ALOGE("pthread_condattr_init failed: %s", strerror(errno));
-        abort();
-    }
-    if (pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)) {
-        ALOGE("pthread_condattr_setclock failed: %s", strerror(errno));
-        abort();
-    }
-    if (pthread_cond_init(&mPartnerCV, &attr)) {
-        ALOGE("pthread_cond_init failed: %s", strerror(errno));
-        abort();
-    }
-    if (pthread_cond_init(&mDisplayPortCV, &attr)) {
-        ALOGE("usbdp: pthread_cond_init failed: %s", strerror(errno));
-        abort();
-    }
-    if (pthread_condattr_destroy(&attr)) {
-        ALOGE("pthread_condattr_destroy failed: %s", strerror(errno));
+      mUsbHubVendorCmdIndex(GL852G_VENDOR_CMD_INDEX_DEFAULT),
+      mUsbHubProfilesLock(PTHREAD_MUTEX_INITIALIZER) {
+    mPendingRoleSwitch.active = false;
+    mRoleSwitchTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (mRoleSwitchTimer == -1) {
+        ALOGE("mRoleSwitchTimer timerfd failed: %s", strerror(errno));
         abort();
     }
     mDisplayPortEventPipe = eventfd(0, EFD_NONBLOCK);
@@ -639,10 +1065,20 @@ Usb::Usb()
         ALOGE("mDisplayPortActivateTimer timerfd failed: %s", strerror(errno));
         abort();
     }
+    if (pthread_create(&mDisplayPortPoll, NULL, displayPortPollWork, this)) {
+        ALOGE("usbdp: displayport handler pthread creation failed %d", errno);
+        abort();
+    }
     if (pthread_create(&mUsbHost, NULL, usbHostWork, this)) {
         ALOGE("pthread creation failed %d\n", errno);
         abort();
     }
+    if (GetBoolProperty(USB_THERMAL_CONTROL_PROPERTY, false) &&
+        pthread_create(&mThermal, NULL, usbThermalWork, this)) {
+        ALOGE("usb thermal pthread creation failed %d\n", errno);
+    }
+
+    sMetrics.startPeriodicPush(&mStatsReporter);
 
     ALOGI("feature flag enable_usb_data_compliance_warning: %d",
           usb_flags::enable_usb_data_compliance_warning());
@@ -652,87 +1088,199 @@ Usb::Usb()
 
 ScopedAStatus Usb::switchRole(const string& in_portName, const PortRole& in_role,
         int64_t in_transactionId) {
+    if (getTypeCPortPaths(in_portName) == NULL ||
+        !mExecutor.submit(executorLaneHelper(in_portName, kLaneRole), "switchRole",
+                          [this, in_portName, in_role, in_transactionId] {
+        executeSwitchRole(in_portName, in_role, in_transactionId);
+    })) {
+        notifyRoleSwitch(in_portName, in_role, Status::ERROR, in_transactionId);
+    }
+
+    return ScopedAStatus::ok();
+}
+
+void Usb::executeSwitchRole(const string& in_portName, const PortRole& in_role,
+        int64_t in_transactionId) {
     string filename = appendRoleNodeHelper(string(in_portName.c_str()), in_role.getTag());
-    string written;
-    FILE *fp;
     bool roleSwitch = false;
 
     if (filename == "") {
         ALOGE("Fatal: invalid node type");
-        return ScopedAStatus::ok();
+        notifyRoleSwitch(in_portName, in_role, Status::ERROR, in_transactionId);
+        return;
+    }
+
+    ALOGI("filename write: %s role:%s", filename.c_str(), convertRoletoString(in_role));
+
+    if (in_role.getTag() == PortRole::mode) {
+        startModeSwitch(in_portName, in_role, in_transactionId);
+        return;
     }
 
     pthread_mutex_lock(&mRoleSwitchLock);
+    roleSwitch = writeRoleHelper(filename, convertRoletoString(in_role));
+    pthread_mutex_unlock(&mRoleSwitchLock);
+    notifyRoleSwitch(in_portName, in_role, roleSwitch ? Status::SUCCESS : Status::ERROR,
+                     in_transactionId);
 
-    ALOGI("filename write: %s role:%s", filename.c_str(), convertRoletoString(in_role).c_str());
+}
 
-    if (in_role.getTag() == PortRole::mode) {
-        roleSwitch = switchMode(in_portName, in_role, this);
-    } else {
-        fp = fopen(filename.c_str(), "w");
-        if (fp != NULL) {
-            int ret = fputs(convertRoletoString(in_role).c_str(), fp);
-            if (ret == EAGAIN) {
-                ALOGI("role switch busy, retry in %d ms", ROLE_SWAP_RETRY_MS);
-                std::this_thread::sleep_for(std::chrono::milliseconds(ROLE_SWAP_RETRY_MS));
-                ret = fputs(convertRoletoString(in_role).c_str(), fp);
-            }
-            fclose(fp);
-            if ((ret != EOF) && ReadFileToString(filename, &written)) {
-                written = Trim(written);
-                extractRole(&written);
-                ALOGI("written: %s", written.c_str());
-                if (written == convertRoletoString(in_role)) {
-                    roleSwitch = true;
-                } else {
-                    ALOGE("Role switch failed");
-                }
-            } else {
-                ALOGE("failed to update the new role");
-            }
-        } else {
-            ALOGE("fopen failed");
+void Usb::notifyRoleSwitch(const string &portName, const PortRole &role, Status status,
+                           int64_t transactionId) {
+    mCallbackDispatcher.post("notifyRoleSwitchStatus",
+                             [=](const shared_ptr<IUsbCallback> &callback) {
+        return callback->notifyRoleSwitchStatus(portName, role, status, transactionId);
+    });
+}
+
+void Usb::startModeSwitch(const string &portName, const PortRole &role, int64_t transactionId) {
+    struct itimerspec ts = itimerspec();
+    struct PendingRoleSwitch superseded;
+    bool written;
+
+    superseded.active = false;
+    pthread_mutex_lock(&mRoleSwitchLock);
+    if (mPendingRoleSwitch.active) {
+        if (mPendingRoleSwitch.portName == portName && mPendingRoleSwitch.role == role) {
+            // Same request is already in flight, report both once it completes.
+            ALOGI("coalescing role switch opID:%ld into pending switch", transactionId);
+            mPendingRoleSwitch.transactionIds.push_back(transactionId);
+            pthread_mutex_unlock(&mRoleSwitchLock);
+            return;
         }
+        superseded = mPendingRoleSwitch;
+        mPendingRoleSwitch.active = false;
     }
 
-    pthread_mutex_lock(&mLock);
-    if (mCallback != NULL) {
-         ScopedAStatus ret = mCallback->notifyRoleSwitchStatus(
-            in_portName, in_role, roleSwitch ? Status::SUCCESS : Status::ERROR, in_transactionId);
-        if (!ret.isOk())
-            ALOGE("RoleSwitchStatus error %s", ret.getDescription().c_str());
+    /*
+     * The port type is written with mRoleSwitchLock held so that a partner added uevent, which
+     * can arrive as soon as the file is written, always finds the pending switch.
+     */
+    written = switchMode(portName, role);
+    if (written) {
+        mPendingRoleSwitch.active = true;
+        mPendingRoleSwitch.portName = portName;
+        mPendingRoleSwitch.role = role;
+        mPendingRoleSwitch.transactionIds.assign(1, transactionId);
+        mPendingRoleSwitch.partnerDown = false;
+        clock_gettime(CLOCK_MONOTONIC, &mPendingRoleSwitch.start);
+        ts.it_value.tv_sec = PORT_TYPE_TIMEOUT;
+        ATRACE_INT("usb_role_switch_pending", 1);
+        recordPortEvent(UsbPortEvent::ROLE_SWITCH_STARTED);
     } else {
-        ALOGE("Not notifying the userspace. Callback is not set");
+        switchToDrp(portName);
     }
-    pthread_mutex_unlock(&mLock);
+    timerfd_settime(mRoleSwitchTimer, 0, &ts, NULL);
     pthread_mutex_unlock(&mRoleSwitchLock);
 
-    return ScopedAStatus::ok();
+    if (superseded.active) {
+        ALOGI("role switch to %s superseded", convertRoletoString(superseded.role));
+        for (int64_t id : superseded.transactionIds)
+            notifyRoleSwitch(superseded.portName, superseded.role, Status::ERROR, id);
+    }
+    if (!written)
+        notifyRoleSwitch(portName, role, Status::ERROR, transactionId);
 }
 
-ScopedAStatus Usb::limitPowerTransfer(const string& in_portName, bool in_limit,
-        int64_t in_transactionId) {
-    bool sessionFail = false, success;
-    std::vector<PortStatus> currentPortStatus;
-    string sinkLimitEnablePath, currentLimitPath, sourceLimitEnablePath;
+void Usb::completeRoleSwitch(Status status) {
+    struct itimerspec ts = itimerspec();
+    struct PendingRoleSwitch completed;
+    struct timespec now;
 
-    if (mI2cClientPath.empty()) {
-        for (int i = 0; i < NUM_HSI2C_PATHS; i++) {
-            mI2cClientPath = getI2cClientPath(kHsi2cPaths[i], kTcpcDevName, kI2cClientId);
-            if (mI2cClientPath.empty()) {
-                ALOGE("%s: Unable to locate i2c bus node", __func__);
-            } else {
-                break;
-            }
-        }
+    pthread_mutex_lock(&mRoleSwitchLock);
+    if (!mPendingRoleSwitch.active) {
+        pthread_mutex_unlock(&mRoleSwitchLock);
+        return;
     }
+    completed = mPendingRoleSwitch;
+    mPendingRoleSwitch.active = false;
+    timerfd_settime(mRoleSwitchTimer, 0, &ts, NULL);
+    if (status != Status::SUCCESS)
+        switchToDrp(completed.portName);
+    pthread_mutex_unlock(&mRoleSwitchLock);
 
-    sinkLimitEnablePath = mI2cClientPath + kSinkLimitEnable;
-    currentLimitPath = mI2cClientPath + kSinkLimitCurrent;
-    sourceLimitEnablePath = mI2cClientPath + kSourceLimitEnable;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    sRoleSwitchWaitLatency.record((now.tv_sec - completed.start.tv_sec) * 1000000 +
+                                  (now.tv_nsec - completed.start.tv_nsec) / 1000);
+    ATRACE_INT("usb_role_switch_pending", 0);
+    recordPortEvent(status == Status::SUCCESS ? UsbPortEvent::ROLE_SWITCH_DONE
+                                              : UsbPortEvent::ROLE_SWITCH_TIMEOUT);
+    ALOGI("role switch to %s %s", convertRoletoString(completed.role),
+          status == Status::SUCCESS ? "completed" : "timed out");
+
+    for (int64_t id : completed.transactionIds)
+        notifyRoleSwitch(completed.portName, completed.role, status, id);
+}
 
-    pthread_mutex_lock(&mLock);
-    if (in_limit) {
+/*
+ * Completes a pending port type switch when the port reconnects in the requested mode, which
+ * covers the partner coming back without a separate -partner add uevent being seen.
+ */
+void Usb::checkRoleSwitchCompletion(const std::vector<PortStatus> &currentPortStatus) {
+    bool done = false;
+
+    pthread_mutex_lock(&mRoleSwitchLock);
+    if (mPendingRoleSwitch.active) {
+        for (const PortStatus &port : currentPortStatus) {
+            if (port.portName != mPendingRoleSwitch.portName)
+                continue;
+            if (port.currentMode == PortMode::NONE) {
+                mPendingRoleSwitch.partnerDown = true;
+            } else if (mPendingRoleSwitch.partnerDown &&
+                       port.currentMode == mPendingRoleSwitch.role.get<PortRole::mode>()) {
+                done = true;
+            }
+        }
+    }
+    pthread_mutex_unlock(&mRoleSwitchLock);
+
+    if (done)
+        completeRoleSwitch(Status::SUCCESS);
+}
+
+ScopedAStatus Usb::limitPowerTransfer(const string& in_portName, bool in_limit,
+        int64_t in_transactionId) {
+    if ((getTypeCPortPaths(in_portName) == NULL ||
+         !mExecutor.submit(executorLaneHelper(in_portName, kLanePower), "limitPowerTransfer",
+                           [this, in_portName, in_limit, in_transactionId] {
+        executeLimitPowerTransfer(in_portName, in_limit, in_transactionId);
+    })) && in_transactionId >= 0) {
+        mCallbackDispatcher.post("notifyLimitPowerTransferStatus",
+                                 [=](const shared_ptr<IUsbCallback> &callback) {
+            return callback->notifyLimitPowerTransferStatus(in_portName, in_limit, Status::ERROR,
+                                                            in_transactionId);
+        });
+    }
+
+    return ScopedAStatus::ok();
+}
+
+void Usb::executeLimitPowerTransfer(const string& in_portName, bool in_limit,
+        int64_t in_transactionId) {
+    bool sessionFail = false, success;
+    std::vector<PortStatus> currentPortStatus;
+    string sinkLimitEnablePath, currentLimitPath, sourceLimitEnablePath;
+
+    // mI2cClientPath is also resolved by status queries running on other executor lanes
+    pthread_mutex_lock(&mLock);
+    if (mI2cClientPath.empty()) {
+        for (int i = 0; i < NUM_HSI2C_PATHS; i++) {
+            mI2cClientPath = getI2cClientPath(sysfsPath(kHsi2cPaths[i]), kTcpcDevName, kI2cClientId);
+            if (mI2cClientPath.empty()) {
+                ALOGE("%s: Unable to locate i2c bus node", __func__);
+            } else {
+                break;
+            }
+        }
+    }
+
+    sinkLimitEnablePath = mI2cClientPath + kSinkLimitEnable;
+    currentLimitPath = mI2cClientPath + kSinkLimitCurrent;
+    sourceLimitEnablePath = mI2cClientPath + kSourceLimitEnable;
+
+    mPowerTransferLimited = in_limit;
+    mThermalSinkLimitMa = -1;
+    if (in_limit) {
         success = WriteStringToFile("0", currentLimitPath);
         if (!success) {
             ALOGE("Failed to set sink current limit");
@@ -753,20 +1301,60 @@ ScopedAStatus Usb::limitPowerTransfer(const string& in_portName, bool in_limit,
     }
 
     ALOGI("limitPowerTransfer limit:%c opId:%ld", in_limit ? 'y' : 'n', in_transactionId);
-    if (mCallback != NULL && in_transactionId >= 0) {
-        ScopedAStatus ret = mCallback->notifyLimitPowerTransferStatus(
-                in_portName, in_limit, sessionFail ? Status::ERROR : Status::SUCCESS,
-                in_transactionId);
-        if (!ret.isOk())
-            ALOGE("limitPowerTransfer error %s", ret.getDescription().c_str());
-    } else {
-        ALOGE("Not notifying the userspace. Callback is not set");
+    if (in_transactionId >= 0) {
+        mCallbackDispatcher.post("notifyLimitPowerTransferStatus",
+                                 [=](const shared_ptr<IUsbCallback> &callback) {
+            return callback->notifyLimitPowerTransferStatus(
+                    in_portName, in_limit, sessionFail ? Status::ERROR : Status::SUCCESS,
+                    in_transactionId);
+        });
     }
 
     pthread_mutex_unlock(&mLock);
     queryVersionHelper(this, &currentPortStatus);
 
-    return ScopedAStatus::ok();
+}
+
+void Usb::applyThermalSinkLimit(int sinkCurrentMa) {
+    std::vector<PortStatus> currentPortStatus;
+    bool success;
+
+    pthread_mutex_lock(&mLock);
+    // The framework's limit takes precedence, and nothing needs to be written without a change
+    if (mPowerTransferLimited || sinkCurrentMa == mThermalSinkLimitMa) {
+        pthread_mutex_unlock(&mLock);
+        return;
+    }
+
+    if (mI2cClientPath.empty()) {
+        for (int i = 0; i < NUM_HSI2C_PATHS; i++) {
+            mI2cClientPath = getI2cClientPath(sysfsPath(kHsi2cPaths[i]), kTcpcDevName, kI2cClientId);
+            if (mI2cClientPath.empty()) {
+                ALOGE("%s: Unable to locate i2c bus node", __func__);
+            } else {
+                break;
+            }
+        }
+    }
+
+    if (sinkCurrentMa >= 0) {
+        success = WriteStringToFile(std::to_string(sinkCurrentMa),
+                                    mI2cClientPath + kSinkLimitCurrent) &&
+                  WriteStringToFile("1", mI2cClientPath + kSinkLimitEnable);
+    } else {
+        success = WriteStringToFile("0", mI2cClientPath + kSinkLimitEnable);
+    }
+    if (!success) {
+        ALOGE("usb thermal: Failed to set sink current limit %d mA", sinkCurrentMa);
+        pthread_mutex_unlock(&mLock);
+        return;
+    }
+    mThermalSinkLimitMa = sinkCurrentMa;
+    sThermalLimitSteps.add();
+    ALOGI("usb thermal: sink current limit %d mA", sinkCurrentMa);
+    pthread_mutex_unlock(&mLock);
+
+    queryVersionHelper(this, &currentPortStatus);
 }
 
 Status queryPowerTransferStatus(android::hardware::usb::Usb *usb,
@@ -775,7 +1363,7 @@ Status queryPowerTransferStatus(android::hardware::usb::Usb *usb,
 
     if (usb->mI2cClientPath.empty()) {
         for (int i = 0; i < NUM_HSI2C_PATHS; i++) {
-            usb->mI2cClientPath = getI2cClientPath(kHsi2cPaths[i], kTcpcDevName, kI2cClientId);
+            usb->mI2cClientPath = getI2cClientPath(sysfsPath(kHsi2cPaths[i]), kTcpcDevName, kI2cClientId);
             if (usb->mI2cClientPath.empty()) {
                 ALOGE("%s: Unable to locate i2c bus node", __func__);
             } else {
@@ -793,15 +1381,16 @@ Status queryPowerTransferStatus(android::hardware::usb::Usb *usb,
     enabled = Trim(enabled);
     (*currentPortStatus)[0].powerTransferLimited = enabled == "1";
 
-    ALOGI("powerTransferLimited:%d", (*currentPortStatus)[0].powerTransferLimited ? 1 : 0);
+    USB_LOGI_RATELIMITED("powerTransferLimited:%d",
+                         (*currentPortStatus)[0].powerTransferLimited ? 1 : 0);
     return Status::SUCCESS;
 }
 
 Status getAccessoryConnected(const string &portName, string *accessory) {
-    string filename = "/sys/class/typec/" + portName + "-partner/accessory_mode";
+    const TypeCPortPaths *paths = getTypeCPortPaths(portName);
 
-    if (!ReadFileToString(filename, accessory)) {
-        ALOGE("getAccessoryConnected: Failed to open filesystem node: %s", filename.c_str());
+    if (paths == NULL || !readSysfsTraced(paths->partnerAccessoryMode, accessory)) {
+        ALOGE("getAccessoryConnected: Failed to open filesystem node of %s", portName.c_str());
         return Status::ERROR;
     }
     *accessory = Trim(*accessory);
@@ -810,20 +1399,28 @@ Status getAccessoryConnected(const string &portName, string *accessory) {
 }
 
 Status getCurrentRoleHelper(const string &portName, bool connected, PortRole *currentRole) {
-    string filename;
-    string roleName;
+    const TypeCPortPaths *paths = getTypeCPortPaths(portName);
+    const string *filename;
+    ::android::base::unique_fd *fd;
+    char role[TYPEC_ROLE_MAX_LEN];
     string accessory;
 
+    if (paths == NULL)
+        return Status::ERROR;
+
     // Mode
 
     if (currentRole->getTag() == PortRole::powerRole) {
-        filename = "/sys/class/typec/" + portName + "/power_role";
+        filename = &paths->powerRole;
+        fd = &paths->powerRoleFd;
         currentRole->set<PortRole::powerRole>(PortPowerRole::NONE);
     } else if (currentRole->getTag() == PortRole::dataRole) {
-        filename = "/sys/class/typec/" + portName + "/data_role";
+        filename = &paths->dataRole;
+        fd = &paths->dataRoleFd;
         currentRole->set<PortRole::dataRole>(PortDataRole::NONE);
     } else if (currentRole->getTag() == PortRole::mode) {
-        filename = "/sys/class/typec/" + portName + "/data_role";
+        filename = &paths->dataRole;
+        fd = &paths->dataRoleFd;
         currentRole->set<PortRole::mode>(PortMode::NONE);
     } else {
         return Status::ERROR;
@@ -845,33 +1442,35 @@ Status getCurrentRoleHelper(const string &portName, bool connected, PortRole *cu
         }
     }
 
-    if (!ReadFileToString(filename, &roleName)) {
-        ALOGE("getCurrentRole: Failed to open filesystem node: %s", filename.c_str());
+    if (!readRoleTraced(fd, *filename, role, sizeof(role))) {
+        ALOGE("getCurrentRole: Failed to open filesystem node: %s", filename->c_str());
         return Status::ERROR;
     }
 
-    roleName = Trim(roleName);
-    extractRole(&roleName);
-
-    if (roleName == "source") {
-        currentRole->set<PortRole::powerRole>(PortPowerRole::SOURCE);
-    } else if (roleName == "sink") {
-        currentRole->set<PortRole::powerRole>(PortPowerRole::SINK);
-    } else if (roleName == "host") {
-        if (currentRole->getTag() == PortRole::dataRole)
-            currentRole->set<PortRole::dataRole>(PortDataRole::HOST);
-        else
-            currentRole->set<PortRole::mode>(PortMode::DFP);
-    } else if (roleName == "device") {
-        if (currentRole->getTag() == PortRole::dataRole)
-            currentRole->set<PortRole::dataRole>(PortDataRole::DEVICE);
-        else
-            currentRole->set<PortRole::mode>(PortMode::UFP);
-    } else if (roleName != "none") {
-        /* case for none has already been addressed.
-         * so we check if the role isn't none.
-         */
-        return Status::UNRECOGNIZED_ROLE;
+    switch (parseTypeCRole(role)) {
+        case TypeCRoleValue::SOURCE:
+            currentRole->set<PortRole::powerRole>(PortPowerRole::SOURCE);
+            break;
+        case TypeCRoleValue::SINK:
+            currentRole->set<PortRole::powerRole>(PortPowerRole::SINK);
+            break;
+        case TypeCRoleValue::HOST:
+            if (currentRole->getTag() == PortRole::dataRole)
+                currentRole->set<PortRole::dataRole>(PortDataRole::HOST);
+            else
+                currentRole->set<PortRole::mode>(PortMode::DFP);
+            break;
+        case TypeCRoleValue::DEVICE:
+            if (currentRole->getTag() == PortRole::dataRole)
+                currentRole->set<PortRole::dataRole>(PortDataRole::DEVICE);
+            else
+                currentRole->set<PortRole::mode>(PortMode::UFP);
+            break;
+        case TypeCRoleValue::NONE:
+            /* case for none has already been addressed. */
+            break;
+        case TypeCRoleValue::UNRECOGNIZED:
+            return Status::UNRECOGNIZED_ROLE;
     }
     return Status::SUCCESS;
 }
@@ -879,7 +1478,7 @@ Status getCurrentRoleHelper(const string &portName, bool connected, PortRole *cu
 Status getTypeCPortNamesHelper(std::unordered_map<string, bool> *names) {
     DIR *dp;
 
-    dp = opendir(kTypecPath);
+    dp = opendir(kTypecPath.c_str());
     if (dp != NULL) {
         struct dirent *ep;
 
@@ -890,6 +1489,7 @@ Status getTypeCPortNamesHelper(std::unordered_map<string, bool> *names) {
                         names->find(ep->d_name);
                     if (portName == names->end()) {
                         names->insert({ep->d_name, false});
+                        getTypeCPortPaths(ep->d_name);
                     }
                 } else {
                     (*names)[std::strtok(ep->d_name, "-")] = true;
@@ -905,10 +1505,10 @@ Status getTypeCPortNamesHelper(std::unordered_map<string, bool> *names) {
 }
 
 bool canSwitchRoleHelper(const string &portName) {
-    string filename = "/sys/class/typec/" + portName + "-partner/supports_usb_power_delivery";
+    const TypeCPortPaths *paths = getTypeCPortPaths(portName);
     string supportsPD;
 
-    if (ReadFileToString(filename, &supportsPD)) {
+    if (paths != NULL && readSysfsTraced(paths->partnerSupportsPd, &supportsPD)) {
         supportsPD = Trim(supportsPD);
         if (supportsPD == "yes") {
             return true;
@@ -928,7 +1528,7 @@ Status getPortStatusHelper(android::hardware::usb::Usb *usb,
         currentPortStatus->resize(names.size());
         for (std::pair<string, bool> port : names) {
             i++;
-            ALOGI("%s", port.first.c_str());
+            USB_LOGV("%s", port.first.c_str());
             (*currentPortStatus)[i].portName = port.first;
 
             PortRole currentRole;
@@ -966,7 +1566,7 @@ Status getPortStatusHelper(android::hardware::usb::Usb *usb,
 
             bool dataEnabled = true;
             string pogoUsbActive = "0";
-            if (ReadFileToString(string(kPogoUsbActive), &pogoUsbActive) &&
+            if (readSysfsTraced(string(kPogoUsbActive), &pogoUsbActive) &&
                 stoi(Trim(pogoUsbActive)) == 1) {
                 (*currentPortStatus)[i].usbDataStatus.push_back(UsbDataStatus::DISABLED_DOCK);
                 dataEnabled = false;
@@ -982,7 +1582,7 @@ Status getPortStatusHelper(android::hardware::usb::Usb *usb,
             // When connected return powerBrickStatus
             if (port.second) {
                 string usbType;
-                if (ReadFileToString(string(kPowerSupplyUsbType), &usbType)) {
+                if (readSysfsTraced(string(kPowerSupplyUsbType), &usbType)) {
                     if (strstr(usbType.c_str(), "[D")) {
                         (*currentPortStatus)[i].powerBrickStatus = PowerBrickStatus::CONNECTED;
                     } else if (strstr(usbType.c_str(), "[U")) {
@@ -998,13 +1598,13 @@ Status getPortStatusHelper(android::hardware::usb::Usb *usb,
                 (*currentPortStatus)[i].powerBrickStatus = PowerBrickStatus::NOT_CONNECTED;
             }
 
-            ALOGI("%d:%s connected:%d canChangeMode:%d canChagedata:%d canChangePower:%d "
-                  "usbDataEnabled:%d",
-                i, port.first.c_str(), port.second,
-                (*currentPortStatus)[i].canChangeMode,
-                (*currentPortStatus)[i].canChangeDataRole,
-                (*currentPortStatus)[i].canChangePowerRole,
-                dataEnabled ? 1 : 0);
+            USB_LOGI_RATELIMITED("%d:%s connected:%d canChangeMode:%d canChagedata:%d "
+                                 "canChangePower:%d usbDataEnabled:%d",
+                                 i, port.first.c_str(), port.second,
+                                 (*currentPortStatus)[i].canChangeMode,
+                                 (*currentPortStatus)[i].canChangeDataRole,
+                                 (*currentPortStatus)[i].canChangePowerRole,
+                                 dataEnabled ? 1 : 0);
         }
 
         return Status::SUCCESS;
@@ -1015,32 +1615,6 @@ done:
 
 /* DisplayPort Helper Functions Start */
 
-DisplayPortAltModePinAssignment parsePinAssignmentHelper(string pinAssignments) {
-    size_t pos = pinAssignments.find("[");
-    if (pos != string::npos) {
-        pinAssignments = pinAssignments.substr(pos+1, 1);
-        if (pinAssignments == "C") {
-            return DisplayPortAltModePinAssignment::C;
-        } else if (pinAssignments == "D") {
-            return DisplayPortAltModePinAssignment::D;
-        } else if (pinAssignments == "E") {
-            return DisplayPortAltModePinAssignment::E;
-        }
-    }
-    return DisplayPortAltModePinAssignment::NONE;
-}
-
-LinkTrainingStatus parseLinkTrainingStatusHelper(string linkTrainingStatus) {
-    linkTrainingStatus = Trim(linkTrainingStatus);
-    if (linkTrainingStatus == LINK_TRAINING_STATUS_SUCCESS) {
-        return LinkTrainingStatus::SUCCESS;
-    } else if (linkTrainingStatus == LINK_TRAINING_STATUS_FAILURE || \
-               linkTrainingStatus == LINK_TRAINING_STATUS_FAILURE_SINK) {
-        return LinkTrainingStatus::FAILURE;
-    }
-    return LinkTrainingStatus::UNKNOWN;
-}
-
 bool isDisplayPortPlugHelper(string vdoString) {
     unsigned long vdo;
     unsigned long receptacleFlag = 1 << DISPLAYPORT_CAPABILITIES_RECEPTACLE_BIT;
@@ -1075,11 +1649,10 @@ AltModeData::DisplayPortAltModeData constructAltModeData(string hpd, string pin_
     }
 
     // pin
-    dpData.pinAssignment = parsePinAssignmentHelper(pin_assignment);
+    dpData.pinAssignment = parsePinAssignment(pin_assignment);
 
     // link training
-    link_status = Trim(link_status);
-    dpData.linkTrainingStatus = parseLinkTrainingStatusHelper(link_status);
+    dpData.linkTrainingStatus = parseLinkTrainingStatus(link_status);
     if (dpData.linkTrainingStatus == LinkTrainingStatus::SUCCESS) {
         dpData.partnerSinkStatus = dpData.partnerSinkStatus == DisplayPortAltModeStatus::CAPABLE ? \
                 DisplayPortAltModeStatus::ENABLED : DisplayPortAltModeStatus::UNKNOWN;
@@ -1092,36 +1665,14 @@ AltModeData::DisplayPortAltModeData constructAltModeData(string hpd, string pin_
                dpData.partnerSinkStatus == DisplayPortAltModeStatus::CAPABLE) {
         // 2.0 cable that fails EDID reports not capable, other link training failures assume
         // 3.0 cable that fails in all other cases.
-        dpData.cableStatus = (link_status == LINK_TRAINING_STATUS_FAILURE_SINK) ? \
+        dpData.cableStatus =
+                (trimSysfsValue(link_status) == LINK_TRAINING_STATUS_FAILURE_SINK) ? \
                 DisplayPortAltModeStatus::NOT_CAPABLE : DisplayPortAltModeStatus::CAPABLE;
     }
 
     return dpData;
 }
 
-Status queryPartnerSvids(std::vector<string> *svids) {
-    DIR *dp;
-
-    dp = opendir(kDisplayPortUsbPath);
-    if (dp != NULL) {
-        struct dirent *ep;
-        // Iterate through directories for Alt Mode SVIDs
-        while ((ep = readdir(dp))) {
-            if (ep->d_type == DT_DIR) {
-                string svid;
-                string portPartnerPath = string(kDisplayPortUsbPath) + string(ep->d_name) + "/svid";
-                if (ReadFileToString(portPartnerPath, &svid)) {
-                    (*svids).push_back(Trim(svid));
-                }
-            }
-        }
-        closedir(dp);
-    } else {
-        return Status::ERROR;
-    }
-    return Status::SUCCESS;
-}
-
 /* DisplayPort Helper Functions End */
 
 // Only care about first port which must support DisplayPortAltMode
@@ -1142,7 +1693,7 @@ Status queryDisplayPortStatus(android::hardware::usb::Usb *usb,
     */
     if (usb->getDisplayPortUsbPathHelper(&path) == Status::ERROR) {
         std::vector<string> svids;
-        if (queryPartnerSvids(&svids) == Status::SUCCESS) {
+        if (usb->queryPartnerSvids(&svids) == Status::SUCCESS) {
             if (std::count(svids.begin(), svids.end(), SVID_THUNDERBOLT) &&
                 !std::count(svids.begin(), svids.end(), SVID_DISPLAYPORT)) {
                 dpData.cableStatus = DisplayPortAltModeStatus::NOT_CAPABLE;
@@ -1179,233 +1730,370 @@ void queryVersionHelper(android::hardware::usb::Usb *usb,
     Status status;
     string displayPortUsbPath;
 
+    sPortRefreshCount.add();
     pthread_mutex_lock(&usb->mLock);
+    auto lockStart = std::chrono::steady_clock::now();
     status = getPortStatusHelper(usb, currentPortStatus);
     queryMoistureDetectionStatus(usb, currentPortStatus);
     queryPowerTransferStatus(usb, currentPortStatus);
     queryNonCompliantChargerStatus(currentPortStatus);
     pthread_mutex_lock(&usb->mDisplayPortLock);
+    auto displayPortLockStart = std::chrono::steady_clock::now();
     if (!usb->mDisplayPortFirstSetupDone &&
         usb->getDisplayPortUsbPathHelper(&displayPortUsbPath) == Status::SUCCESS) {
 
         ALOGI("usbdp: boot with display connected or usb hal restarted");
         usb->setupDisplayPortPoll();
     }
+    recordElapsedHelper(&sDisplayPortLockHold, displayPortLockStart);
     pthread_mutex_unlock(&usb->mDisplayPortLock);
     queryDisplayPortStatus(usb, currentPortStatus);
-    if (usb->mCallback != NULL) {
-        ScopedAStatus ret = usb->mCallback->notifyPortStatusChange(*currentPortStatus,
-            status);
-        if (!ret.isOk())
-            ALOGE("queryPortStatus error %s", ret.getDescription().c_str());
-    } else {
-        ALOGI("Notifying userspace skipped. Callback is NULL");
-    }
+    usb->mCallbackDispatcher.postPortStatus(*currentPortStatus, status);
+    recordElapsedHelper(&sPortLockHold, lockStart);
     pthread_mutex_unlock(&usb->mLock);
 }
 
 ScopedAStatus Usb::queryPortStatus(int64_t in_transactionId) {
+    if (!mExecutor.submit(executorLaneHelper("all", kLaneStatus), "queryPortStatus",
+                          [this, in_transactionId] {
+        executeQueryPortStatus(in_transactionId);
+    })) {
+        mCallbackDispatcher.post("notifyQueryPortStatus",
+                                 [=](const shared_ptr<IUsbCallback> &callback) {
+            return callback->notifyQueryPortStatus("all", Status::ERROR, in_transactionId);
+        });
+    }
+
+    return ScopedAStatus::ok();
+}
+
+void Usb::executeQueryPortStatus(int64_t in_transactionId) {
     std::vector<PortStatus> currentPortStatus;
 
     queryVersionHelper(this, &currentPortStatus);
-    pthread_mutex_lock(&mLock);
-    if (mCallback != NULL) {
-        ScopedAStatus ret = mCallback->notifyQueryPortStatus(
-            "all", Status::SUCCESS, in_transactionId);
-        if (!ret.isOk())
-            ALOGE("notifyQueryPortStatus error %s", ret.getDescription().c_str());
-    } else {
-        ALOGE("Not notifying the userspace. Callback is not set");
+    mCallbackDispatcher.post("notifyQueryPortStatus",
+                             [=](const shared_ptr<IUsbCallback> &callback) {
+        return callback->notifyQueryPortStatus("all", Status::SUCCESS, in_transactionId);
+    });
+
+}
+
+ScopedAStatus Usb::enableContaminantPresenceDetection(const string& in_portName,
+        bool in_enable, int64_t in_transactionId) {
+    if (getTypeCPortPaths(in_portName) == NULL ||
+        !mExecutor.submit(executorLaneHelper(in_portName, kLaneContaminant),
+                          "enableContaminantPresenceDetection",
+                          [this, in_portName, in_enable, in_transactionId] {
+        executeEnableContaminantPresenceDetection(in_portName, in_enable, in_transactionId);
+    })) {
+        mCallbackDispatcher.post("notifyContaminantEnabledStatus",
+                                 [=](const shared_ptr<IUsbCallback> &callback) {
+            return callback->notifyContaminantEnabledStatus(in_portName, in_enable,
+                                                            Status::ERROR, in_transactionId);
+        });
     }
-    pthread_mutex_unlock(&mLock);
 
     return ScopedAStatus::ok();
 }
 
-ScopedAStatus Usb::enableContaminantPresenceDetection(const string& in_portName,
+void Usb::executeEnableContaminantPresenceDetection(const string& in_portName,
         bool in_enable, int64_t in_transactionId) {
     string disable = GetProperty(kDisableContatminantDetection, "");
     std::vector<PortStatus> currentPortStatus;
     bool success = true;
+    string path;
 
+    // enabledPath is updated by status queries running on other executor lanes
+    pthread_mutex_lock(&mLock);
+    path = enabledPath;
+    pthread_mutex_unlock(&mLock);
     if (disable != "true")
-        success = WriteStringToFile(in_enable ? "1" : "0", enabledPath);
+        success = WriteStringToFile(in_enable ? "1" : "0", path);
 
-    pthread_mutex_lock(&mLock);
-    if (mCallback != NULL) {
-        ScopedAStatus ret = mCallback->notifyContaminantEnabledStatus(
+    mCallbackDispatcher.post("notifyContaminantEnabledStatus",
+                             [=](const shared_ptr<IUsbCallback> &callback) {
+        return callback->notifyContaminantEnabledStatus(
             in_portName, in_enable, success ? Status::SUCCESS : Status::ERROR, in_transactionId);
-        if (!ret.isOk())
-            ALOGE("notifyContaminantEnabledStatus error %s", ret.getDescription().c_str());
-    } else {
-        ALOGE("Not notifying the userspace. Callback is not set");
-    }
-    pthread_mutex_unlock(&mLock);
+    });
 
     queryVersionHelper(this, &currentPortStatus);
-    return ScopedAStatus::ok();
 }
 
-void report_overheat_event(android::hardware::usb::Usb *usb) {
-    VendorUsbPortOverheat overheat_info;
+// Reads a cooling device statistic, counting a missing or malformed one in sOverheatDataErrors
+static bool readOverheatStatHelper(const char *name, int *value) {
     string contents;
 
-    overheat_info.set_plug_temperature_deci_c(usb->mPluggedTemperatureCelsius * 10);
-    overheat_info.set_max_temperature_deci_c(usb->mOverheat.getMaxOverheatTemperature() * 10);
-    if (ReadFileToString(string(kOverheatStatsPath) + "trip_time", &contents)) {
-        overheat_info.set_time_to_overheat_secs(stoi(Trim(contents)));
+    if (!ReadFileToString(string(kOverheatStatsPath) + name, &contents)) {
+        ALOGE("Unable to read %s", name);
+    } else if (!ParseInt(Trim(contents), value)) {
+        ALOGE("Unable to parse %s: %s", name, contents.c_str());
     } else {
-        ALOGE("Unable to read trip_time");
-        return;
-    }
-    if (ReadFileToString(string(kOverheatStatsPath) + "hysteresis_time", &contents)) {
-        overheat_info.set_time_to_hysteresis_secs(stoi(Trim(contents)));
-    } else {
-        ALOGE("Unable to read hysteresis_time");
-        return;
-    }
-    if (ReadFileToString(string(kOverheatStatsPath) + "cleared_time", &contents)) {
-        overheat_info.set_time_to_inactive_secs(stoi(Trim(contents)));
-    } else {
-        ALOGE("Unable to read cleared_time");
-        return;
+        return true;
     }
+    sOverheatDataErrors.add();
+    return false;
+}
 
-    const shared_ptr<IStats> stats_client = getStatsService();
-    if (!stats_client) {
-        ALOGE("Unable to get AIDL Stats service");
-    } else {
-        reportUsbPortOverheat(stats_client, overheat_info);
-    }
+/*
+ * Queues an overheat report. The temperatures are snapshotted here, the cooling device
+ * statistics are read on the reporter thread together with the report.
+ */
+void report_overheat_event(android::hardware::usb::Usb *usb) {
+    int plugTemperatureDeciC = usb->mPluggedTemperatureCelsius * 10;
+    int maxTemperatureDeciC = usb->mOverheat.getMaxOverheatTemperature() * 10;
+
+    usb->mStatsReporter.post("usb overheat report", [plugTemperatureDeciC, maxTemperatureDeciC](
+                                                            const shared_ptr<IStats> &stats) {
+        VendorUsbPortOverheat overheat_info;
+        int tripTime, hysteresisTime, clearedTime;
+
+        if (!readOverheatStatHelper("trip_time", &tripTime) ||
+            !readOverheatStatHelper("hysteresis_time", &hysteresisTime) ||
+            !readOverheatStatHelper("cleared_time", &clearedTime)) {
+            return;
+        }
+
+        overheat_info.set_plug_temperature_deci_c(plugTemperatureDeciC);
+        overheat_info.set_max_temperature_deci_c(maxTemperatureDeciC);
+        overheat_info.set_time_to_overheat_secs(tripTime);
+        overheat_info.set_time_to_hysteresis_secs(hysteresisTime);
+        overheat_info.set_time_to_inactive_secs(clearedTime);
+        reportUsbPortOverheat(stats, overheat_info);
+    });
 }
 
 struct data {
-    int uevent_fd;
+    ::aidl::android::hardware::usb::UeventSubscription *uevent_subscription;
+    // Drops of uevent_subscription already accounted in sUeventDropped
+    uint64_t uevent_dropped;
     ::aidl::android::hardware::usb::Usb *usb;
 };
 
 enum UeventType { UNKNOWN, BIND, CHANGE };
 
-enum UeventType matchUeventType(char* str) {
-    if (!strncmp(str, "ACTION=bind", strlen("ACTION=bind"))) {
+enum UeventType matchUeventType(const string &action) {
+    if (action == "bind") {
         return UeventType::BIND;
-    } else if (!strncmp(str, "ACTION=change", strlen("ACTION=change"))) {
+    } else if (action == "change") {
         return UeventType::CHANGE;
     }
     return UeventType::UNKNOWN;
 }
 
-static void uevent_event(uint32_t /*epevents*/, struct data *payload) {
-    char msg[UEVENT_MSG_LEN + 2];
-    char *cp;
-    int n;
-    enum UeventType uevent_type = UeventType::UNKNOWN;
+// Whether the uevent carries key with a value starting with prefix
+static bool ueventFieldStartsWithHelper(const Uevent &uevent, const char *key,
+                                        const char *prefix) {
+    const string *value = uevent.get(key);
 
-    n = uevent_kernel_multicast_recv(payload->uevent_fd, msg, UEVENT_MSG_LEN);
-    if (n <= 0)
-        return;
-    if (n >= UEVENT_MSG_LEN) /* overflow -- discard */
-        return;
+    return value != NULL && ::android::base::StartsWith(*value, prefix);
+}
 
-    msg[n] = '\0';
-    msg[n + 1] = '\0';
-    cp = msg;
-
-    while (*cp) {
-        if (std::regex_match(cp, std::regex("(add)(.*)(-partner)"))) {
-            ALOGI("partner added");
-            pthread_mutex_lock(&payload->usb->mPartnerLock);
-            payload->usb->mPartnerUp = true;
-            pthread_cond_signal(&payload->usb->mPartnerCV);
-            pthread_mutex_unlock(&payload->usb->mPartnerLock);
-        } else if (std::regex_match(cp, std::regex("(remove)(.*)(-partner)"))) {
-            string drmDisconnectPath = string(kDisplayPortDrmPath) + "usbc_cable_disconnect";
-
-            if (payload->usb->mPartnerSupportsDisplayPort) {
-                ALOGI("displayport partner removed");
-                if (!WriteStringToFile("1", drmDisconnectPath)) {
-                    ALOGE("Failed to signal disconnect to drm");
-                }
-                payload->usb->mPartnerSupportsDisplayPort = false;
-            }
-        } else if (!strncmp(cp, "DEVTYPE=typec_", strlen("DEVTYPE=typec_")) ||
-                   !strncmp(cp, "DRIVER=max77759tcpc",
-                            strlen("DRIVER=max77759tcpc")) ||
-                   !strncmp(cp, "DRIVER=pogo-transport",
-                            strlen("DRIVER=pogo-transport")) ||
-                   !strncmp(cp, "POWER_SUPPLY_NAME=usb",
-                            strlen("POWER_SUPPLY_NAME=usb"))) {
-            std::vector<PortStatus> currentPortStatus;
-            queryVersionHelper(payload->usb, &currentPortStatus);
-
-            // Role switch is not in progress and port is in disconnected state
-            if (!pthread_mutex_trylock(&payload->usb->mRoleSwitchLock)) {
-                for (unsigned long i = 0; i < currentPortStatus.size(); i++) {
-                    DIR *dp =
-                        opendir(string("/sys/class/typec/" +
-                                            string(currentPortStatus[i].portName.c_str()) +
-                                            "-partner").c_str());
-                    if (dp == NULL) {
-                        switchToDrp(currentPortStatus[i].portName);
-                    } else {
-                        closedir(dp);
-                    }
-                }
-                pthread_mutex_unlock(&payload->usb->mRoleSwitchLock);
-            }
-            if (!strncmp(cp, "DRIVER=max77759tcpc", strlen("DRIVER=max77759tcpc"))
-                       && payload->usb->mDisplayPortPollRunning) {
-                uint64_t flag = DISPLAYPORT_IRQ_HPD_COUNT_CHECK;
+// Handles one uevent, as parsed by the dispatcher
+static void handleUevent(::aidl::android::hardware::usb::Usb *usb, const Uevent &uevent) {
+    enum UeventType uevent_type = matchUeventType(uevent.action);
+    bool partner = ::android::base::EndsWith(uevent.devpath, "-partner");
+    ScopedLatencyTrace trace(&sUeventLatency, "uevent_event");
 
-                ALOGI("usbdp: DISPLAYPORT_IRQ_HPD_COUNT_CHECK sent");
-                write(payload->usb->mDisplayPortEventPipe, &flag, sizeof(flag));
+    ATRACE_INT64("usb_uevents", sUeventCount.add());
+    /*
+     * The partner, its alt modes and the DisplayPort driver binding to them come and go with
+     * add/remove/bind/unbind uevents below port0-partner. Drop the cached alt mode scan before
+     * the port status below is refreshed.
+     */
+    if (uevent.devpath.find("-partner") != string::npos && uevent.action != "change")
+        usb->invalidatePartnerAltModes();
+    if (partner && uevent.action == "add") {
+        ALOGI("partner added");
+        usb->recordPortEvent(UsbPortEvent::PARTNER_ADDED);
+        usb->completeRoleSwitch(Status::SUCCESS);
+    } else if (partner && uevent.action == "remove") {
+        string drmDisconnectPath = string(kDisplayPortDrmPath) + "usbc_cable_disconnect";
+
+        usb->recordPortEvent(UsbPortEvent::PARTNER_REMOVED);
+        if (usb->mPartnerSupportsDisplayPort) {
+            ALOGI("displayport partner removed");
+            if (!WriteStringToFile("1", drmDisconnectPath)) {
+                ALOGE("Failed to signal disconnect to drm");
             }
-            /*if (!!strncmp(cp, "DEVTYPE=typec_alternate_mode", strlen("DEVTYPE=typec_alternate_mode"))) {
-                break;
-            }*/
-        } else if (!strncmp(cp, kOverheatStatsDev, strlen(kOverheatStatsDev))) {
-            ALOGV("Overheat Cooling device suez update");
-            report_overheat_event(payload->usb);
-        } else if (!(strncmp(cp, "ACTION=", strlen("ACTION=")))) {
-            uevent_type = matchUeventType(cp);
-        } else if (!strncmp(cp, "DRIVER=typec_displayport", strlen("DRIVER=typec_displayport"))) {
-            if (uevent_type == UeventType::BIND) {
-                pthread_mutex_lock(&payload->usb->mDisplayPortLock);
-                payload->usb->setupDisplayPortPoll();
-                pthread_mutex_unlock(&payload->usb->mDisplayPortLock);
-            } else if (uevent_type == UeventType::CHANGE) {
-                pthread_mutex_lock(&payload->usb->mDisplayPortLock);
-                payload->usb->shutdownDisplayPortPoll(false);
-                pthread_mutex_unlock(&payload->usb->mDisplayPortLock);
+            usb->mPartnerSupportsDisplayPort = false;
+        }
+    }
+
+    bool tcpc = ueventFieldStartsWithHelper(uevent, "DRIVER", "max77759tcpc");
+    if (tcpc || ueventFieldStartsWithHelper(uevent, "DEVTYPE", "typec_") ||
+        ueventFieldStartsWithHelper(uevent, "DRIVER", "pogo-transport") ||
+        ueventFieldStartsWithHelper(uevent, "POWER_SUPPLY_NAME", "usb")) {
+        std::vector<PortStatus> currentPortStatus;
+
+        /*
+         * IRQ_HPD is forwarded ahead of the port status sweep so dongles signalling link
+         * loss are not held behind it. The handler thread compares irq_hpd_count against
+         * its cache, so the EPOLLPRI wakeup and this request never forward a count twice.
+         */
+        if (tcpc && usb->mDisplayPortArmed)
+            usb->postDisplayPortRequest(DISPLAYPORT_REQUEST_IRQ_HPD_COUNT_CHECK);
+        queryVersionHelper(usb, &currentPortStatus);
+
+        usb->checkRoleSwitchCompletion(currentPortStatus);
+
+        // Role switch is not in progress and port is in disconnected state
+        if (!pthread_mutex_trylock(&usb->mRoleSwitchLock)) {
+            for (unsigned long i = 0; !usb->mPendingRoleSwitch.active &&
+                                      i < currentPortStatus.size(); i++) {
+                const TypeCPortPaths *paths =
+                    getTypeCPortPaths(currentPortStatus[i].portName);
+                if (paths != NULL && access(paths->partner.c_str(), F_OK)) {
+                    switchToDrp(currentPortStatus[i].portName);
+                }
             }
-            break;
+            pthread_mutex_unlock(&usb->mRoleSwitchLock);
         }
-        /* advance to after the next \0 */
-        while (*cp++) {
+    } else if (ueventFieldStartsWithHelper(uevent, "DRIVER", kOverheatStatsDriver)) {
+        ALOGV("Overheat Cooling device suez update");
+        report_overheat_event(usb);
+    } else if (ueventFieldStartsWithHelper(uevent, "DRIVER", "typec_displayport")) {
+        usb->invalidatePartnerAltModes();
+        if (uevent_type == UeventType::BIND) {
+            usb->recordPortEvent(UsbPortEvent::DISPLAYPORT_BOUND);
+            pthread_mutex_lock(&usb->mDisplayPortLock);
+            auto lockStart = std::chrono::steady_clock::now();
+            usb->setupDisplayPortPoll();
+            recordElapsedHelper(&sDisplayPortLockHold, lockStart);
+            pthread_mutex_unlock(&usb->mDisplayPortLock);
+        } else if (uevent_type == UeventType::CHANGE) {
+            usb->recordPortEvent(UsbPortEvent::DISPLAYPORT_UNBOUND);
+            pthread_mutex_lock(&usb->mDisplayPortLock);
+            auto lockStart = std::chrono::steady_clock::now();
+            usb->shutdownDisplayPortPoll(false);
+            recordElapsedHelper(&sDisplayPortLockHold, lockStart);
+            pthread_mutex_unlock(&usb->mDisplayPortLock);
         }
     }
 }
 
+static void uevent_event(uint32_t /*epevents*/, struct data *payload) {
+    uint64_t dropped;
+
+    payload->uevent_subscription->drain([payload](Uevent &uevent) {
+        handleUevent(payload->usb, uevent);
+    });
+
+    dropped = payload->uevent_subscription->dropped();
+    if (dropped != payload->uevent_dropped) {
+        ATRACE_INT64("usb_uevents_dropped",
+                     sUeventDropped.add(dropped - payload->uevent_dropped));
+        payload->uevent_dropped = dropped;
+    }
+}
+
+// Returns the devpath of the sysfs device at path, resolving class links, or "" when absent
+static string sysfsDevpathHelper(const string &path) {
+    char resolved[PATH_MAX], root[PATH_MAX];
+    size_t rootLen;
+
+    if (!realpath(sysfsPath(path).c_str(), resolved) ||
+        !realpath(sysfsPath("/sys").c_str(), root)) {
+        return "";
+    }
+    rootLen = strlen(root);
+    if (strncmp(resolved, root, rootLen) || resolved[rootLen] != '/')
+        return "";
+    return string(resolved + rootLen);
+}
+
+/*
+ * Discovers the devpaths handleUevent() needs so the kernel filter follows the board: the tcpc
+ * parent of every typec port, which holds its partner, alt modes and usually the usb power
+ * supply, and the kUeventDevicePaths present. Returns none, letting every uevent through, when
+ * no typec port is found.
+ */
+static std::vector<string> ueventDevpathPrefixesHelper() {
+    std::vector<string> prefixes;
+    DIR *dp;
+
+    dp = opendir(kTypecPath.c_str());
+    if (dp != NULL) {
+        struct dirent *ep;
+
+        while ((ep = readdir(dp))) {
+            if (ep->d_name[0] == '.' || strstr(ep->d_name, "-partner"))
+                continue;
+            string devpath = sysfsDevpathHelper(string("/sys/class/typec/") + ep->d_name);
+            size_t typec = devpath.rfind("/typec/");
+
+            if (devpath.empty())
+                continue;
+            // Ports registered by a tcpc sit in its typec directory
+            if (typec != string::npos && typec > 0)
+                devpath.resize(typec);
+            prefixes.push_back(devpath);
+        }
+        closedir(dp);
+    }
+    if (prefixes.empty()) {
+        ALOGW("no typec port found, uevents are not filtered");
+        return prefixes;
+    }
+
+    for (const char *path : kUeventDevicePaths) {
+        string devpath = sysfsDevpathHelper(path);
+
+        if (!devpath.empty())
+            prefixes.push_back(devpath);
+    }
+    std::sort(prefixes.begin(), prefixes.end());
+    prefixes.erase(std::unique(prefixes.begin(), prefixes.end()), prefixes.end());
+    for (const string &prefix : prefixes)
+        ALOGI("uevent devpath %s", prefix.c_str());
+    return prefixes;
+}
+
+// Uevents handled by handleUevent()
+static UeventFilter usbUeventFilter() {
+    UeventFilter filter;
+
+    filter.devpathPrefixes = ueventDevpathPrefixesHelper();
+    filter.fieldPrefixes = {"DEVTYPE=typec_", "DRIVER=max77759tcpc", "DRIVER=pogo-transport",
+                            "POWER_SUPPLY_NAME=usb", "DRIVER=typec_displayport",
+                            string("DRIVER=") + kOverheatStatsDriver};
+    filter.predicate = [](const Uevent &uevent) {
+        return (uevent.action == "add" || uevent.action == "remove") &&
+               ::android::base::EndsWith(uevent.devpath, "-partner");
+    };
+    return filter;
+}
+
+static void role_switch_timer_event(uint32_t /*epevents*/, struct data *payload) {
+    uint64_t expirations;
+
+    if (read(payload->usb->mRoleSwitchTimer, &expirations, sizeof(expirations)) <= 0)
+        return;
+
+    ALOGI("uevents wait timedout");
+    payload->usb->completeRoleSwitch(Status::ERROR);
+}
+
 void *work(void *param) {
-    int epoll_fd, uevent_fd;
-    struct epoll_event ev;
+    int epoll_fd;
+    struct epoll_event ev, ev_timer;
     int nevents = 0;
     struct data payload;
+    std::shared_ptr<UeventSubscription> ueventSubscription;
 
     ALOGE("creating thread");
 
-    uevent_fd = uevent_open_socket(64 * 1024, true);
-
-    if (uevent_fd < 0) {
-        ALOGE("uevent_init: uevent_open_socket failed\n");
+    ueventSubscription = UeventDispatcher::getInstance().subscribe(usbUeventFilter());
+    if (!ueventSubscription) {
+        ALOGE("uevent_init: uevent subscription failed\n");
         return NULL;
     }
+    // Partner changes are only seen from here on, anything scanned before may be stale
+    ((::aidl::android::hardware::usb::Usb *)param)->trackPartnerAltModes(true);
 
-    payload.uevent_fd = uevent_fd;
+    payload.uevent_subscription = ueventSubscription.get();
+    payload.uevent_dropped = 0;
     payload.usb = (::aidl::android::hardware::usb::Usb *)param;
 
-    fcntl(uevent_fd, F_SETFL, O_NONBLOCK);
-
     ev.events = EPOLLIN;
     ev.data.ptr = (void *)uevent_event;
 
@@ -1415,11 +2103,22 @@ void *work(void *param) {
         goto error;
     }
 
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, uevent_fd, &ev) == -1) {
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ueventSubscription->fd().get(), &ev) == -1) {
         ALOGE("epoll_ctl failed; errno=%d", errno);
         goto error;
     }
 
+    /*
+     * The role switch timer outlives this thread. A timeout that expired while the thread was
+     * not running is handled as soon as the timer is added back.
+     */
+    ev_timer.events = EPOLLIN;
+    ev_timer.data.ptr = (void *)role_switch_timer_event;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, payload.usb->mRoleSwitchTimer, &ev_timer) == -1) {
+        ALOGE("epoll_ctl failed to add role switch timer; errno=%d", errno);
+        goto error;
+    }
+
     while (!destroyThread) {
         struct epoll_event events[64];
 
@@ -1440,7 +2139,8 @@ void *work(void *param) {
 
     ALOGI("exiting worker thread");
 error:
-    close(uevent_fd);
+    UeventDispatcher::getInstance().unsubscribe(ueventSubscription);
+    payload.usb->trackPartnerAltModes(false);
 
     if (epoll_fd >= 0)
         close(epoll_fd);
@@ -1459,17 +2159,18 @@ void sighandler(int sig) {
 
 ScopedAStatus Usb::setCallback(const shared_ptr<IUsbCallback>& in_callback) {
     pthread_mutex_lock(&mLock);
-    if ((mCallback == NULL && in_callback == NULL) ||
-            (mCallback != NULL && in_callback != NULL)) {
-        mCallback = in_callback;
+    shared_ptr<IUsbCallback> oldCallback = mCallbackDispatcher.getCallback();
+    if ((oldCallback == NULL && in_callback == NULL) ||
+            (oldCallback != NULL && in_callback != NULL)) {
+        mCallbackDispatcher.setCallback(in_callback);
         pthread_mutex_unlock(&mLock);
         return ScopedAStatus::ok();
     }
 
-    mCallback = in_callback;
+    mCallbackDispatcher.setCallback(in_callback);
     ALOGI("registering callback");
 
-    if (mCallback == NULL) {
+    if (in_callback == NULL) {
         if  (!pthread_kill(mPoll, SIGUSR1)) {
             pthread_join(mPoll, NULL);
             ALOGI("pthread destroyed");
@@ -1487,7 +2188,7 @@ ScopedAStatus Usb::setCallback(const shared_ptr<IUsbCallback>& in_callback) {
      */
     if (pthread_create(&mPoll, NULL, work, this)) {
         ALOGE("pthread creation failed %d", errno);
-        mCallback = NULL;
+        mCallbackDispatcher.setCallback(NULL);
     }
 
     pthread_mutex_unlock(&mLock);
@@ -1496,33 +2197,93 @@ ScopedAStatus Usb::setCallback(const shared_ptr<IUsbCallback>& in_callback) {
 
 /***** DisplayPort Alt Mode Helpers *****/
 
-Status Usb::getDisplayPortUsbPathHelper(string *path) {
+/*
+ * Scans the alt mode directories of port0-partner for their svids and the DisplayPort driver.
+ * Called with mPartnerAltModesLock held whenever the cache was invalidated.
+ */
+static void scanPartnerAltModesHelper(bool *present, string *displayPortUsbPath,
+                                      std::vector<string> *svids) {
     DIR *dp;
-    Status result = Status::ERROR;
 
-    dp = opendir(kDisplayPortUsbPath);
+    *present = false;
+    displayPortUsbPath->clear();
+    svids->clear();
+
+    dp = opendir(kDisplayPortUsbPath.c_str());
     if (dp != NULL) {
         struct dirent *ep;
-        // Iterate through all alt mode directories to find displayport driver
+
+        *present = true;
+        // Iterate through all alt mode directories to find svids and the displayport driver
         while ((ep = readdir(dp))) {
             if (ep->d_type == DT_DIR) {
+                string altModePath = string(kDisplayPortUsbPath) + string(ep->d_name);
+                string svid;
                 DIR *displayPortDp;
-                string portPartnerPath = string(kDisplayPortUsbPath) + string(ep->d_name)
-                        + "/displayport/";
-                displayPortDp = opendir(portPartnerPath.c_str());
-                if (displayPortDp != NULL) {
-                    *path = portPartnerPath;
-                    closedir(displayPortDp);
-                    result = Status::SUCCESS;
-                    break;
+
+                if (ReadFileToString(altModePath + "/svid", &svid)) {
+                    svids->push_back(Trim(svid));
+                }
+                if (displayPortUsbPath->empty()) {
+                    displayPortDp = opendir((altModePath + "/displayport/").c_str());
+                    if (displayPortDp != NULL) {
+                        *displayPortUsbPath = altModePath + "/displayport/";
+                        closedir(displayPortDp);
+                    }
                 }
             }
         }
         closedir(dp);
     }
+}
+
+Status Usb::getDisplayPortUsbPathHelper(string *path) {
+    Status result = Status::ERROR;
+
+    pthread_mutex_lock(&mPartnerAltModesLock);
+    if (!mPartnerAltModesValid) {
+        scanPartnerAltModesHelper(&mPartnerPresent, &mDisplayPortUsbPath, &mPartnerSvids);
+        mPartnerAltModesValid = mPartnerAltModesTracked;
+    }
+    if (!mDisplayPortUsbPath.empty()) {
+        *path = mDisplayPortUsbPath;
+        result = Status::SUCCESS;
+    }
+    pthread_mutex_unlock(&mPartnerAltModesLock);
+
+    return result;
+}
+
+Status Usb::queryPartnerSvids(std::vector<string> *svids) {
+    Status result = Status::ERROR;
+
+    pthread_mutex_lock(&mPartnerAltModesLock);
+    if (!mPartnerAltModesValid) {
+        scanPartnerAltModesHelper(&mPartnerPresent, &mDisplayPortUsbPath, &mPartnerSvids);
+        mPartnerAltModesValid = mPartnerAltModesTracked;
+    }
+    if (mPartnerPresent) {
+        svids->insert(svids->end(), mPartnerSvids.begin(), mPartnerSvids.end());
+        result = Status::SUCCESS;
+    }
+    pthread_mutex_unlock(&mPartnerAltModesLock);
+
     return result;
 }
 
+void Usb::invalidatePartnerAltModes() {
+    pthread_mutex_lock(&mPartnerAltModesLock);
+    mPartnerAltModesValid = false;
+    pthread_mutex_unlock(&mPartnerAltModesLock);
+}
+
+void Usb::trackPartnerAltModes(bool tracked) {
+    pthread_mutex_lock(&mPartnerAltModesLock);
+    mPartnerAltModesTracked = tracked;
+    mPartnerAltModesValid = false;
+    pthread_mutex_unlock(&mPartnerAltModesLock);
+}
+
 Status Usb::readDisplayPortAttribute(string attribute, string usb_path, string* value) {
     string attrPath;
 
@@ -1558,7 +2319,8 @@ Status Usb::writeDisplayPortAttributeOverride(string attribute, string value) {
         ALOGE("usbdp: Failed to write attribute %s to drm: %s", attribute.c_str(), value.c_str());
         return Status::ERROR;
     }
-    ALOGI("usbdp: Successfully wrote attribute %s: %s to drm.", attribute.c_str(), value.c_str());
+    USB_LOGI_RATELIMITED("usbdp: Successfully wrote attribute %s: %s to drm.", attribute.c_str(),
+                         value.c_str());
     return Status::SUCCESS;
 }
 
@@ -1583,29 +2345,14 @@ Status Usb::writeDisplayPortAttribute(string attribute, string usb_path) {
                 return Status::ERROR;
             }
             if (!strncmp(attrDrm.c_str(), "0", strlen("0"))) {
-                ALOGI("usbdp: Skipping hpd write when drm and usb both equal 0");
+                USB_LOGI_RATELIMITED("usbdp: Skipping hpd write when drm and usb both equal 0");
                 return Status::SUCCESS;
             }
         }
-    } else if (!strncmp(attribute.c_str(), "irq_hpd_count", strlen("irq_hpd_count"))) {
-        uint32_t temp;
-        if (!::android::base::ParseUint(Trim(attrUsb), &temp)) {
-            ALOGE("usbdp: failed parsing irq_hpd_count:%s", attrUsb.c_str());
-            return Status::ERROR;
-        }
-        // Used to cache the values read from tcpci's irq_hpd_count.
-        // Update drm driver when cached value is not the same as the read value.
-        ALOGI("usbdp: mIrqHpdCountCache:%u irq_hpd_count:%u", mIrqHpdCountCache, temp);
-        if (mIrqHpdCountCache == temp) {
-            return Status::SUCCESS;
-        } else {
-            mIrqHpdCountCache = temp;
-        }
-        attrDrmPath = string(kDisplayPortDrmPath) + "irq_hpd";
     } else if (!strncmp(attribute.c_str(), "pin_assignment", strlen("pin_assignment"))) {
         size_t pos = attrUsb.find("[");
         if (pos != string::npos) {
-            ALOGI("usbdp: Modifying Pin Config from %s", attrUsb.c_str());
+            USB_LOGV("usbdp: Modifying Pin Config from %s", attrUsb.c_str());
             attrUsb = attrUsb.substr(pos+1, 1);
         } else {
             // Don't write anything
@@ -1619,7 +2366,8 @@ Status Usb::writeDisplayPortAttribute(string attribute, string usb_path) {
         ALOGE("usbdp: Failed to write attribute %s to drm: %s", attribute.c_str(), attrUsb.c_str());
         return Status::ERROR;
     }
-    ALOGI("usbdp: Successfully wrote attribute %s: %s to drm.", attribute.c_str(), attrUsb.c_str());
+    USB_LOGI_RATELIMITED("usbdp: Successfully wrote attribute %s: %s to drm.", attribute.c_str(),
+                         attrUsb.c_str());
     return Status::SUCCESS;
 }
 
@@ -1659,49 +2407,183 @@ static int armTimerFdHelper(int fd, int ms) {
     return timerfd_settime(fd, 0, &ts, NULL);
 }
 
-void *displayPortPollWork(void *param) {
-    /* USB Payload */
-    ::aidl::android::hardware::usb::Usb *usb = (::aidl::android::hardware::usb::Usb *)param;
-    /* Epoll fields */
-    int epoll_fd;
-    struct epoll_event ev_hpd, ev_pin, ev_orientation, ev_eventfd, ev_link, ev_debounce;
-    struct epoll_event ev_activate;
-    int nevents = 0;
-    int hpd_fd, pin_fd, orientation_fd, link_training_status_fd;
-    int file_flags = O_RDONLY;
-    int epoll_flags;
-    /* DisplayPort link statuses */
-    bool orientationSet = false;
-    bool pinSet = false;
-    int activateRetryCount = 0;
-    unsigned long res;
-    int ret = 0;
-    /* File paths */
-    string displayPortUsbPath, irqHpdCountPath, hpdPath, pinAssignmentPath, orientationPath;
-    string tcpcI2cBus, linkPath, partnerActivePath, portActivePath;
+static int64_t elapsedMsHelper(const struct timespec &start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+}
+
+/*
+ * State owned by the DisplayPort handler thread for the currently bound partner. The fds are
+ * opened when the handler is armed and closed again when it is disarmed.
+ */
+struct displayPortPollState {
+    bool armed;
+    int hpd_fd;
+    int pin_fd;
+    int orientation_fd;
+    int link_training_status_fd;
+    // drm hpd attribute, kept open for the HPD fast path
+    int drm_hpd_fd;
+    // tcpci irq_hpd_count, polled for EPOLLPRI, and drm irq_hpd for the IRQ_HPD fast path
+    int irq_hpd_count_fd;
+    int drm_irq_hpd_fd;
+    bool orientationSet;
+    bool pinSet;
+    bool hpdForwarded;
+    int activateRetryCount;
+    // Set while the framework update debounce timer is pending
+    bool debouncePending;
+    struct timespec debounceStart;
+    struct timespec debounceLastEvent;
+    // Events in the pending burst, and whether the timer was last armed for a trained link
+    uint32_t debounceEvents;
+    bool debounceEarly;
+    // Last hpd value read from the Type-C side
+    bool hpdHigh;
+    struct timespec armRequestTime;
+    string hpdPath;
+    string pinAssignmentPath;
+    string orientationPath;
+    string linkPath;
+    string partnerActivePath;
+    string portActivePath;
+    string irqHpdCountPath;
+};
+
+static void displayPortPollCloseHelper(int epoll_fd, int *fd) {
+    if (*fd == -1)
+        return;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, *fd, NULL);
+    close(*fd);
+    *fd = -1;
+}
+
+static bool displayPortPollAddEventsHelper(int epoll_fd, int fd, uint32_t events,
+                                           const char *name) {
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        ALOGE("usbdp: worker: epoll_ctl failed to add %s; errno=%d", name, errno);
+        return false;
+    }
+    return true;
+}
+
+static bool displayPortPollAddHelper(int epoll_fd, int fd, const char *name) {
+    return displayPortPollAddEventsHelper(epoll_fd, fd, EPOLLIN | EPOLLET, name);
+}
+
+/*
+ * Returns true when the drm reports link training success. Reading link_status also clears its
+ * pending sysfs notification, which is harmless as every caller is about to (re)arm the timer.
+ */
+static bool displayPortLinkTrainedHelper(struct displayPortPollState *state) {
+    char buf[DISPLAYPORT_HPD_MAX_LEN];
+    ssize_t len;
+
+    len = TEMP_FAILURE_RETRY(pread(state->link_training_status_fd, buf, sizeof(buf) - 1, 0));
+    if (len <= 0)
+        return false;
+    return parseLinkTrainingStatus(std::string_view(buf, len)) == LinkTrainingStatus::SUCCESS;
+}
+
+/*
+ * (Re)arms the framework update debounce timer for an hpd, pin, orientation, link training or
+ * forwarded IRQ_HPD event. The time from the first event of a burst until the timer fires is
+ * accounted in sDisplayPortDebounceLatency. The timer is armed for DISPLAYPORT_STATUS_SETTLE_MS
+ * when the link is trained and hpd is high, since the framework has nothing left to wait for,
+ * unless the burst already looks like an IRQ storm.
+ */
+static void armDisplayPortDebounceHelper(::aidl::android::hardware::usb::Usb *usb,
+                                         struct displayPortPollState *state) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!state->debouncePending) {
+        state->debouncePending = true;
+        state->debounceStart = now;
+        state->debounceEvents = 0;
+        ATRACE_INT("usbdp_debounce_pending", 1);
+    }
+    state->debounceLastEvent = now;
+    state->debounceEvents++;
+
+    if (state->debounceEvents == DISPLAYPORT_STATUS_STORM_EVENTS + 1 &&
+        usb->mDisplayPortDebounceWindowMs < DISPLAYPORT_STATUS_DEBOUNCE_MAX_MS) {
+        usb->mDisplayPortDebounceWindowMs =
+                std::min(usb->mDisplayPortDebounceWindowMs * 2, DISPLAYPORT_STATUS_DEBOUNCE_MAX_MS);
+        usb->mDisplayPortStormBackoffCount++;
+        ALOGW("usbdp: worker: event storm, debounce window raised to %d ms",
+              usb->mDisplayPortDebounceWindowMs.load());
+    }
+
+    state->debounceEarly = state->debounceEvents <= DISPLAYPORT_STATUS_STORM_EVENTS &&
+                           state->hpdHigh && displayPortLinkTrainedHelper(state);
+    armTimerFdHelper(usb->mDisplayPortDebounceTimer,
+                     state->debounceEarly ? DISPLAYPORT_STATUS_SETTLE_MS
+                                          : usb->mDisplayPortDebounceWindowMs.load());
+}
+
+static void displayPortPollDisarm(::aidl::android::hardware::usb::Usb *usb, int epoll_fd,
+                                  struct displayPortPollState *state) {
+    if (!state->armed)
+        return;
 
-    usb->mDisplayPortPollRunning = true;
-    usb->mDisplayPortPollStarting = false;
+    /* Need to disarm so the next partner doesn't get old events */
+    armTimerFdHelper(usb->mDisplayPortDebounceTimer, 0);
+    armTimerFdHelper(usb->mDisplayPortActivateTimer, 0);
+    if (state->debouncePending) {
+        state->debouncePending = false;
+        ATRACE_INT("usbdp_debounce_pending", 0);
+    }
+    usb->mDisplayPortDebounceWindowMs = DISPLAYPORT_STATUS_DEBOUNCE_MS;
+    displayPortPollCloseHelper(epoll_fd, &state->link_training_status_fd);
+    displayPortPollCloseHelper(epoll_fd, &state->orientation_fd);
+    displayPortPollCloseHelper(epoll_fd, &state->pin_fd);
+    displayPortPollCloseHelper(epoll_fd, &state->hpd_fd);
+    displayPortPollCloseHelper(epoll_fd, &state->irq_hpd_count_fd);
+    if (state->drm_hpd_fd != -1) {
+        close(state->drm_hpd_fd);
+        state->drm_hpd_fd = -1;
+    }
+    if (state->drm_irq_hpd_fd != -1) {
+        close(state->drm_irq_hpd_fd);
+        state->drm_irq_hpd_fd = -1;
+    }
+    state->armed = false;
+
+    usb->writeDisplayPortAttributeOverride("hpd", "0");
+    ALOGI("usbdp: worker: displayport handler disarmed");
+}
 
-    /*---------- Setup ----------*/
+static bool displayPortPollArm(::aidl::android::hardware::usb::Usb *usb, int epoll_fd,
+                               struct displayPortPollState *state) {
+    int file_flags = O_RDONLY;
+    string displayPortUsbPath;
 
     if (usb->getDisplayPortUsbPathHelper(&displayPortUsbPath) == Status::ERROR) {
         ALOGE("usbdp: worker: could not locate usb displayport directory");
-        goto usb_path_error;
+        return false;
     }
 
     ALOGI("usbdp: worker: displayport usb path located at %s", displayPortUsbPath.c_str());
-    hpdPath = displayPortUsbPath + "hpd";
-    pinAssignmentPath = displayPortUsbPath + "pin_assignment";
-    orientationPath = "/sys/class/typec/port0/orientation";
-    linkPath = string(kDisplayPortDrmPath) + "link_status";
+    state->hpdPath = displayPortUsbPath + "hpd";
+    state->pinAssignmentPath = displayPortUsbPath + "pin_assignment";
+    state->orientationPath = kTypecPath + "/port0/orientation";
+    state->linkPath = string(kDisplayPortDrmPath) + "link_status";
 
-    partnerActivePath = displayPortUsbPath + "../mode1/active";
-    portActivePath = "/sys/class/typec/port0/port0.0/mode1/active";
+    state->partnerActivePath = displayPortUsbPath + "../mode1/active";
+    state->portActivePath = sysfsPath(DISPLAYPORT_ACTIVE_PATH);
 
+    // mI2cClientPath is resolved under mLock by the port status queries as well
+    pthread_mutex_lock(&usb->mLock);
     if (usb->mI2cClientPath.empty()) {
         for (int i = 0; i < NUM_HSI2C_PATHS; i++) {
-            usb->mI2cClientPath = getI2cClientPath(kHsi2cPaths[i], kTcpcDevName, kI2cClientId);
+            usb->mI2cClientPath = getI2cClientPath(sysfsPath(kHsi2cPaths[i]), kTcpcDevName, kI2cClientId);
             if (usb->mI2cClientPath.empty()) {
                 ALOGE("%s: Unable to locate i2c bus node", __func__);
             } else {
@@ -1709,81 +2591,194 @@ void *displayPortPollWork(void *param) {
             }
         }
     }
-
-    irqHpdCountPath = usb->mI2cClientPath + kIrqHpdCount;
-    ALOGI("usbdp: worker: irqHpdCountPath:%s", irqHpdCountPath.c_str());
-
-    epoll_fd = epoll_create(64);
-    if (epoll_fd == -1) {
-        ALOGE("usbdp: worker: epoll_create failed; errno=%d", errno);
-        goto epoll_fd_error;
-    }
-
-    if ((hpd_fd = displayPortPollOpenFileHelper(hpdPath.c_str(), file_flags)) == -1){
-        goto hpd_fd_error;
-    }
-    if ((pin_fd = displayPortPollOpenFileHelper(pinAssignmentPath.c_str(), file_flags)) == -1){
-        goto pin_fd_error;
-    }
-    if ((orientation_fd = displayPortPollOpenFileHelper(orientationPath.c_str(), file_flags))
-            == -1){
-        goto orientation_fd_error;
-    }
-    if ((link_training_status_fd = displayPortPollOpenFileHelper(linkPath.c_str(), file_flags)) == -1){
-        goto link_training_status_fd_error;
-    }
-
-    // Set epoll_event events and flags
-    epoll_flags = EPOLLIN | EPOLLET;
-    ev_hpd.events = epoll_flags;
-    ev_pin.events = epoll_flags;
-    ev_orientation.events = epoll_flags;
-    ev_eventfd.events = epoll_flags;
-    ev_link.events = epoll_flags;
-    ev_debounce.events = epoll_flags;
-    ev_activate.events = epoll_flags;
-
-    ev_hpd.data.fd = hpd_fd;
-    ev_pin.data.fd = pin_fd;
-    ev_orientation.data.fd = orientation_fd;
-    ev_eventfd.data.fd = usb->mDisplayPortEventPipe;
-    ev_link.data.fd = link_training_status_fd;
-    ev_debounce.data.fd = usb->mDisplayPortDebounceTimer;
-    ev_activate.data.fd = usb->mDisplayPortActivateTimer;
-
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, hpd_fd, &ev_hpd) == -1) {
-        ALOGE("usbdp: worker: epoll_ctl failed to add hpd; errno=%d", errno);
-        goto error;
-    }
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pin_fd, &ev_pin) == -1) {
-        ALOGE("usbdp: worker: epoll_ctl failed to add pin; errno=%d", errno);
+    state->irqHpdCountPath = usb->mI2cClientPath + kIrqHpdCount;
+    pthread_mutex_unlock(&usb->mLock);
+    ALOGI("usbdp: worker: irqHpdCountPath:%s", state->irqHpdCountPath.c_str());
+
+    state->armed = true;
+    state->orientationSet = false;
+    state->pinSet = false;
+    state->hpdForwarded = false;
+    state->hpdHigh = false;
+    state->activateRetryCount = 0;
+    state->debouncePending = false;
+
+    if ((state->hpd_fd = displayPortPollOpenFileHelper(state->hpdPath.c_str(), file_flags)) == -1 ||
+        !displayPortPollAddHelper(epoll_fd, state->hpd_fd, "hpd")) {
         goto error;
     }
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, orientation_fd, &ev_orientation) == -1) {
-        ALOGE("usbdp: worker: epoll_ctl failed to add orientation; errno=%d", errno);
+    if ((state->pin_fd = displayPortPollOpenFileHelper(state->pinAssignmentPath.c_str(),
+                                                       file_flags)) == -1 ||
+        !displayPortPollAddHelper(epoll_fd, state->pin_fd, "pin")) {
         goto error;
     }
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, link_training_status_fd, &ev_link) == -1) {
-        ALOGE("usbdp: worker: epoll_ctl failed to add link status; errno=%d", errno);
+    if ((state->orientation_fd = displayPortPollOpenFileHelper(state->orientationPath.c_str(),
+                                                               file_flags)) == -1 ||
+        !displayPortPollAddHelper(epoll_fd, state->orientation_fd, "orientation")) {
         goto error;
     }
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, usb->mDisplayPortDebounceTimer, &ev_debounce) == -1) {
-        ALOGE("usbdp: worker: epoll_ctl failed to add framework update debounce; errno=%d", errno);
+    if ((state->link_training_status_fd = displayPortPollOpenFileHelper(state->linkPath.c_str(),
+                                                                        file_flags)) == -1 ||
+        !displayPortPollAddHelper(epoll_fd, state->link_training_status_fd, "link status")) {
         goto error;
     }
-     if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, usb->mDisplayPortActivateTimer, &ev_activate) == -1) {
-        ALOGE("usbdp: worker: epoll_ctl failed to add activate debounce; errno=%d", errno);
+    if ((state->drm_hpd_fd = displayPortPollOpenFileHelper(
+                 (string(kDisplayPortDrmPath) + "hpd").c_str(), O_RDWR)) == -1) {
         goto error;
     }
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, usb->mDisplayPortEventPipe, &ev_eventfd) == -1) {
-        ALOGE("usbdp: worker: epoll_ctl failed to add orientation; errno=%d", errno);
-        goto error;
+    /*
+     * irq_hpd_count is watched for EPOLLPRI in case the tcpc driver notifies it. Drivers that
+     * don't are still served by DISPLAYPORT_REQUEST_IRQ_HPD_COUNT_CHECK from the tcpc uevent.
+     * A missing tcpc node only disables IRQ_HPD forwarding, as it did before. When the node
+     * can't be watched, the fd is kept open for that uevent driven check.
+     */
+    if ((state->irq_hpd_count_fd = displayPortPollOpenFileHelper(
+                 state->irqHpdCountPath.c_str(), file_flags)) != -1 &&
+        !displayPortPollAddEventsHelper(epoll_fd, state->irq_hpd_count_fd, EPOLLPRI | EPOLLET,
+                                        "irq_hpd_count")) {
+        ALOGW("usbdp: worker: irq_hpd_count not watched, checked on tcpc uevents only");
     }
+    state->drm_irq_hpd_fd = displayPortPollOpenFileHelper(
+            (string(kDisplayPortDrmPath) + "irq_hpd").c_str(), O_WRONLY);
 
     /* Arm timer to see if DisplayPort Alt Mode Activates */
     armTimerFdHelper(usb->mDisplayPortActivateTimer, DISPLAYPORT_ACTIVATE_DEBOUNCE_MS);
+    sDisplayPortArmCount.add();
+    ALOGI("usbdp: worker: displayport handler armed");
+    return true;
+
+error:
+    displayPortPollDisarm(usb, epoll_fd, state);
+    return false;
+}
+
+/*
+ * HPD fast path: forwards the Type-C hpd value to the drm with a single pread/pwrite on the fds
+ * cached while the handler is armed. The value is returned in hpd so the caller can log it once
+ * the drm has been updated; *written is false when the write was skipped because both sides
+ * already read 0.
+ */
+static Status displayPortForwardHpdHelper(struct displayPortPollState *state, char *hpd,
+                                          bool *written) {
+    char drmHpd[4];
+    ssize_t len;
+
+    *written = false;
+    len = TEMP_FAILURE_RETRY(pread(state->hpd_fd, hpd, DISPLAYPORT_HPD_MAX_LEN - 1, 0));
+    if (len <= 0)
+        return Status::ERROR;
+    hpd[len] = '\0';
+
+    if (hpd[0] == '0' &&
+        TEMP_FAILURE_RETRY(pread(state->drm_hpd_fd, drmHpd, sizeof(drmHpd), 0)) > 0 &&
+        drmHpd[0] == '0') {
+        return Status::SUCCESS;
+    }
+
+    if (TEMP_FAILURE_RETRY(pwrite(state->drm_hpd_fd, hpd, len, 0)) != len)
+        return Status::ERROR;
+
+    *written = true;
+    return Status::SUCCESS;
+}
+
+/*
+ * IRQ_HPD fast path: forwards a changed irq_hpd_count to the drm irq_hpd with a single
+ * pread/pwrite on the fds cached while the handler is armed. *written is false when the count
+ * matches mIrqHpdCountCache, i.e. the IRQ_HPD was already forwarded.
+ */
+static Status displayPortForwardIrqHpdHelper(::aidl::android::hardware::usb::Usb *usb,
+                                             struct displayPortPollState *state,
+                                             uint32_t *count, bool *written) {
+    char buf[DISPLAYPORT_IRQ_HPD_COUNT_MAX_LEN];
+    ssize_t len;
+
+    *written = false;
+    if (state->irq_hpd_count_fd == -1 || state->drm_irq_hpd_fd == -1)
+        return Status::ERROR;
+    len = TEMP_FAILURE_RETRY(pread(state->irq_hpd_count_fd, buf, sizeof(buf) - 1, 0));
+    if (len <= 0)
+        return Status::ERROR;
+    buf[len] = '\0';
+
+    if (!ParseUint(string(trimSysfsValue(std::string_view(buf, len))), count))
+        return Status::ERROR;
+    if (*count == usb->mIrqHpdCountCache)
+        return Status::SUCCESS;
+
+    // A failed write leaves the cache behind, so the next wakeup forwards the count again
+    if (TEMP_FAILURE_RETRY(pwrite(state->drm_irq_hpd_fd, buf, len, 0)) != len)
+        return Status::ERROR;
+    usb->mIrqHpdCountCache = *count;
+
+    *written = true;
+    return Status::SUCCESS;
+}
+
+/*
+ * Forwards a pending IRQ_HPD and logs the outcome once the drm has been updated. source names
+ * the wakeup that noticed it.
+ */
+static void displayPortIrqHpdHelper(::aidl::android::hardware::usb::Usb *usb,
+                                    struct displayPortPollState *state, const char *source) {
+    uint32_t count = 0;
+    bool written;
+    Status status;
+
+    ATRACE_NAME("usbdp irq_hpd");
+    status = displayPortForwardIrqHpdHelper(usb, state, &count, &written);
+    // Counted in the burst so an IRQ_HPD storm backs off the window and defers the update
+    if (written)
+        armDisplayPortDebounceHelper(usb, state);
+
+    if (status != Status::SUCCESS) {
+        ALOGE("usbdp: worker: Failed to forward irq_hpd_count from %s; errno=%d", source, errno);
+    } else if (written) {
+        USB_LOGI_RATELIMITED("usbdp: worker: IRQ_HPD from %s, irq_hpd_count:%u forwarded to drm",
+                             source, count);
+    }
+}
+
+/*
+ * Long-lived DisplayPort handler. The thread is started once with the HAL and is armed when a
+ * DisplayPort partner binds and disarmed when it unbinds, so docking and undocking does not
+ * create or join any thread.
+ */
+void *displayPortPollWork(void *param) {
+    /* USB Payload */
+    ::aidl::android::hardware::usb::Usb *usb = (::aidl::android::hardware::usb::Usb *)param;
+    /* Epoll fields */
+    int epoll_fd;
+    int nevents = 0;
+    unsigned long res;
+    int ret = 0;
+    struct displayPortPollState state;
+
+    state.armed = false;
+    state.hpd_fd = -1;
+    state.pin_fd = -1;
+    state.orientation_fd = -1;
+    state.link_training_status_fd = -1;
+    state.drm_hpd_fd = -1;
+    state.irq_hpd_count_fd = -1;
+    state.drm_irq_hpd_fd = -1;
+    state.debouncePending = false;
 
-    while (!destroyDisplayPortThread) {
+    epoll_fd = epoll_create(64);
+    if (epoll_fd == -1) {
+        ALOGE("usbdp: worker: epoll_create failed; errno=%d", errno);
+        return NULL;
+    }
+
+    if (!displayPortPollAddHelper(epoll_fd, usb->mDisplayPortDebounceTimer,
+                                  "framework update debounce") ||
+        !displayPortPollAddHelper(epoll_fd, usb->mDisplayPortActivateTimer, "activate debounce") ||
+        !displayPortPollAddHelper(epoll_fd, usb->mDisplayPortEventPipe, "eventfd")) {
+        close(epoll_fd);
+        return NULL;
+    }
+
+    while (true) {
         struct epoll_event events[64];
 
         nevents = epoll_wait(epoll_fd, events, 64, -1);
@@ -1795,228 +2790,387 @@ void *displayPortPollWork(void *param) {
         }
 
         for (int n = 0; n < nevents; n++) {
-            if (events[n].data.fd == hpd_fd) {
-                if (!pinSet || !orientationSet) {
+            if (events[n].data.fd == usb->mDisplayPortEventPipe) {
+                uint64_t flag = 0;
+                uint32_t requests;
+
+                if (read(usb->mDisplayPortEventPipe, &flag, sizeof(flag)) < 0 &&
+                    errno != EAGAIN) {
+                    ALOGE("usbdp: worker: eventfd read error:%d", errno);
+                }
+
+                pthread_mutex_lock(&usb->mDisplayPortRequestLock);
+                requests = usb->mDisplayPortRequests;
+                usb->mDisplayPortRequests = 0;
+                state.armRequestTime = usb->mDisplayPortArmRequestTime;
+                pthread_mutex_unlock(&usb->mDisplayPortRequestLock);
+
+                if (requests & (DISPLAYPORT_REQUEST_ARM | DISPLAYPORT_REQUEST_DISARM)) {
+                    /*
+                     * Back to back BIND events leave the fds of a previous partner behind, so
+                     * arming always starts from a disarmed state.
+                     */
+                    displayPortPollDisarm(usb, epoll_fd, &state);
+                }
+                if (requests & DISPLAYPORT_REQUEST_ARM) {
+                    displayPortPollArm(usb, epoll_fd, &state);
+                }
+                if ((requests & DISPLAYPORT_REQUEST_IRQ_HPD_COUNT_CHECK) && state.armed) {
+                    displayPortIrqHpdHelper(usb, &state, "tcpc uevent");
+                }
+                continue;
+            }
+
+            if (!state.armed)
+                continue;
+
+            if (events[n].data.fd == state.irq_hpd_count_fd) {
+                displayPortIrqHpdHelper(usb, &state, "irq_hpd_count");
+            } else if (events[n].data.fd == state.hpd_fd) {
+                if (!state.pinSet || !state.orientationSet) {
                     ALOGW("usbdp: worker: HPD may be set before pin_assignment and orientation");
-                    if (!pinSet &&
-                        usb->writeDisplayPortAttribute("pin_assignment", pinAssignmentPath) ==
+                    if (!state.pinSet &&
+                        usb->writeDisplayPortAttribute("pin_assignment",
+                                                       state.pinAssignmentPath) ==
                         Status::SUCCESS) {
-                        pinSet = true;
+                        state.pinSet = true;
                     }
-                    if (!orientationSet &&
-                        usb->writeDisplayPortAttribute("orientation", orientationPath) ==
+                    if (!state.orientationSet &&
+                        usb->writeDisplayPortAttribute("orientation", state.orientationPath) ==
                         Status::SUCCESS) {
-                        orientationSet = true;
+                        state.orientationSet = true;
                     }
                 }
-                usb->writeDisplayPortAttribute("hpd", hpdPath);
-                armTimerFdHelper(usb->mDisplayPortDebounceTimer, DISPLAYPORT_STATUS_DEBOUNCE_MS);
-            } else if (events[n].data.fd == pin_fd) {
-                if (usb->writeDisplayPortAttribute("pin_assignment", pinAssignmentPath) ==
+                char hpd[DISPLAYPORT_HPD_MAX_LEN];
+                bool written;
+                Status hpdStatus = displayPortForwardHpdHelper(&state, hpd, &written);
+
+                if (hpdStatus == Status::SUCCESS)
+                    state.hpdHigh = hpd[0] == '1';
+                armDisplayPortDebounceHelper(usb, &state);
+
+                // Logging is kept off the hot path until the drm has been updated.
+                if (hpdStatus != Status::SUCCESS) {
+                    ALOGE("usbdp: worker: Failed to forward hpd to drm; errno=%d", errno);
+                } else if (!written) {
+                    USB_LOGI_RATELIMITED("usbdp: Skipping hpd write when drm and usb both equal 0");
+                } else {
+                    USB_LOGI_RATELIMITED("usbdp: Successfully wrote attribute hpd: %c to drm.",
+                                         hpd[0]);
+                    usb->recordPortEvent(hpd[0] == '1' ? UsbPortEvent::HPD_HIGH
+                                                       : UsbPortEvent::HPD_LOW);
+                    if (!state.hpdForwarded) {
+                        int64_t latencyMs = elapsedMsHelper(state.armRequestTime);
+
+                        state.hpdForwarded = true;
+                        usb->mDisplayPortHpdLatencyLastMs = latencyMs;
+                        if (latencyMs > usb->mDisplayPortHpdLatencyMaxMs)
+                            usb->mDisplayPortHpdLatencyMaxMs = latencyMs;
+                        usb->mDisplayPortHpdLatencyCount++;
+                        sDisplayPortHpdLatency.record(latencyMs * 1000);
+                        ALOGI("usbdp: worker: first hpd forwarded %" PRId64 " ms after bind",
+                              latencyMs);
+                    }
+                }
+            } else if (events[n].data.fd == state.pin_fd) {
+                if (usb->writeDisplayPortAttribute("pin_assignment", state.pinAssignmentPath) ==
                     Status::SUCCESS) {
-                    pinSet = true;
-                    armTimerFdHelper(usb->mDisplayPortDebounceTimer, DISPLAYPORT_STATUS_DEBOUNCE_MS);
+                    state.pinSet = true;
+                    armDisplayPortDebounceHelper(usb, &state);
                 }
-            } else if (events[n].data.fd == orientation_fd) {
-                if (usb->writeDisplayPortAttribute("orientation", orientationPath) ==
+            } else if (events[n].data.fd == state.orientation_fd) {
+                if (usb->writeDisplayPortAttribute("orientation", state.orientationPath) ==
                     Status::SUCCESS) {
-                    orientationSet = true;
-                    armTimerFdHelper(usb->mDisplayPortDebounceTimer, DISPLAYPORT_STATUS_DEBOUNCE_MS);
+                    state.orientationSet = true;
+                    armDisplayPortDebounceHelper(usb, &state);
                 }
-            } else if (events[n].data.fd == link_training_status_fd) {
-                armTimerFdHelper(usb->mDisplayPortDebounceTimer, DISPLAYPORT_STATUS_DEBOUNCE_MS);
+            } else if (events[n].data.fd == state.link_training_status_fd) {
+                armDisplayPortDebounceHelper(usb, &state);
             } else if (events[n].data.fd == usb->mDisplayPortDebounceTimer) {
                 std::vector<PortStatus> currentPortStatus;
                 ret = read(usb->mDisplayPortDebounceTimer, &res, sizeof(res));
-                ALOGI("usbdp: dp debounce triggered, val:%lu ret:%d", res, ret);
+                USB_LOGI_RATELIMITED("usbdp: dp debounce triggered, val:%lu ret:%d", res, ret);
                 if (ret < 0) {
                     ALOGW("usbdp: debounce read error:%d", errno);
                     continue;
                 }
+                if (state.debouncePending) {
+                    state.debouncePending = false;
+                    ATRACE_INT("usbdp_debounce_pending", 0);
+                    sDisplayPortDebounceLatency.record(elapsedMsHelper(state.debounceStart) * 1000);
+                    sDisplayPortSettleLatency.record(
+                            (state.debounceLastEvent.tv_sec - state.debounceStart.tv_sec) *
+                                    1000000LL +
+                            (state.debounceLastEvent.tv_nsec - state.debounceStart.tv_nsec) / 1000);
+                    if (state.debounceEarly)
+                        usb->mDisplayPortEarlyUpdateCount++;
+                    // A burst that ended below the storm threshold restores the default window
+                    if (state.debounceEvents <= DISPLAYPORT_STATUS_STORM_EVENTS)
+                        usb->mDisplayPortDebounceWindowMs = DISPLAYPORT_STATUS_DEBOUNCE_MS;
+                }
+                ATRACE_NAME("usbdp debounce update");
                 queryVersionHelper(usb, &currentPortStatus);
             } else if (events[n].data.fd == usb->mDisplayPortActivateTimer) {
                 string activePartner, activePort;
 
-                if (ReadFileToString(partnerActivePath.c_str(), &activePartner) &&
-                    ReadFileToString(portActivePath.c_str(), &activePort)) {
+                if (ReadFileToString(state.partnerActivePath.c_str(), &activePartner) &&
+                    ReadFileToString(state.portActivePath.c_str(), &activePort)) {
                     // Retry activate signal when DisplayPort Alt Mode is active on port but not
                     // partner.
                     if (!strncmp(activePartner.c_str(), "no", strlen("no")) &&
                         !strncmp(activePort.c_str(), "yes", strlen("yes")) &&
-                        activateRetryCount < DISPLAYPORT_ACTIVATE_MAX_RETRIES) {
-                        if (!WriteStringToFile("1", partnerActivePath)) {
+                        state.activateRetryCount < DISPLAYPORT_ACTIVATE_MAX_RETRIES) {
+                        if (!WriteStringToFile("1", state.partnerActivePath)) {
                             ALOGE("usbdp: Failed to activate port partner Alt Mode");
                         } else {
                             ALOGI("usbdp: Attempting to activate port partner Alt Mode");
                         }
-                        activateRetryCount++;
+                        state.activateRetryCount++;
                         armTimerFdHelper(usb->mDisplayPortActivateTimer,
                                          DISPLAYPORT_ACTIVATE_DEBOUNCE_MS);
                     } else {
                         ALOGI("usbdp: DisplayPort Alt Mode is active, or disabled on port");
                     }
                 } else {
-                    activateRetryCount++;
+                    state.activateRetryCount++;
                     armTimerFdHelper(usb->mDisplayPortActivateTimer,
                                      DISPLAYPORT_ACTIVATE_DEBOUNCE_MS);
                     ALOGE("usbdp: Failed to read active state from port or partner");
                 }
-            } else if (events[n].data.fd == usb->mDisplayPortEventPipe) {
-                uint64_t flag = 0;
-                if (!read(usb->mDisplayPortEventPipe, &flag, sizeof(flag))) {
-                    if (errno == EAGAIN)
-                        continue;
-                    ALOGI("usbdp: worker: Shutdown eventfd read error");
-                    goto error;
-                }
-                if (flag == DISPLAYPORT_SHUTDOWN_SET) {
-                    ALOGI("usbdp: worker: Shutdown eventfd triggered");
-                    destroyDisplayPortThread = true;
-                    break;
-                } else if (flag == DISPLAYPORT_IRQ_HPD_COUNT_CHECK) {
-                    ALOGI("usbdp: worker: IRQ_HPD event through DISPLAYPORT_IRQ_HPD_COUNT_CHECK");
-                    usb->writeDisplayPortAttribute("irq_hpd_count", irqHpdCountPath);
-                }
             }
         }
     }
 
-error:
-    /* Need to disarm so new threads don't get old event */
-    armTimerFdHelper(usb->mDisplayPortDebounceTimer, 0);
-    armTimerFdHelper(usb->mDisplayPortActivateTimer, 0);
-    close(link_training_status_fd);
-link_training_status_fd_error:
-    close(orientation_fd);
-orientation_fd_error:
-    close(pin_fd);
-pin_fd_error:
-    close(hpd_fd);
-hpd_fd_error:
-    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, usb->mDisplayPortDebounceTimer, &ev_debounce);
-    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, usb->mDisplayPortActivateTimer, &ev_activate);
-    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, usb->mDisplayPortEventPipe, &ev_eventfd);
+    displayPortPollDisarm(usb, epoll_fd, &state);
     close(epoll_fd);
-epoll_fd_error:
-usb_path_error:
-    usb->mDisplayPortPollRunning = false;
     ALOGI("usbdp: worker: exiting worker thread");
     return NULL;
 }
 
-static struct timespec setTimespecTimer(int debounceMs) {
-    struct timespec to;
-    struct timespec now;
+void Usb::postDisplayPortRequest(uint32_t request) {
+    uint64_t flag = 1;
 
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    to.tv_nsec = now.tv_nsec + ((debounceMs % 1000) * 1000000);
-    to.tv_sec = now.tv_sec + (debounceMs / 1000);
-    if (to.tv_nsec >= 1000000000) {
-        to.tv_nsec -= 1000000000;
-        to.tv_sec += 1;
-    }
+    pthread_mutex_lock(&mDisplayPortRequestLock);
+    // Arm and disarm are mutually exclusive, the latest request wins.
+    if (request & (DISPLAYPORT_REQUEST_ARM | DISPLAYPORT_REQUEST_DISARM))
+        mDisplayPortRequests &= ~(DISPLAYPORT_REQUEST_ARM | DISPLAYPORT_REQUEST_DISARM);
+    mDisplayPortRequests |= request;
+    if (request & DISPLAYPORT_REQUEST_ARM)
+        clock_gettime(CLOCK_MONOTONIC, &mDisplayPortArmRequestTime);
+    pthread_mutex_unlock(&mDisplayPortRequestLock);
 
-    return to;
+    if (write(mDisplayPortEventPipe, &flag, sizeof(flag)) < 0)
+        ALOGE("usbdp: failed to signal displayport handler; errno=%d", errno);
 }
 
 void Usb::setupDisplayPortPoll() {
-    uint64_t flag = DISPLAYPORT_SHUTDOWN_CLEAR;
     mDisplayPortFirstSetupDone = true;
-    int ret;
 
-    ALOGI("usbdp: setup: beginning setup for displayport poll thread");
+    ALOGI("usbdp: setup: arming displayport handler");
     mPartnerSupportsDisplayPort = true;
+    mDisplayPortArmed = true;
+    postDisplayPortRequest(DISPLAYPORT_REQUEST_ARM);
+}
 
-    /*
-     * If thread is currently starting, then it hasn't setup DisplayPort fd's, and we can abandon
-     * this process.
-     */
-    if (mDisplayPortPollStarting) {
-        ALOGI("usbdp: setup: abandoning poll thread because another startup is in progress");
-        return;
-    }
+void Usb::shutdownDisplayPortPoll(bool force) {
+    string displayPortUsbPath;
+
+    ALOGI("usbdp: shutdown: disarming displayport handler");
 
     /*
-     * Check to see if thread is currently running. If it is, then we assume that it must have
-     * invalid DisplayPort fd's and the new thread takes over.
+     * Determine if should disarm the handler
+     *
+     * getDisplayPortUsbPathHelper locates a DisplayPort directory, no need to double check
+     * directory.
+     *
+     * Force is put in place to disarm even when displayPortUsbPath is still present.
      */
-    if (mDisplayPortPollRunning) {
-        shutdownDisplayPortPoll(true);
-        pthread_mutex_lock(&mDisplayPortCVLock);
-        struct timespec to = setTimespecTimer(DISPLAYPORT_POLL_WAIT_MS);
-        ret = pthread_cond_timedwait(&mDisplayPortCV, &mDisplayPortCVLock, &to);
-        if (ret == ETIMEDOUT) {
-            ALOGI("usbdp: setup: Wait for poll to shutdown timed out, starting new poll anyways.");
-        }
-        pthread_mutex_unlock(&mDisplayPortCVLock);
+    if (!mDisplayPortArmed ||
+        (!force && getDisplayPortUsbPathHelper(&displayPortUsbPath) == Status::SUCCESS)) {
+        return;
     }
 
-    // Indicate that startup procedure is initiated (mutex protects two threads running setup at
-    // once)
-    mDisplayPortPollStarting = true;
+    // Disarming is nonblocking to let other usb operations continue
+    mDisplayPortArmed = false;
+    postDisplayPortRequest(DISPLAYPORT_REQUEST_DISARM);
+}
 
-    // Reset shutdown signals because shutdown() does not perform self clean-up
-    write(mDisplayPortEventPipe, &flag, sizeof(flag));
-    destroyDisplayPortThread = false;
+/*
+ * Replays a recorded thermal trace through a fresh UsbThermalController, polling the trace at
+ * the intervals the controller picks and interpolating between recorded samples. The trace does
+ * not react to the limits, so the report is the lead time of the first step over the first trip
+ * crossing and the polls compared to fixed kSamplingIntervalSec sampling.
+ */
+status_t Usb::replayThermalTrace(int in, int out, int tripDeciC) {
+    std::vector<std::pair<int64_t, int>> samples;
+    string contents, error;
+    int64_t firstStepMs = -1, firstTripMs = -1;
+    int polls = 0, stepsDown = 0, stepsUp = 0, level = 0, maxLevel = 0;
+    size_t index = 0;
+
+    if (!::android::base::ReadFdToString(in, &contents) ||
+        !parseUsbThermalTrace(contents, &samples, &error) || samples.empty()) {
+        dprintf(out, "Failed to read thermal trace: %s\n", error.c_str());
+        return ::android::UNKNOWN_ERROR;
+    }
+    if (tripDeciC <= 0)
+        tripDeciC = mThermalTripDeciC.load();
+    if (tripDeciC <= 0)
+        tripDeciC = thermalTripDeciCHelper();
+    if (tripDeciC <= 0) {
+        dprintf(out, "No trip temperature, pass TRIP_DECI_C\n");
+        return ::android::UNKNOWN_ERROR;
+    }
+
+    for (const auto &[timeMs, temperatureDeciC] : samples) {
+        if (firstTripMs < 0 && temperatureDeciC >= tripDeciC)
+            firstTripMs = timeMs - samples.front().first;
+    }
+
+    UsbThermalController controller(defaultUsbThermalConfig(tripDeciC));
+    for (int64_t timeMs = samples.front().first; timeMs <= samples.back().first; polls++) {
+        int temperatureDeciC;
+
+        while (index + 1 < samples.size() && samples[index + 1].first <= timeMs)
+            index++;
+        temperatureDeciC = samples[index].second;
+        if (index + 1 < samples.size()) {
+            const auto &from = samples[index], &to = samples[index + 1];
+            temperatureDeciC += (int64_t)(to.second - from.second) * (timeMs - from.first) /
+                                (to.first - from.first);
+        }
 
-    /*
-     * Create a background thread to poll DisplayPort system files
-     */
-    if (pthread_create(&mDisplayPortPoll, NULL, displayPortPollWork, this)) {
-        ALOGE("usbdp: setup: failed to create displayport poll thread %d", errno);
-        goto error;
+        UsbThermalController::Decision decision = controller.update(timeMs, temperatureDeciC);
+        if (decision.changed) {
+            dprintf(out, "%" PRId64 " ms: %d dC slope %d dC/min -> level %d (%d mA)\n",
+                    timeMs - samples.front().first, temperatureDeciC, decision.slopeDeciCPerMin,
+                    decision.level, decision.sinkCurrentMa);
+            if (decision.level > level) {
+                stepsDown++;
+                if (firstStepMs < 0)
+                    firstStepMs = timeMs - samples.front().first;
+            } else {
+                stepsUp++;
+            }
+            level = decision.level;
+            maxLevel = std::max(maxLevel, level);
+        }
+        timeMs += decision.nextSampleMs;
     }
-    ALOGI("usbdp: setup: successfully started displayport poll thread");
-    return;
 
-error:
-    mDisplayPortPollStarting = false;
-    return;
+    int64_t durationMs = samples.back().first - samples.front().first;
+    dprintf(out, "trip %d dC, %zu samples over %" PRId64 " ms\n", tripDeciC, samples.size(),
+            durationMs);
+    dprintf(out, "polls: %d (fixed %d s sampling: %" PRId64 ")\n", polls, kSamplingIntervalSec,
+            durationMs / (kSamplingIntervalSec * 1000) + 1);
+    dprintf(out, "limit steps: %d down %d up, max level %d\n", stepsDown, stepsUp, maxLevel);
+    if (firstTripMs >= 0 && firstStepMs >= 0) {
+        dprintf(out, "trip first reached at %" PRId64 " ms, first step %" PRId64 " ms ahead\n",
+                firstTripMs, firstTripMs - firstStepMs);
+    } else if (firstTripMs >= 0) {
+        dprintf(out, "trip first reached at %" PRId64 " ms without a step\n", firstTripMs);
+    }
+    return ::android::NO_ERROR;
 }
 
-void Usb::shutdownDisplayPortPollHelper() {
-    uint64_t flag = DISPLAYPORT_SHUTDOWN_SET;
+void Usb::recordPortEvent(UsbPortEvent event) {
+    uint32_t timeMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
 
-    // Write shutdown signal to child thread.
-    write(mDisplayPortEventPipe, &flag, sizeof(flag));
-    pthread_join(mDisplayPortPoll, NULL);
-    writeDisplayPortAttributeOverride("hpd", "0");
-    pthread_mutex_lock(&mDisplayPortCVLock);
-    pthread_cond_signal(&mDisplayPortCV);
-    pthread_mutex_unlock(&mDisplayPortCVLock);
-}
-
-void *shutdownDisplayPortPollWork(void *param) {
-    ::aidl::android::hardware::usb::Usb *usb = (::aidl::android::hardware::usb::Usb *)param;
+    pthread_mutex_lock(&mPortStateLock);
+    UsbPortStateMachine::Transition transition = mPortStateMachine.update(timeMs, event);
+    mPortTrace.append({timeMs, event, transition.to, mPortStateMachine.partner()});
+    pthread_mutex_unlock(&mPortStateLock);
 
-    usb->shutdownDisplayPortPollHelper();
-    ALOGI("usbdp: shutdown: displayport thread shutdown complete.");
-    return NULL;
+    if (!transition.expected) {
+        USB_LOGI_RATELIMITED("port state: unexpected %s in %s", usbPortEventName(event),
+                             usbPortStateName(transition.from));
+    } else if (transition.from != transition.to) {
+        USB_LOGV("port state: %s -> %s on %s", usbPortStateName(transition.from),
+                 usbPortStateName(transition.to), usbPortEventName(event));
+    }
 }
 
-void Usb::shutdownDisplayPortPoll(bool force) {
-    string displayPortUsbPath;
-
-    ALOGI("usbdp: shutdown: beginning shutdown for displayport poll thread");
+/*
+ * Re-runs the recorded events through a fresh UsbPortStateMachine from the state the trace
+ * starts in, printing every transition and where the replay disagrees with the recorded state,
+ * then the time spent per state and the plug to display and role switch durations.
+ */
+status_t Usb::replayPortTrace(int in, int out) {
+    std::vector<UsbPortTraceRecord> records;
+    UsbPortTraceRecord base;
+    string contents, error;
+    int64_t attachMs = -1, roleSwitchMs = -1, plugToDisplayMaxMs = 0, roleSwitchMaxMs = 0;
+    int plugToDisplayCount = 0, roleSwitchCount = 0, divergences = 0;
+
+    if (!::android::base::ReadFdToString(in, &contents) ||
+        !parseUsbPortTrace(contents, &base, &records, &error) || records.empty()) {
+        dprintf(out, "Failed to read port trace: %s\n", error.c_str());
+        return ::android::UNKNOWN_ERROR;
+    }
+
+    // Times are relative to the first record, which also keeps the replay clear of wraparound
+    uint32_t startMs = records.front().timeMs;
+    UsbPortStateMachine machine;
+    machine.reset(0, base.state, base.partner);
+    for (const UsbPortTraceRecord &record : records) {
+        uint32_t timeMs = record.timeMs - startMs;
+        UsbPortStateMachine::Transition transition = machine.update(timeMs, record.event);
+        bool diverged = transition.to != record.state || machine.partner() != record.partner;
+
+        if (transition.from != transition.to || !transition.expected || diverged) {
+            dprintf(out, "%u ms: %s %s -> %s%s", timeMs, usbPortEventName(record.event),
+                    usbPortStateName(transition.from), usbPortStateName(transition.to),
+                    transition.expected ? "" : " (unexpected)");
+            if (diverged)
+                dprintf(out, " recorded %s", usbPortStateName(record.state));
+            dprintf(out, "\n");
+        }
+        if (diverged) {
+            divergences++;
+            // Follow the recording so one divergence is not reported for every later record
+            machine.reset(timeMs, record.state, record.partner);
+        }
 
-    /*
-     * Determine if should shutdown thread
-     *
-     * getDisplayPortUsbPathHelper locates a DisplayPort directory, no need to double check
-     * directory.
-     *
-     * Force is put in place to shutdown even when displayPortUsbPath is still present.
-     * Happens when back to back BIND events are sent and fds are no longer current.
-     */
-    if (!mDisplayPortPollRunning ||
-        (!force && getDisplayPortUsbPathHelper(&displayPortUsbPath) == Status::SUCCESS)) {
-        return;
+        if (transition.from == UsbPortState::DETACHED && transition.to != UsbPortState::DETACHED)
+            attachMs = timeMs;
+        if (transition.to == UsbPortState::DISPLAYPORT_ACTIVE && attachMs >= 0) {
+            plugToDisplayMaxMs = std::max(plugToDisplayMaxMs, timeMs - attachMs);
+            plugToDisplayCount++;
+            attachMs = -1;
+        }
+        if (transition.to == UsbPortState::DETACHED)
+            attachMs = -1;
+        if (transition.from != UsbPortState::ROLE_SWITCHING &&
+            transition.to == UsbPortState::ROLE_SWITCHING) {
+            roleSwitchMs = timeMs;
+        } else if (transition.from == UsbPortState::ROLE_SWITCHING &&
+                   transition.to != UsbPortState::ROLE_SWITCHING && roleSwitchMs >= 0) {
+            roleSwitchMaxMs = std::max(roleSwitchMaxMs, timeMs - roleSwitchMs);
+            roleSwitchCount++;
+            roleSwitchMs = -1;
+        }
     }
 
-    // Shutdown is nonblocking to let other usb operations continue
-    if (pthread_create(&mDisplayPortShutdownHelper, NULL, shutdownDisplayPortPollWork, this)) {
-        ALOGE("usbdp: shutdown: shutdown worker pthread creation failed %d", errno);
+    uint32_t durationMs = records.back().timeMs - startMs;
+    dprintf(out, "%zu records over %u ms starting %s, %" PRIu64 " unexpected, %d diverged\n",
+            records.size(), durationMs, usbPortStateName(base.state),
+            machine.unexpectedEvents(), divergences);
+    if (!divergences) {
+        for (int state = 0; state < static_cast<int>(UsbPortState::COUNT); state++) {
+            dprintf(out, "%s: %" PRIu64 " ms\n",
+                    usbPortStateName(static_cast<UsbPortState>(state)),
+                    machine.dwellMs(static_cast<UsbPortState>(state), durationMs));
+        }
     }
+    dprintf(out, "plug to display: %d max %" PRId64 " ms\n", plugToDisplayCount,
+            plugToDisplayMaxMs);
+    dprintf(out, "role switches: %d max %" PRId64 " ms\n", roleSwitchCount, roleSwitchMaxMs);
+    return ::android::NO_ERROR;
+}
+
+const UsbMetrics &Usb::metrics() {
+    return sMetrics;
 }
 
 status_t Usb::handleShellCommand(int in, int out, int err, const char** argv,
@@ -2048,6 +3202,121 @@ status_t Usb::handleShellCommand(int in, int out, int err, const char** argv,
             mUsbHubVendorCmdIndex = index;
             ALOGI("USB hub vendor cmd update (wValue 0x%x, wIndex 0x%x)\n",
                   mUsbHubVendorCmdValue, mUsbHubVendorCmdIndex);
+            // Rebuild the built-in profiles with the new settings
+            string error;
+            if (loadUsbHubProfiles(&error) != Status::SUCCESS)
+                dprintf(out, "Malformed %s kept the previous profiles: %s\n",
+                        USB_HUB_PROFILES_PATH, error.c_str());
+            return ::android::NO_ERROR;
+        } else if (!utf8Args[0].compare(String8("hub-profiles"))) {
+            if (argc >= 2 && !utf8Args[1].compare(String8("reload"))) {
+                string error;
+                if (loadUsbHubProfiles(&error) != Status::SUCCESS) {
+                    dprintf(out, "Malformed %s: %s\n", USB_HUB_PROFILES_PATH, error.c_str());
+                    return ::android::UNKNOWN_ERROR;
+                }
+            }
+            pthread_mutex_lock(&mUsbHubProfilesLock);
+            for (const UsbHubProfile &profile : mUsbHubProfiles) {
+                dprintf(out, "%04x:%04x %s", profile.id.vendorId, profile.id.productId,
+                        profile.name.c_str());
+                for (const UsbHubCommand &command : profile.commands) {
+                    dprintf(out, " %02x:%02x:%04x:%04x", command.requestType, command.request,
+                            command.value, command.index);
+                }
+                dprintf(out, "\n");
+            }
+            for (const auto &[name, stats] : mUsbHubProfileStats) {
+                dprintf(out, "%s: applied %u failed %u last %" PRId64 " us max %" PRId64 " us\n",
+                        name.c_str(), stats.applied, stats.failed, stats.lastUs, stats.maxUs);
+            }
+            pthread_mutex_unlock(&mUsbHubProfilesLock);
+            return ::android::NO_ERROR;
+        } else if (!utf8Args[0].compare(String8("latency"))) {
+            dprintf(out, "uevents: %" PRIu64 " dropped: %" PRIu64 "\n", sUeventCount.value(),
+                    sUeventDropped.value());
+            for (LatencyHistogram *histogram : kLatencyHistograms) {
+                histogram->dump(out);
+            }
+            if (argc >= 2 && !utf8Args[1].compare(String8("reset"))) {
+                for (LatencyHistogram *histogram : kLatencyHistograms) {
+                    histogram->reset();
+                }
+            }
+            return ::android::NO_ERROR;
+        } else if (!utf8Args[0].compare(String8("thermal"))) {
+            dprintf(out, "enabled: %d trip %d dC\n",
+                    GetBoolProperty(USB_THERMAL_CONTROL_PROPERTY, false) ? 1 : 0,
+                    mThermalTripDeciC.load());
+            dprintf(out, "temperature %d dC slope %d dC/min, level %d, sink limit %d mA, next "
+                         "sample %d ms\n",
+                    mThermalTemperatureDeciC.load(), mThermalSlopeDeciCPerMin.load(),
+                    mThermalLevel.load(), mThermalSinkLimitMa.load(), mThermalSampleMs.load());
+            return ::android::NO_ERROR;
+        } else if (!utf8Args[0].compare(String8("thermal-replay"))) {
+            int tripDeciC = 0;
+            if (argc >= 2 && !::android::base::ParseInt(utf8Args[1].c_str(), &tripDeciC, 1)) {
+                dprintf(out, "Fail to parse arguments\n");
+                return ::android::UNKNOWN_ERROR;
+            }
+            return replayThermalTrace(in, out, tripDeciC);
+        } else if (!utf8Args[0].compare(String8("metrics"))) {
+            sMetrics.dump(out);
+            if (argc >= 2 && !utf8Args[1].compare(String8("reset")))
+                sMetrics.reset();
+            return ::android::NO_ERROR;
+        } else if (!utf8Args[0].compare(String8("port-state"))) {
+            uint32_t timeMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+
+            pthread_mutex_lock(&mPortStateLock);
+            dprintf(out, "state: %s partner: %d unexpected events: %" PRIu64 "\n",
+                    usbPortStateName(mPortStateMachine.state()),
+                    mPortStateMachine.partner() ? 1 : 0, mPortStateMachine.unexpectedEvents());
+            for (int state = 0; state < static_cast<int>(UsbPortState::COUNT); state++) {
+                dprintf(out, "%s: %" PRIu64 " ms\n",
+                        usbPortStateName(static_cast<UsbPortState>(state)),
+                        mPortStateMachine.dwellMs(static_cast<UsbPortState>(state), timeMs));
+            }
+            dprintf(out, "trace: %zu records, %" PRIu64 " overwritten\n", mPortTrace.size(),
+                    mPortTrace.overwritten());
+            pthread_mutex_unlock(&mPortStateLock);
+            return ::android::NO_ERROR;
+        } else if (!utf8Args[0].compare(String8("port-trace"))) {
+            pthread_mutex_lock(&mPortStateLock);
+            string trace = mPortTrace.serialize();
+            pthread_mutex_unlock(&mPortStateLock);
+            if (!::android::base::WriteFully(out, trace.data(), trace.size()))
+                return ::android::UNKNOWN_ERROR;
+            return ::android::NO_ERROR;
+        } else if (!utf8Args[0].compare(String8("port-trace-replay"))) {
+            return replayPortTrace(in, out);
+        } else if (!utf8Args[0].compare(String8("executor"))) {
+            mExecutor.dump(out);
+            return ::android::NO_ERROR;
+        } else if (!utf8Args[0].compare(String8("log-verbose"))) {
+            if (argc >= 2) {
+                if (!utf8Args[1].compare(String8("on"))) {
+                    LogRateLimiter::setVerbose(true);
+                } else if (!utf8Args[1].compare(String8("off"))) {
+                    LogRateLimiter::setVerbose(false);
+                } else {
+                    dprintf(out, "log-verbose: expected on or off\n");
+                    return ::android::BAD_VALUE;
+                }
+            }
+            dprintf(out, "log-verbose: %s\n", LogRateLimiter::verbose() ? "on" : "off");
+            LogRateLimiter::dump(out);
+            return ::android::NO_ERROR;
+        } else if (!utf8Args[0].compare(String8("displayport-stats"))) {
+            dprintf(out, "armed: %d\n", mDisplayPortArmed.load() ? 1 : 0);
+            dprintf(out, "first hpd forward after bind: count %u last %" PRId64 " ms max %" PRId64
+                         " ms\n",
+                    mDisplayPortHpdLatencyCount.load(), mDisplayPortHpdLatencyLastMs.load(),
+                    mDisplayPortHpdLatencyMaxMs.load());
+            dprintf(out, "framework updates: early %u storm backoffs %u window %d ms\n",
+                    mDisplayPortEarlyUpdateCount.load(), mDisplayPortStormBackoffCount.load(),
+                    mDisplayPortDebounceWindowMs.load());
             return ::android::NO_ERROR;
         }
     }
@@ -2055,7 +3324,37 @@ status_t Usb::handleShellCommand(int in, int out, int err, const char** argv,
     dprintf(out, "usage: adb shell cmd hub-vendor-cmd VALUE INDEX\n"
                  "  VALUE wValue field in hex format, e.g. 0xf321\n"
                  "  INDEX wIndex field in hex format, e.g. 0xf321\n"
-                 "  The settings take effect next time the hub is enabled\n");
+                 "  The settings take effect next time the hub is enabled\n"
+                 "usage: adb shell cmd hub-profiles [reload]\n"
+                 "  Print the hub vendor command profiles and the time taken to apply them,\n"
+                 "  optionally reloading them from " USB_HUB_PROFILES_PATH " first\n"
+                 "usage: adb shell cmd latency [reset]\n"
+                 "  Print latency histograms of the hotplug pipeline, optionally resetting them\n"
+                 "usage: adb shell cmd thermal\n"
+                 "  Print the state of the thermal controller enabled by\n"
+                 "  " USB_THERMAL_CONTROL_PROPERTY "\n"
+                 "usage: adb shell cmd thermal-replay [TRIP_DECI_C] < FILE\n"
+                 "  Replay a thermal trace of TIME_MS TEMPERATURE_DECI_C lines through the\n"
+                 "  thermal controller and print its limit steps and polling\n"
+                 "usage: adb shell cmd metrics [reset]\n"
+                 "  Print the HAL counters and latency summaries as NAME VALUE lines,\n"
+                 "  optionally resetting them\n"
+                 "usage: adb shell cmd port-state\n"
+                 "  Print the modelled port state and the time spent in each state\n"
+                 "usage: adb exec-out cmd port-trace > FILE\n"
+                 "  Write the recorded port events in their binary trace format\n"
+                 "usage: adb shell cmd port-trace-replay < FILE\n"
+                 "  Replay a recorded port trace through the port state machine and print its\n"
+                 "  transitions, the time spent per state and the plug to display latency\n"
+                 "usage: adb shell cmd executor\n"
+                 "  Print the running, queued, completed and rejected IUsb operations of each\n"
+                 "  executor lane\n"
+                 "usage: adb shell cmd log-verbose [on|off]\n"
+                 "  Log the hot path detail and stop rate limiting its messages, and print\n"
+                 "  the messages each rate limited call site suppressed\n"
+                 "usage: adb shell cmd displayport-stats\n"
+                 "  Print the time from DisplayPort partner bind to the first HPD forward and\n"
+                 "  the adaptive framework update debounce counters\n");
 
     return ::android::NO_ERROR;
 }
@@ -21,17 +21,36 @@
 #include <aidl/android/hardware/usb/BnUsbCallback.h>
 #include <pixelusb/UsbOverheatEvent.h>
 #include <sys/eventfd.h>
+#include <atomic>
+#include <map>
 #include <utils/Log.h>
 #include <UsbDataSessionMonitor.h>
+#include "UsbCallbackDispatcher.h"
+#include "UsbExecutor.h"
+#include "UsbHubMatcher.h"
+#include "UsbMetrics.h"
+#include "UsbPortStateMachine.h"
+#include "UsbStatsReporter.h"
+#include "UsbThermalController.h"
 
-#define UEVENT_MSG_LEN 2048
 // The type-c stack waits for 4.5 - 5.5 secs before declaring a port non-pd.
 // The -partner directory would not be created until this is done.
 // Having a margin of ~3 secs for the directory and other related bookeeping
-// structures created and uvent fired.
+// structures created and uvent fired. A port type switch that has not completed
+// by then is reported as failed and the port is switched back to drp.
 #define PORT_TYPE_TIMEOUT 8
 #define DISPLAYPORT_CAPABILITIES_RECEPTACLE_BIT 6
+/*
+ * Window the DisplayPort handler waits for hpd, pin_assignment, orientation and link_status
+ * to settle before the framework is updated. Once the drm reports a trained link the update
+ * is sent after DISPLAYPORT_STATUS_SETTLE_MS without further events instead. A burst of more
+ * than DISPLAYPORT_STATUS_STORM_EVENTS events, forwarded IRQ_HPDs included, doubles the window
+ * up to DISPLAYPORT_STATUS_DEBOUNCE_MAX_MS until a burst ends below the threshold again.
+ */
 #define DISPLAYPORT_STATUS_DEBOUNCE_MS 2000
+#define DISPLAYPORT_STATUS_DEBOUNCE_MAX_MS 8000
+#define DISPLAYPORT_STATUS_SETTLE_MS 100
+#define DISPLAYPORT_STATUS_STORM_EVENTS 16
 /*
  * Type-C HAL should wait 2 seconds to reattempt DisplayPort Alt Mode entry to
  * allow the port and port partner to settle Role Swaps.
@@ -70,17 +89,24 @@ constexpr char kGadgetName[] = "11210000.dwc3";
 
 #define DISPLAYPORT_ACTIVE_PATH "/sys/class/typec/port0/port0.0/mode1/active"
 
-#define LINK_TRAINING_STATUS_UNKNOWN "0"
-#define LINK_TRAINING_STATUS_SUCCESS "1"
-#define LINK_TRAINING_STATUS_FAILURE "2"
-#define LINK_TRAINING_STATUS_FAILURE_SINK "3"
-
-#define DISPLAYPORT_SHUTDOWN_CLEAR 0
-#define DISPLAYPORT_SHUTDOWN_SET 1
-#define DISPLAYPORT_IRQ_HPD_COUNT_CHECK 3
+// Requests posted to the DisplayPort handler thread through mDisplayPortEventPipe
+#define DISPLAYPORT_REQUEST_ARM (1 << 0)
+#define DISPLAYPORT_REQUEST_DISARM (1 << 1)
+#define DISPLAYPORT_REQUEST_IRQ_HPD_COUNT_CHECK (1 << 2)
+// Size of the stack buffer used to forward hpd, "0\n" or "1\n" plus terminator
+#define DISPLAYPORT_HPD_MAX_LEN 8
+// Size of the stack buffer used to forward irq_hpd_count, a decimal uint32_t plus newline
+#define DISPLAYPORT_IRQ_HPD_COUNT_MAX_LEN 16
 
-#define DISPLAYPORT_POLL_WAIT_MS 100
-#define ROLE_SWAP_RETRY_MS 700
+/*
+ * Data and power role writes that fail with EAGAIN/EBUSY are retried with an exponential
+ * backoff starting at ROLE_SWAP_RETRY_INITIAL_MS, at most ROLE_SWAP_RETRY_MAX_ATTEMPTS times.
+ * The new role is then confirmed by waiting up to ROLE_SWAP_CONFIRM_TIMEOUT_MS for the kernel
+ * to reflect it. The defaults can be overridden by the vendor.usb.role_swap_* properties.
+ */
+#define ROLE_SWAP_RETRY_INITIAL_MS 100
+#define ROLE_SWAP_RETRY_MAX_ATTEMPTS 4
+#define ROLE_SWAP_CONFIRM_TIMEOUT_MS 1000
 
 #define SVID_DISPLAYPORT "ff01"
 #define SVID_THUNDERBOLT "8087"
@@ -103,27 +129,68 @@ struct Usb : public BnUsb {
     ScopedAStatus resetUsbPort(const string& in_portName, int64_t in_transactionId) override;
 
     Status getDisplayPortUsbPathHelper(string *path);
+    Status queryPartnerSvids(std::vector<string> *svids);
+    void invalidatePartnerAltModes();
+    // Called by the uevent thread once it subscribed and when it exits
+    void trackPartnerAltModes(bool tracked);
     Status readDisplayPortAttribute(string attribute, string usb_path, string* value);
     Status writeDisplayPortAttributeOverride(string attribute, string value);
     Status writeDisplayPortAttribute(string attribute, string usb_path);
     bool determineDisplayPortRetry(string linkPath, string hpdPath);
+    void postDisplayPortRequest(uint32_t request);
     void setupDisplayPortPoll();
-    void shutdownDisplayPortPollHelper();
     void shutdownDisplayPortPoll(bool force);
+    void startModeSwitch(const string &portName, const PortRole &role, int64_t transactionId);
+    void completeRoleSwitch(Status status);
+    void checkRoleSwitchCompletion(const std::vector<PortStatus> &currentPortStatus);
+    void notifyRoleSwitch(const string &portName, const PortRole &role, Status status,
+                          int64_t transactionId);
+    // Replays a recorded thermal trace read from in through a UsbThermalController
+    status_t replayThermalTrace(int in, int out, int tripDeciC);
+    // Applies a UsbThermalController sink current limit, -1 lifting it
+    void applyThermalSinkLimit(int sinkCurrentMa);
+    // Feeds event to mPortStateMachine and records it in mPortTrace
+    void recordPortEvent(UsbPortEvent event);
+    // Replays a trace written by the "port-trace" shell command read from in
+    status_t replayPortTrace(int in, int out);
     status_t handleShellCommand(int in, int out, int err, const char** argv,
             uint32_t argc) override;
+    // Registry of the counters and histograms the "metrics" shell command prints
+    static const UsbMetrics &metrics();
 
-    std::shared_ptr<::aidl::android::hardware::usb::IUsbCallback> mCallback;
-    // Protects mCallback variable
+    // Delivers IUsbCallback notifications without holding any HAL lock
+    UsbCallbackDispatcher mCallbackDispatcher;
+    // Sends IStats reports off the uevent thread
+    UsbStatsReporter mStatsReporter;
+    // Runs the IUsb operations queued by the binder thread
+    UsbExecutor mExecutor;
+    // Serializes port status queries and callback registration
     pthread_mutex_t mLock;
-    // Protects roleSwitch operation
+    // Protects roleSwitch operation and mPendingRoleSwitch
     pthread_mutex_t mRoleSwitchLock;
-    // Threads waiting for the partner to come back wait here
-    pthread_cond_t mPartnerCV;
-    // lock protecting mPartnerCV
-    pthread_mutex_t mPartnerLock;
-    // Variable to signal partner coming back online after type switch
-    bool mPartnerUp;
+    /*
+     * Port type switch waiting for the port to settle. switchRole() returns as soon as the port
+     * type is written; the result is reported through notifyRoleSwitchStatus once the partner
+     * comes back, the port reaches the requested mode or mRoleSwitchTimer expires.
+     */
+    struct PendingRoleSwitch {
+        bool active;
+        string portName;
+        PortRole role;
+        // Transactions coalesced into this switch, notified together on completion
+        std::vector<int64_t> transactionIds;
+        // Set once the port is seen disconnected after the port type was written
+        bool partnerDown;
+        struct timespec start;
+    } mPendingRoleSwitch;
+    // timerfd armed for PORT_TYPE_TIMEOUT while mPendingRoleSwitch is active
+    int mRoleSwitchTimer;
+    // Model of the port fed by the uevent, role switch and DisplayPort handlers
+    UsbPortStateMachine mPortStateMachine;
+    // Events fed to mPortStateMachine, dumped by the "port-trace" shell command
+    UsbPortTrace mPortTrace;
+    // Protects mPortStateMachine and mPortTrace
+    pthread_mutex_t mPortStateLock;
 
     // Report usb data session event and data incompliance warnings
     UsbDataSessionMonitor mUsbDataSessionMonitor;
@@ -131,24 +198,55 @@ struct Usb : public BnUsb {
     UsbOverheatEvent mOverheat;
     // Temperature when connected
     float mPluggedTemperatureCelsius;
-    // Usb Data status
-    bool mUsbDataEnabled;
+    // Usb Data status, read by the port status queries on other executor lanes
+    std::atomic<bool> mUsbDataEnabled;
+    // Protected by mLock
     std::string mI2cClientPath;
 
-    // True when mDisplayPortPoll pthread is running
-    volatile bool mDisplayPortPollRunning;
-    volatile bool mDisplayPortPollStarting;
-    pthread_cond_t mDisplayPortCV;
-    pthread_mutex_t mDisplayPortCVLock;
-    volatile bool mDisplayPortFirstSetupDone;
+    // True while the DisplayPort handler is asked to monitor a bound partner
+    std::atomic<bool> mDisplayPortArmed;
+    std::atomic<bool> mDisplayPortFirstSetupDone;
+    // Bitmask of pending DISPLAYPORT_REQUEST_* for the DisplayPort handler
+    uint32_t mDisplayPortRequests;
+    // Time of the last DISPLAYPORT_REQUEST_ARM, used to measure time to first HPD forward
+    struct timespec mDisplayPortArmRequestTime;
+    // Protects mDisplayPortRequests and mDisplayPortArmRequestTime
+    pthread_mutex_t mDisplayPortRequestLock;
+    /*
+     * Written by the DisplayPort handler and read by the displayport-stats shell command.
+     * Time from partner bind to the first HPD written to the drm, in milliseconds.
+     */
+    std::atomic<int64_t> mDisplayPortHpdLatencyLastMs;
+    std::atomic<int64_t> mDisplayPortHpdLatencyMaxMs;
+    std::atomic<uint32_t> mDisplayPortHpdLatencyCount;
+    // Framework updates sent early on a trained link, and debounce window backoffs under storms
+    std::atomic<uint32_t> mDisplayPortEarlyUpdateCount;
+    std::atomic<uint32_t> mDisplayPortStormBackoffCount;
+    // Current framework update debounce window of the DisplayPort handler, in milliseconds
+    std::atomic<int> mDisplayPortDebounceWindowMs;
+    /*
+     * Alt modes of port0-partner, scanned on first use after mPartnerAltModesValid is cleared
+     * by a partner or alt mode add/remove or a typec_displayport bind/unbind uevent.
+     */
+    bool mPartnerAltModesValid;
+    // Whether the uevent thread is subscribed; without it every lookup scans again
+    bool mPartnerAltModesTracked;
+    // Whether port0-partner existed at the last scan
+    bool mPartnerPresent;
+    // DisplayPort alt mode directory of the partner, empty when it has none
+    string mDisplayPortUsbPath;
+    std::vector<string> mPartnerSvids;
+    // Protects the partner alt mode cache
+    pthread_mutex_t mPartnerAltModesLock;
     // Used to cache the values read from tcpci's irq_hpd_count.
     // Update drm driver when cached value is not the same as the read value.
+    // Only accessed by the DisplayPort handler thread.
     uint32_t mIrqHpdCountCache;
 
     // Protects writeDisplayPortToExynos(), setupDisplayPortPoll(), and
     // shutdownDisplayPortPoll()
     pthread_mutex_t mDisplayPortLock;
-    // eventfd to signal DisplayPort thread
+    // eventfd to wake up the DisplayPort thread when mDisplayPortRequests changes
     int mDisplayPortEventPipe;
 
     /*
@@ -168,15 +266,63 @@ struct Usb : public BnUsb {
      */
     bool mPartnerSupportsDisplayPort;
 
+    // Whether the framework limited power transfer through limitPowerTransfer()
+    bool mPowerTransferLimited;
+    /*
+     * Sink current limit applied by the thermal controller, -1 when none. Reset by
+     * limitPowerTransfer() so the controller re-applies its limit once the framework's is lifted.
+     */
+    std::atomic<int> mThermalSinkLimitMa;
+    // Last thermal controller sample, read without locks by the "thermal" shell command
+    std::atomic<int> mThermalTemperatureDeciC;
+    std::atomic<int> mThermalSlopeDeciCPerMin;
+    std::atomic<int> mThermalLevel;
+    std::atomic<int> mThermalSampleMs;
+    std::atomic<int> mThermalTripDeciC;
+
     // Usb hub vendor command settings for JK level tuning
     int mUsbHubVendorCmdValue;
     int mUsbHubVendorCmdIndex;
 
+    // Time taken by the vendor commands of a hub profile, from device open to the last command
+    struct UsbHubProfileStats {
+        uint32_t applied;
+        uint32_t failed;
+        int64_t lastUs;
+        int64_t maxUs;
+    };
+    /*
+     * (Re)builds mUsbHubProfiles from USB_HUB_PROFILES_PATH, followed by the built-in GL852G
+     * profiles for the ids the file does not cover. A malformed file keeps the profiles loaded
+     * before, or only the built-in ones on the first load.
+     */
+    Status loadUsbHubProfiles(string *error);
+    // Copies the profile matching id to profile, which may be NULL. Returns false without one.
+    bool findUsbHubProfile(UsbHubId id, UsbHubProfile *profile);
+    void recordUsbHubProfile(const string &name, bool success, int64_t elapsedUs);
+
   private:
+    // IUsb operations as run by mExecutor
+    void executeEnableContaminantPresenceDetection(const string &in_portName, bool in_enable,
+                                                   int64_t in_transactionId);
+    void executeQueryPortStatus(int64_t in_transactionId);
+    void executeSwitchRole(const string &in_portName, const PortRole &in_role,
+                           int64_t in_transactionId);
+    void executeEnableUsbData(const string &in_portName, bool in_enable, int64_t in_transactionId);
+    void executeEnableUsbDataWhileDocked(const string &in_portName, int64_t in_transactionId);
+    void executeLimitPowerTransfer(const string &in_portName, bool in_limit,
+                                   int64_t in_transactionId);
+    void executeResetUsbPort(const string &in_portName, int64_t in_transactionId);
+
+    std::vector<UsbHubProfile> mUsbHubProfiles;
+    // Kept per profile name so they survive reloads
+    std::map<string, UsbHubProfileStats> mUsbHubProfileStats;
+    // Protects mUsbHubProfiles and mUsbHubProfileStats
+    pthread_mutex_t mUsbHubProfilesLock;
     pthread_t mPoll;
     pthread_t mDisplayPortPoll;
-    pthread_t mDisplayPortShutdownHelper;
     pthread_t mUsbHost;
+    pthread_t mThermal;
 };
 
 } // namespace usb
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.aidl-service"
+
+#include "UsbCallbackDispatcher.h"
+
+#include <utils/Log.h>
+
+#include <algorithm>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+using ::ndk::ScopedAStatus;
+
+UsbCallbackDispatcher::UsbCallbackDispatcher(LatencyHistogram *latency,
+                                             LatencyHistogram *queueLatency,
+                                             MetricCounter *dropped)
+    : mLatency(latency),
+      mQueueLatency(queueLatency),
+      mDropped(dropped),
+      mLock(PTHREAD_MUTEX_INITIALIZER),
+      mCV(PTHREAD_COND_INITIALIZER) {
+    if (pthread_create(&mThread, NULL, dispatchThread, this)) {
+        ALOGE("pthread creation failed %d", errno);
+        abort();
+    }
+}
+
+void UsbCallbackDispatcher::setCallback(const std::shared_ptr<IUsbCallback> &callback) {
+    std::atomic_store(&mCallback, callback);
+}
+
+std::shared_ptr<IUsbCallback> UsbCallbackDispatcher::getCallback() const {
+    return std::atomic_load(&mCallback);
+}
+
+void UsbCallbackDispatcher::post(const char *name, Notification notification) {
+    if (getCallback() == NULL) {
+        ALOGE("Not notifying the userspace of %s. Callback is not set", name);
+        return;
+    }
+    enqueue({name, std::move(notification), false, std::chrono::steady_clock::now()});
+}
+
+void UsbCallbackDispatcher::postPortStatus(const std::vector<PortStatus> &currentPortStatus,
+                                           Status status) {
+    if (getCallback() == NULL) {
+        ALOGI("Notifying userspace skipped. Callback is NULL");
+        return;
+    }
+    enqueue({"notifyPortStatusChange",
+             [currentPortStatus, status](const std::shared_ptr<IUsbCallback> &callback) {
+                 return callback->notifyPortStatusChange(currentPortStatus, status);
+             },
+             true, std::chrono::steady_clock::now()});
+}
+
+void UsbCallbackDispatcher::enqueue(Entry entry) {
+    pthread_mutex_lock(&mLock);
+    if (entry.portStatus) {
+        // Only the latest port status matters to the framework
+        auto queued = std::find_if(mQueue.begin(), mQueue.end(),
+                                   [](const Entry &queued) { return queued.portStatus; });
+        if (queued != mQueue.end()) {
+            queued->notification = std::move(entry.notification);
+            pthread_mutex_unlock(&mLock);
+            return;
+        }
+    }
+    if (mQueue.size() >= USB_CALLBACK_DISPATCHER_MAX_QUEUED) {
+        pthread_mutex_unlock(&mLock);
+        mDropped->add();
+        ALOGE("%s dropped, %d notifications are queued", entry.name,
+              USB_CALLBACK_DISPATCHER_MAX_QUEUED);
+        return;
+    }
+    mQueue.push_back(std::move(entry));
+    pthread_cond_signal(&mCV);
+    pthread_mutex_unlock(&mLock);
+}
+
+void *UsbCallbackDispatcher::dispatchThread(void *param) {
+    UsbCallbackDispatcher *dispatcher = static_cast<UsbCallbackDispatcher *>(param);
+
+    pthread_setname_np(pthread_self(), "usb-callback");
+    while (true) {
+        pthread_mutex_lock(&dispatcher->mLock);
+        while (dispatcher->mQueue.empty())
+            pthread_cond_wait(&dispatcher->mCV, &dispatcher->mLock);
+        Entry entry = std::move(dispatcher->mQueue.front());
+        dispatcher->mQueue.pop_front();
+        pthread_mutex_unlock(&dispatcher->mLock);
+
+        dispatcher->mQueueLatency->record(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - entry.queued).count());
+
+        // The callback may have been replaced or cleared since the notification was queued
+        std::shared_ptr<IUsbCallback> callback = dispatcher->getCallback();
+        if (callback == NULL)
+            continue;
+
+        ScopedLatencyTrace trace(dispatcher->mLatency, entry.name);
+        ScopedAStatus ret = entry.notification(callback);
+        if (!ret.isOk())
+            ALOGE("%s error %s", entry.name, ret.getDescription().c_str());
+    }
+
+    return NULL;
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <aidl/android/hardware/usb/IUsbCallback.h>
+#include <pthread.h>
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "LatencyHistogram.h"
+#include "UsbMetrics.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+// Notifications queued while system_server is not keeping up before new ones are dropped
+#define USB_CALLBACK_DISPATCHER_MAX_QUEUED 64
+
+/*
+ * UsbCallbackDispatcher delivers IUsbCallback notifications from its own thread so that a slow
+ * system_server never stalls uevent processing or HAL methods holding mLock. The callback is
+ * published through an atomic shared_ptr: the dispatcher snapshots it for every notification and
+ * notifications posted while no callback is registered are dropped. Notifications are delivered
+ * in the order they are posted, except that a queued port status change is replaced in place by
+ * a newer one, so a transaction result posted after it still follows a port status.
+ */
+class UsbCallbackDispatcher {
+  public:
+    using Notification =
+        std::function<::ndk::ScopedAStatus(const std::shared_ptr<IUsbCallback> &callback)>;
+
+    /*
+     * latency records how long each callback takes, queueLatency how long notifications wait in
+     * the queue before being delivered, and dropped counts notifications refused by a full queue.
+     */
+    UsbCallbackDispatcher(LatencyHistogram *latency, LatencyHistogram *queueLatency,
+                          MetricCounter *dropped);
+    void setCallback(const std::shared_ptr<IUsbCallback> &callback);
+    std::shared_ptr<IUsbCallback> getCallback() const;
+    // Queues notification, name is used for tracing and error logs and must be a literal.
+    void post(const char *name, Notification notification);
+    // Queues a port status change, replacing one still waiting in the queue.
+    void postPortStatus(const std::vector<PortStatus> &currentPortStatus, Status status);
+
+  private:
+    struct Entry {
+        const char *name;
+        Notification notification;
+        bool portStatus;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    static void *dispatchThread(void *param);
+    void enqueue(Entry entry);
+
+    std::shared_ptr<IUsbCallback> mCallback;
+    LatencyHistogram *mLatency;
+    LatencyHistogram *mQueueLatency;
+    MetricCounter *mDropped;
+    pthread_t mThread;
+    // Protects mQueue
+    pthread_mutex_t mLock;
+    pthread_cond_t mCV;
+    std::deque<Entry> mQueue;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -18,11 +18,12 @@
 
 #include "UsbDataSessionMonitor.h"
 
+#include "UsbSysfs.h"
+
 #include <aidl/android/frameworks/stats/IStats.h>
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android_hardware_usb_flags.h>
-#include <cutils/uevent.h>
 #include <pixelstats/StatsHelper.h>
 #include <pixelusb/CommonUtils.h>
 #include <sys/epoll.h>
@@ -46,7 +47,6 @@ namespace android {
 namespace hardware {
 namespace usb {
 
-#define UEVENT_MSG_LEN 2048
 #define USB_STATE_MAX_LEN 20
 #define DATA_ROLE_MAX_LEN 10
 #define WARNING_SURFACE_DELAY_SEC 5
@@ -95,6 +95,21 @@ static void removeEpollFile(const int &epollFd, const std::string &filePath, uni
     ALOGI("epoll unregistered %s", filePath.c_str());
 }
 
+/*
+ * Returns the leading part of regex that matches only itself, e.g. to scope a uevent filter. A
+ * '.' is kept as a literal since devpaths only ever hold literal dots there. The character
+ * before a quantifier is dropped, and an alternation leaves no common prefix.
+ */
+static std::string regexLiteralPrefix(const std::string &regex) {
+    size_t end = regex.find_first_of("[()\\{}*+?|^$");
+
+    if (regex.find('|') != std::string::npos)
+        return "";
+    if (end != std::string::npos && end > 0 && strchr("{*+?", regex[end]))
+        end--;
+    return regex.substr(0, end);
+}
+
 UsbDataSessionMonitor::UsbDataSessionMonitor(
     const std::string &deviceUeventRegex, const std::string &deviceStatePath,
     const std::string &host1UeventRegex, const std::string &host1StatePath,
@@ -109,14 +124,21 @@ UsbDataSessionMonitor::UsbDataSessionMonitor(
         abort();
     }
 
-    unique_fd ueventFd(uevent_open_socket(64 * 1024, true));
-    if (ueventFd.get() == -1) {
-        ALOGE("uevent_open_socket failed");
+    /*
+     * Only the uevents under the monitored usb devices are queued for this thread. The handler
+     * matches the devpath against the regexes to tell the devices apart.
+     */
+    UeventFilter ueventFilter;
+    for (const std::string *regex : {&deviceUeventRegex, &host1UeventRegex, &host2UeventRegex})
+        ueventFilter.devpathPrefixes.push_back(regexLiteralPrefix(*regex));
+    std::shared_ptr<UeventSubscription> ueventSubscription =
+        UeventDispatcher::getInstance().subscribe(std::move(ueventFilter));
+    if (!ueventSubscription) {
+        ALOGE("uevent subscription failed");
         abort();
     }
-    fcntl(ueventFd, F_SETFL, O_NONBLOCK);
 
-    if (addEpollFd(epollFd, ueventFd))
+    if (addEpollFd(epollFd, ueventSubscription->fd()))
         abort();
 
     unique_fd timerFd(timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK));
@@ -139,23 +161,23 @@ UsbDataSessionMonitor::UsbDataSessionMonitor(
      * will be monitored later when its presence is detected by uevent.
      */
     mDeviceState.filePath = deviceStatePath;
-    mDeviceState.ueventRegex = deviceUeventRegex;
+    mDeviceState.ueventRegex = std::regex(deviceUeventRegex);
     addEpollFile(epollFd.get(), mDeviceState.filePath, mDeviceState.fd);
 
     mHost1State.filePath = host1StatePath;
-    mHost1State.ueventRegex = host1UeventRegex;
+    mHost1State.ueventRegex = std::regex(host1UeventRegex);
     addEpollFile(epollFd.get(), mHost1State.filePath, mHost1State.fd);
 
     mHost2State.filePath = host2StatePath;
-    mHost2State.ueventRegex = host2UeventRegex;
+    mHost2State.ueventRegex = std::regex(host2UeventRegex);
     addEpollFile(epollFd.get(), mHost2State.filePath, mHost2State.fd);
 
     mEpollFd = std::move(epollFd);
-    mUeventFd = std::move(ueventFd);
+    mUeventSubscription = std::move(ueventSubscription);
     mTimerFd = std::move(timerFd);
     mUpdatePortStatusCb = updatePortStatusCb;
 
-    if (ReadFileToString(kUdcConfigfsPath, &udc) && !udc.empty())
+    if (ReadFileToString(sysfsPath(kUdcConfigfsPath), &udc) && !udc.empty())
         mUdcBind = true;
     else
         mUdcBind = false;
@@ -169,7 +191,9 @@ UsbDataSessionMonitor::UsbDataSessionMonitor(
           usb_flags::enable_report_usb_data_compliance_warning());
 }
 
-UsbDataSessionMonitor::~UsbDataSessionMonitor() {}
+UsbDataSessionMonitor::~UsbDataSessionMonitor() {
+    UeventDispatcher::getInstance().unsubscribe(mUeventSubscription);
+}
 
 void UsbDataSessionMonitor::reportUsbDataSessionMetrics() {
     std::vector<VendorUsbDataSessionEvent> events;
@@ -376,7 +400,7 @@ void UsbDataSessionMonitor::updateUdcBindStatus(const std::string &devname) {
      * Ref: https://www.kernel.org/doc/Documentation/ABI/stable/sysfs-class-udc
      * Empty name string means the udc device is not bound and gadget is pulldown.
      */
-    if (!ReadFileToString("/sys" + devname + "/function", &function))
+    if (!ReadFileToString(sysfsPath("/sys" + devname + "/function"), &function))
         return;
 
     if (function == "")
@@ -407,48 +431,30 @@ void UsbDataSessionMonitor::updateUdcBindStatus(const std::string &devname) {
 }
 
 void UsbDataSessionMonitor::handleUevent() {
-    char msg[UEVENT_MSG_LEN + 2];
-    char *cp;
-    int n;
-
-    n = uevent_kernel_multicast_recv(mUeventFd.get(), msg, UEVENT_MSG_LEN);
-    if (n <= 0)
-        return;
-    if (n >= UEVENT_MSG_LEN)
-        return;
-
-    msg[n] = '\0';
-    msg[n + 1] = '\0';
-    cp = msg;
+    mUeventSubscription->drain([this](Uevent &uevent) { handleUeventMessage(uevent); });
+}
 
-    while (*cp) {
-        for (auto e : {&mHost1State, &mHost2State}) {
-            if (std::regex_search(cp, std::regex(e->ueventRegex))) {
-                if (!strncmp(cp, "bind@", strlen("bind@"))) {
-                    addEpollFile(mEpollFd.get(), e->filePath, e->fd);
-                } else if (!strncmp(cp, "unbind@", strlen("unbind@"))) {
-                    removeEpollFile(mEpollFd.get(), e->filePath, e->fd);
-                }
+void UsbDataSessionMonitor::handleUeventMessage(const Uevent &uevent) {
+    for (auto e : {&mHost1State, &mHost2State}) {
+        if (std::regex_search(uevent.devpath, e->ueventRegex)) {
+            if (uevent.action == "bind") {
+                addEpollFile(mEpollFd.get(), e->filePath, e->fd);
+            } else if (uevent.action == "unbind") {
+                removeEpollFile(mEpollFd.get(), e->filePath, e->fd);
             }
         }
+    }
 
-        // TODO: support bind@ unbind@ to detect dynamically allocated udc device
-        if (std::regex_search(cp, std::regex(mDeviceState.ueventRegex))) {
-            if (!strncmp(cp, "change@", strlen("change@"))) {
-                char *devname = cp + strlen("change@");
-                /*
-                 * Udc device emits a KOBJ_CHANGE event on configfs driver bind and unbind.
-                 * TODO: upstream udc driver emits KOBJ_CHANGE event BEFORE unbind is actually
-                 * executed. Add a short delay to get the correct state while working on a fix
-                 * upstream.
-                 */
-                usleep(50000);
-                updateUdcBindStatus(devname);
-            }
-        }
-        /* advance to after the next \0 */
-        while (*cp++) {
-        }
+    // TODO: support bind@ unbind@ to detect dynamically allocated udc device
+    if (uevent.action == "change" && std::regex_search(uevent.devpath, mDeviceState.ueventRegex)) {
+        /*
+         * Udc device emits a KOBJ_CHANGE event on configfs driver bind and unbind.
+         * TODO: upstream udc driver emits KOBJ_CHANGE event BEFORE unbind is actually
+         * executed. Add a short delay to get the correct state while working on a fix
+         * upstream.
+         */
+        usleep(50000);
+        updateUdcBindStatus(uevent.devpath);
     }
 }
 
@@ -484,7 +490,7 @@ void *UsbDataSessionMonitor::monitorThread(void *param) {
         }
 
         for (int n = 0; n < nevents; ++n) {
-            if (events[n].data.fd == monitor->mUeventFd.get()) {
+            if (events[n].data.fd == monitor->mUeventSubscription->fd().get()) {
                 monitor->handleUevent();
             } else if (events[n].data.fd == monitor->mTimerFd.get()) {
                 monitor->handleTimerEvent();
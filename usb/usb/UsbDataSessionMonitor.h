@@ -21,10 +21,13 @@
 #include <android-base/chrono_utils.h>
 #include <android-base/unique_fd.h>
 
+#include <regex>
 #include <set>
 #include <string>
 #include <vector>
 
+#include "UeventDispatcher.h"
+
 namespace aidl {
 namespace android {
 namespace hardware {
@@ -66,7 +69,8 @@ class UsbDataSessionMonitor {
     struct usbDeviceState {
         unique_fd fd;
         std::string filePath;
-        std::string ueventRegex;
+        // Compiled once, matched against the devpath of every uevent under the device
+        std::regex ueventRegex;
         // Usb device states reported by state sysfs
         std::vector<std::string> states;
         // Timestamps of when the usb device states were captured
@@ -75,6 +79,7 @@ class UsbDataSessionMonitor {
 
     static void *monitorThread(void *param);
     void handleUevent();
+    void handleUeventMessage(const Uevent &uevent);
     void handleTimerEvent();
     void handleDataRoleEvent();
     void handleDeviceStateEvent(struct usbDeviceState *deviceState);
@@ -87,7 +92,7 @@ class UsbDataSessionMonitor {
 
     pthread_t mMonitor;
     unique_fd mEpollFd;
-    unique_fd mUeventFd;
+    std::shared_ptr<UeventSubscription> mUeventSubscription;
     unique_fd mTimerFd;
     unique_fd mDataRoleFd;
     struct usbDeviceState mDeviceState;
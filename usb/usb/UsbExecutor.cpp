@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.aidl-service"
+
+#include "UsbExecutor.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <utils/Log.h>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+UsbExecutor::UsbExecutor(LatencyHistogram *latency, LatencyHistogram *queueLatency,
+                         MetricCounter *rejected)
+    : mLatency(latency),
+      mQueueLatency(queueLatency),
+      mRejected(rejected),
+      mThreads(USB_EXECUTOR_THREADS),
+      mLock(PTHREAD_MUTEX_INITIALIZER),
+      mCV(PTHREAD_COND_INITIALIZER) {
+    for (pthread_t &thread : mThreads) {
+        if (pthread_create(&thread, NULL, workerThread, this)) {
+            ALOGE("pthread creation failed %d", errno);
+            abort();
+        }
+    }
+}
+
+bool UsbExecutor::submit(const std::string &lane, const char *name, Task task) {
+    pthread_mutex_lock(&mLock);
+    Lane &target = mLanes[lane];
+    if (target.queue.size() >= USB_EXECUTOR_MAX_QUEUED) {
+        target.rejected++;
+        pthread_mutex_unlock(&mLock);
+        mRejected->add();
+        ALOGE("executor: %s rejected, %s is full", name, lane.c_str());
+        return false;
+    }
+    if (target.name.empty())
+        target.name = lane;
+    target.queue.push_back({name, std::move(task), std::chrono::steady_clock::now()});
+    // A running lane is made ready again by its worker once the running operation returns
+    if (!target.running && target.queue.size() == 1) {
+        mReady.push_back(&target);
+        pthread_cond_signal(&mCV);
+    }
+    pthread_mutex_unlock(&mLock);
+    return true;
+}
+
+void UsbExecutor::dump(int fd) {
+    pthread_mutex_lock(&mLock);
+    for (const auto &[name, lane] : mLanes) {
+        dprintf(fd, "%s: running %s queued %zu completed %" PRIu64 " rejected %" PRIu64 "\n",
+                name.c_str(), lane.running ? lane.running : "-", lane.queue.size(),
+                lane.completed, lane.rejected);
+    }
+    pthread_mutex_unlock(&mLock);
+}
+
+void *UsbExecutor::workerThread(void *param) {
+    UsbExecutor *executor = static_cast<UsbExecutor *>(param);
+
+    pthread_setname_np(pthread_self(), "usb-executor");
+    while (true) {
+        pthread_mutex_lock(&executor->mLock);
+        while (executor->mReady.empty())
+            pthread_cond_wait(&executor->mCV, &executor->mLock);
+        Lane *lane = executor->mReady.front();
+        executor->mReady.pop_front();
+        Entry entry = std::move(lane->queue.front());
+        lane->queue.pop_front();
+        lane->running = entry.name;
+        pthread_mutex_unlock(&executor->mLock);
+
+        executor->mQueueLatency->record(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - entry.queued).count());
+        {
+            ScopedLatencyTrace trace(executor->mLatency, entry.name);
+            entry.task();
+        }
+
+        pthread_mutex_lock(&executor->mLock);
+        lane->running = NULL;
+        lane->completed++;
+        // Back to the tail so that a busy lane cannot starve the others
+        if (!lane->queue.empty()) {
+            executor->mReady.push_back(lane);
+            pthread_cond_signal(&executor->mCV);
+        }
+        pthread_mutex_unlock(&executor->mLock);
+    }
+
+    return NULL;
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
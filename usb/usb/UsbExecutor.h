@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <pthread.h>
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "LatencyHistogram.h"
+#include "UsbMetrics.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+// Worker threads of the HAL method executor
+#define USB_EXECUTOR_THREADS 2
+// Operations a lane queues, not counting the running one, before new ones are rejected
+#define USB_EXECUTOR_MAX_QUEUED 8
+
+/*
+ * UsbExecutor runs the IUsb operations off the binder thread, which only queues them; their
+ * results already reach the framework through IUsbCallback. Operations are queued on named
+ * lanes, one per port and operation class, e.g. "port0:role". A lane runs its operations one at a
+ * time and in the order they were submitted, while operations on different lanes run in parallel
+ * on a small pool of threads, so a role switch waiting for the port never holds up a status
+ * query or a power transfer limit.
+ */
+class UsbExecutor {
+  public:
+    using Task = std::function<void()>;
+
+    /*
+     * latency records how long each operation runs, queueLatency how long it waits before
+     * starting, and rejected counts operations refused because their lane was full.
+     */
+    UsbExecutor(LatencyHistogram *latency, LatencyHistogram *queueLatency,
+                MetricCounter *rejected);
+    /*
+     * Queues task on lane. Returns false without queueing it when the lane already holds
+     * USB_EXECUTOR_MAX_QUEUED operations. name is used for tracing and logs and must be a literal.
+     */
+    bool submit(const std::string &lane, const char *name, Task task);
+    // Prints the state of every lane to fd
+    void dump(int fd);
+
+  private:
+    struct Entry {
+        const char *name;
+        Task task;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    struct Lane {
+        std::string name;
+        std::deque<Entry> queue;
+        // Running operation, NULL when idle
+        const char *running = NULL;
+        uint64_t completed = 0;
+        uint64_t rejected = 0;
+    };
+
+    static void *workerThread(void *param);
+
+    LatencyHistogram *mLatency;
+    LatencyHistogram *mQueueLatency;
+    MetricCounter *mRejected;
+    std::vector<pthread_t> mThreads;
+    // Protects mLanes and mReady
+    pthread_mutex_t mLock;
+    pthread_cond_t mCV;
+    // Lanes are never removed, so pointers to them stay valid
+    std::map<std::string, Lane> mLanes;
+    // Idle lanes with queued operations, in the order they became ready
+    std::deque<Lane *> mReady;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
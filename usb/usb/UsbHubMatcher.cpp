@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.aidl-service"
+
+#include "UsbHubMatcher.h"
+
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <dirent.h>
+#include <linux/usb/ch9.h>
+#include <errno.h>
+#include <poll.h>
+#include <utils/Log.h>
+
+#include <deque>
+#include <memory>
+
+#include "UeventDispatcher.h"
+#include "UsbSysfs.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+using ::android::base::ParseUint;
+using ::android::base::ReadFileToString;
+using ::android::base::StringPrintf;
+using ::android::base::Trim;
+
+constexpr char kUsbDevicesPath[] = "/sys/bus/usb/devices/";
+
+static bool parseHexId(std::string_view value, uint16_t *id) {
+    return ParseUint(std::string(value).insert(0, "0x"), id);
+}
+
+bool parseUsbProduct(std::string_view product, UsbHubId *id) {
+    size_t vidEnd = product.find('/');
+    if (vidEnd == std::string_view::npos)
+        return false;
+    size_t pidEnd = product.find('/', vidEnd + 1);
+
+    return parseHexId(product.substr(0, vidEnd), &id->vendorId) &&
+           parseHexId(product.substr(vidEnd + 1, pidEnd == std::string_view::npos
+                                                         ? std::string_view::npos
+                                                         : pidEnd - vidEnd - 1),
+                      &id->productId);
+}
+
+static bool parseUsbHubCommand(const std::string &command, UsbHubCommand *parsed) {
+    std::vector<std::string> fields = ::android::base::Split(command, ":");
+    uint16_t requestType, request;
+
+    if (fields.size() != 4 || !parseHexId(fields[0], &requestType) ||
+        !parseHexId(fields[1], &request) || !parseHexId(fields[2], &parsed->value) ||
+        !parseHexId(fields[3], &parsed->index) || requestType > UINT8_MAX ||
+        request > UINT8_MAX) {
+        return false;
+    }
+    // Only OUT transfers without data stage are supported
+    if (requestType & USB_DIR_IN)
+        return false;
+    parsed->requestType = requestType;
+    parsed->request = request;
+    return true;
+}
+
+bool parseUsbHubProfiles(const std::string &config, std::vector<UsbHubProfile> *profiles,
+                         std::string *error) {
+    std::vector<UsbHubProfile> parsed;
+
+    for (const std::string &rawLine : ::android::base::Split(config, "\n")) {
+        std::string line = Trim(rawLine.substr(0, rawLine.find('#')));
+        std::vector<std::string> fields;
+        UsbHubProfile profile;
+        size_t sep;
+
+        if (line.empty())
+            continue;
+        for (const std::string &field : ::android::base::Split(line, " \t")) {
+            if (!field.empty())
+                fields.push_back(field);
+        }
+
+        sep = fields[0].find(':');
+        if (fields.size() < 3 || sep == std::string::npos ||
+            !parseHexId(std::string_view(fields[0]).substr(0, sep), &profile.id.vendorId) ||
+            !parseHexId(std::string_view(fields[0]).substr(sep + 1), &profile.id.productId)) {
+            *error = rawLine;
+            return false;
+        }
+        profile.name = fields[1];
+        for (size_t i = 2; i < fields.size(); i++) {
+            UsbHubCommand command;
+
+            if (!parseUsbHubCommand(fields[i], &command)) {
+                *error = rawLine;
+                return false;
+            }
+            profile.commands.push_back(command);
+        }
+        parsed.push_back(std::move(profile));
+    }
+    *profiles = std::move(parsed);
+    return true;
+}
+
+/*
+ * Matches waiting for a handler thread. Every handler thread keeps taking pending matches until
+ * none are left, so at most USB_HUB_MAX_HANDLER_THREADS run at once.
+ */
+struct UsbHubMatcher::Handlers {
+    explicit Handlers(Handler handler)
+        : handler(std::move(handler)), lock(PTHREAD_MUTEX_INITIALIZER), threads(0) {}
+
+    const Handler handler;
+    pthread_mutex_t lock;
+    std::deque<std::pair<std::string, UsbHubId>> pending;
+    int threads;
+};
+
+UsbHubMatcher::UsbHubMatcher(std::vector<std::string> devpathPrefixes, Lookup lookup,
+                             Handler handler)
+    : mDevpathPrefixes(std::move(devpathPrefixes)),
+      mLookup(std::move(lookup)),
+      mHandlers(std::make_shared<Handlers>(std::move(handler))) {}
+
+MetricCounter &UsbHubMatcher::devicesSeenCounter() {
+    static MetricCounter sCounter("usb_hub_devices_seen");
+
+    return sCounter;
+}
+
+MetricCounter &UsbHubMatcher::devicesMatchedCounter() {
+    static MetricCounter sCounter("usb_hub_devices_matched");
+
+    return sCounter;
+}
+
+void *UsbHubMatcher::handlerThread(void *param) {
+    std::unique_ptr<std::shared_ptr<Handlers>> handlers(
+            static_cast<std::shared_ptr<Handlers> *>(param));
+    Handlers &shared = **handlers;
+
+    pthread_mutex_lock(&shared.lock);
+    while (!shared.pending.empty()) {
+        std::pair<std::string, UsbHubId> match = std::move(shared.pending.front());
+
+        shared.pending.pop_front();
+        pthread_mutex_unlock(&shared.lock);
+        shared.handler(match.first, match.second);
+        pthread_mutex_lock(&shared.lock);
+    }
+    shared.threads--;
+    pthread_mutex_unlock(&shared.lock);
+    return NULL;
+}
+
+void UsbHubMatcher::dispatch(const std::string &devname, UsbHubId id) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    std::shared_ptr<Handlers> *handlers;
+
+    devicesMatchedCounter().add();
+    ALOGI("usb hub %04x:%04x matched at %s", id.vendorId, id.productId, devname.c_str());
+
+    pthread_mutex_lock(&mHandlers->lock);
+    mHandlers->pending.emplace_back(devname, id);
+    if (mHandlers->threads >= USB_HUB_MAX_HANDLER_THREADS) {
+        pthread_mutex_unlock(&mHandlers->lock);
+        return;
+    }
+    mHandlers->threads++;
+    pthread_mutex_unlock(&mHandlers->lock);
+
+    handlers = new std::shared_ptr<Handlers>(mHandlers);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, handlerThread, handlers)) {
+        ALOGE("usb hub handler pthread creation failed %d", errno);
+        delete handlers;
+        // The match stays pending for the next handler thread
+        pthread_mutex_lock(&mHandlers->lock);
+        mHandlers->threads--;
+        pthread_mutex_unlock(&mHandlers->lock);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/*
+ * Devices attached before the HAL started never send an add uevent to it, so they are matched
+ * from sysfs. Interfaces and other entries without idVendor are skipped.
+ */
+void UsbHubMatcher::scanAttached() {
+    std::unique_ptr<DIR, int (*)(DIR *)> dir(opendir(sysfsPath(kUsbDevicesPath).c_str()),
+                                             closedir);
+    struct dirent *entry;
+
+    if (!dir) {
+        ALOGE("usb hub: failed to open %s; errno=%d", kUsbDevicesPath, errno);
+        return;
+    }
+
+    while ((entry = readdir(dir.get())) != NULL) {
+        std::string devicePath = sysfsPath(kUsbDevicesPath) + entry->d_name + "/";
+        std::string vendorId, productId, busnum, devnum;
+        UsbHubId id;
+        unsigned bus, dev;
+
+        if (entry->d_name[0] == '.' || !ReadFileToString(devicePath + "idVendor", &vendorId) ||
+            !ReadFileToString(devicePath + "idProduct", &productId) ||
+            !parseHexId(Trim(vendorId), &id.vendorId) ||
+            !parseHexId(Trim(productId), &id.productId)) {
+            continue;
+        }
+        devicesSeenCounter().add();
+        if (!mLookup(id))
+            continue;
+        if (!ReadFileToString(devicePath + "busnum", &busnum) ||
+            !ReadFileToString(devicePath + "devnum", &devnum) || !ParseUint(Trim(busnum), &bus) ||
+            !ParseUint(Trim(devnum), &dev)) {
+            ALOGE("usb hub: failed to read bus and device number of %s", entry->d_name);
+            continue;
+        }
+
+        std::string devname = StringPrintf("/dev/bus/usb/%03u/%03u", bus, dev);
+        if (mMatched.insert(devname).second)
+            dispatch(devname, id);
+    }
+}
+
+void UsbHubMatcher::run() {
+    UeventFilter filter;
+    std::shared_ptr<UeventSubscription> subscription;
+    struct pollfd pfd;
+
+    filter.devpathPrefixes = mDevpathPrefixes;
+    // Removals forget the device node, so a device later enumerated at it is matched again
+    filter.predicate = [](const Uevent &uevent) {
+        const std::string *devtype = uevent.get("DEVTYPE");
+        return (uevent.action == "add" || uevent.action == "remove") && devtype &&
+               *devtype == "usb_device";
+    };
+    // Subscribe before the scan so a device added in between is not missed
+    subscription = UeventDispatcher::getInstance().subscribe(std::move(filter));
+    if (!subscription) {
+        ALOGE("usb hub: uevent subscription failed");
+        return;
+    }
+
+    scanAttached();
+
+    pfd.fd = subscription->fd().get();
+    pfd.events = POLLIN;
+    while (true) {
+        if (poll(&pfd, 1, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            ALOGE("usb hub: poll failed; errno=%d", errno);
+            break;
+        }
+
+        subscription->drain([this](Uevent &uevent) {
+            const std::string *product = uevent.get("PRODUCT");
+            const std::string *devname = uevent.get("DEVNAME");
+            UsbHubId id;
+
+            if (!devname)
+                return;
+            if (uevent.action == "remove") {
+                mMatched.erase("/dev/" + *devname);
+                return;
+            }
+            devicesSeenCounter().add();
+            if (!product || !parseUsbProduct(*product, &id) || !mLookup(id))
+                return;
+            // The scan already matched a device added after the subscription
+            if (mMatched.insert("/dev/" + *devname).second)
+                dispatch("/dev/" + *devname, id);
+        });
+    }
+
+    UeventDispatcher::getInstance().unsubscribe(subscription);
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
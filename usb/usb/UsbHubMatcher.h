@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <pthread.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#include "UsbMetrics.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+/*
+ * Vendor config file of hub profiles. Each non-empty line that is not a # comment reads
+ *   VID:PID NAME COMMAND [COMMAND...]
+ * where every COMMAND is BMREQUESTTYPE:BREQUEST:WVALUE:WINDEX, all in hex, sent as an OUT
+ * control transfer without data stage, e.g.
+ *   05e3:0608 gl852g-jk 40:e3:0008:0407
+ */
+#define USB_HUB_PROFILES_PATH "/vendor/etc/usb_hub_profiles.conf"
+// ueventd may create the device node after the uevent reached the HAL, so opening it is retried
+#define USB_HUB_OPEN_RETRIES 50
+#define USB_HUB_OPEN_RETRY_MS 20
+// Matches handled at once; later matches wait for a handler thread to finish its current one
+#define USB_HUB_MAX_HANDLER_THREADS 4
+
+struct UsbHubId {
+    uint16_t vendorId;
+    uint16_t productId;
+};
+
+struct UsbHubCommand {
+    uint8_t requestType;
+    uint8_t request;
+    uint16_t value;
+    uint16_t index;
+};
+
+// Vendor commands sent, in order, to every hub matching id when it is attached
+struct UsbHubProfile {
+    std::string name;
+    UsbHubId id;
+    std::vector<UsbHubCommand> commands;
+};
+
+// Parses the PRODUCT field of a usb_device uevent, "VID/PID/BCDDEVICE" in hex without padding
+bool parseUsbProduct(std::string_view product, UsbHubId *id);
+/*
+ * Parses a USB_HUB_PROFILES_PATH config. Returns false, leaving profiles untouched and the
+ * offending line in error, when malformed.
+ */
+bool parseUsbHubProfiles(const std::string &config, std::vector<UsbHubProfile> *profiles,
+                         std::string *error);
+
+/*
+ * Finds the hubs lookup accepts from the usb_device add uevents and the PRODUCT field they
+ * carry, so that no device is opened unless it matches. Devices attached before the HAL started
+ * are matched from their idVendor/idProduct sysfs attributes. A device is matched once until
+ * its remove uevent, even when both the scan and its add uevent report it. Matches are handed to
+ * the handler on up to USB_HUB_MAX_HANDLER_THREADS detached threads, so a slow or unresponsive
+ * hub never holds up the matching of the devices enumerated after it.
+ */
+class UsbHubMatcher {
+  public:
+    // Returns whether a device with id is of interest, called for every added device
+    using Lookup = std::function<bool(UsbHubId id)>;
+    // Receives the /dev/bus/usb node of a matching device and the ids it matched
+    using Handler = std::function<void(const std::string &devname, UsbHubId id)>;
+
+    // devpathPrefixes scope the uevent subscription to the host controllers of interest
+    UsbHubMatcher(std::vector<std::string> devpathPrefixes, Lookup lookup, Handler handler);
+    // Matches the attached devices and then every added one. Only returns on error.
+    void run();
+
+    // Added devices looked up, and those handed to the handler
+    static MetricCounter &devicesSeenCounter();
+    static MetricCounter &devicesMatchedCounter();
+
+  private:
+    struct Handlers;
+
+    void scanAttached();
+    void dispatch(const std::string &devname, UsbHubId id);
+    static void *handlerThread(void *param);
+
+    const std::vector<std::string> mDevpathPrefixes;
+    const Lookup mLookup;
+    // Shared with the handler threads, which may outlive the matcher
+    const std::shared_ptr<Handlers> mHandlers;
+    // Device nodes matched and not removed since, only used by the thread in run()
+    std::unordered_set<std::string> mMatched;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.aidl-service"
+
+#include "UsbLog.h"
+
+#include <stdio.h>
+
+#include <chrono>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+std::atomic<bool> LogRateLimiter::sVerbose(false);
+
+// Every call site that logged, most recent first. Protected by sLimitersLock.
+static LogRateLimiter *sLimiters;
+static pthread_mutex_t sLimitersLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t nowMsHelper() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+}
+
+LogRateLimiter::LogRateLimiter(const char *site)
+    : mSite(site),
+      mLock(PTHREAD_MUTEX_INITIALIZER),
+      mTokens(USB_LOG_BURST),
+      mRefillMs(nowMsHelper()),
+      mSuppressed(0),
+      mSuppressedTotal(0) {
+    pthread_mutex_lock(&sLimitersLock);
+    mNext = sLimiters;
+    sLimiters = this;
+    pthread_mutex_unlock(&sLimitersLock);
+}
+
+MetricCounter &LogRateLimiter::suppressedCounter() {
+    static MetricCounter sSuppressed("log_suppressed");
+
+    return sSuppressed;
+}
+
+bool LogRateLimiter::allow(uint64_t *suppressed) {
+    int64_t now = nowMsHelper();
+    bool allowed;
+
+    pthread_mutex_lock(&mLock);
+    if (mTokens < USB_LOG_BURST) {
+        int64_t refills = (now - mRefillMs) / USB_LOG_REFILL_MS;
+
+        mTokens = refills >= USB_LOG_BURST - mTokens ? USB_LOG_BURST : mTokens + refills;
+        mRefillMs += refills * USB_LOG_REFILL_MS;
+    } else {
+        mRefillMs = now;
+    }
+
+    allowed = verbose() || mTokens > 0;
+    if (allowed) {
+        if (mTokens > 0)
+            mTokens--;
+        *suppressed = mSuppressed;
+        mSuppressed = 0;
+    } else {
+        mSuppressed++;
+        mSuppressedTotal++;
+    }
+    pthread_mutex_unlock(&mLock);
+
+    if (!allowed)
+        suppressedCounter().add();
+    return allowed;
+}
+
+void LogRateLimiter::dump(int fd) {
+    pthread_mutex_lock(&sLimitersLock);
+    for (LogRateLimiter *limiter = sLimiters; limiter; limiter = limiter->mNext) {
+        pthread_mutex_lock(&limiter->mLock);
+        if (limiter->mSuppressedTotal)
+            dprintf(fd, "%s: %" PRIu64 " suppressed\n", limiter->mSite, limiter->mSuppressedTotal);
+        pthread_mutex_unlock(&limiter->mLock);
+    }
+    pthread_mutex_unlock(&sLimitersLock);
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
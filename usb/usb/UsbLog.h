@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <utils/Log.h>
+
+#include <atomic>
+#include <cstdint>
+
+#include "UsbMetrics.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+// Messages a call site may log back to back, and the interval one more is allowed after
+#define USB_LOG_BURST 10
+#define USB_LOG_REFILL_MS 1000
+
+/*
+ * LogRateLimiter is the token bucket of one USB_LOGI_RATELIMITED call site. Messages beyond the
+ * bucket are dropped and counted; the next one logged carries how many were dropped before it.
+ * Rate limiting is bypassed while verbose logging is enabled.
+ */
+class LogRateLimiter {
+  public:
+    explicit LogRateLimiter(const char *site);
+    // Returns whether a message may be logged, setting *suppressed to those dropped since the last
+    bool allow(uint64_t *suppressed);
+
+    static bool verbose() { return sVerbose.load(std::memory_order_relaxed); }
+    static void setVerbose(bool verbose) { sVerbose.store(verbose, std::memory_order_relaxed); }
+    // Messages dropped by every call site
+    static MetricCounter &suppressedCounter();
+    // Prints the call sites that dropped messages to fd
+    static void dump(int fd);
+
+  private:
+    const char *mSite;
+    pthread_mutex_t mLock;
+    int mTokens;
+    int64_t mRefillMs;
+    uint64_t mSuppressed;
+    uint64_t mSuppressedTotal;
+    LogRateLimiter *mNext;
+
+    static std::atomic<bool> sVerbose;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
+
+#define USB_LOG_STRINGIFY_(x) #x
+#define USB_LOG_STRINGIFY(x) USB_LOG_STRINGIFY_(x)
+
+// ALOGI for hot paths such as port status refreshes, rate limited per call site
+#define USB_LOGI_RATELIMITED(fmt, ...)                                                         \
+    do {                                                                                       \
+        static ::aidl::android::hardware::usb::LogRateLimiter _usbLogLimiter(               \
+                __FILE__ ":" USB_LOG_STRINGIFY(__LINE__));                                     \
+        uint64_t _usbLogSuppressed;                                                            \
+        if (_usbLogLimiter.allow(&_usbLogSuppressed)) {                                        \
+            if (_usbLogSuppressed)                                                             \
+                ALOGI(fmt " [%" PRIu64 " suppressed]", ##__VA_ARGS__, _usbLogSuppressed);      \
+            else                                                                               \
+                ALOGI(fmt, ##__VA_ARGS__);                                                     \
+        }                                                                                      \
+    } while (0)
+
+// Detail only logged while verbose logging is enabled through the "log-verbose" shell command
+#define USB_LOGV(fmt, ...)                                                                     \
+    do {                                                                                       \
+        if (::aidl::android::hardware::usb::LogRateLimiter::verbose())                         \
+            ALOGI(fmt, ##__VA_ARGS__);                                                         \
+    } while (0)
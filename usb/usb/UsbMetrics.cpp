@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.aidl-service"
+
+#include "UsbMetrics.h"
+
+#include <android-base/properties.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <utils/Log.h>
+
+#include "UsbStatsReporter.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+using ::aidl::android::frameworks::stats::IStats;
+using ::aidl::android::frameworks::stats::VendorAtom;
+using ::aidl::android::frameworks::stats::VendorAtomValue;
+using ::android::base::GetIntProperty;
+
+UsbMetrics::UsbMetrics(std::vector<MetricCounter *> counters,
+                       std::vector<LatencyHistogram *> histograms)
+    : mCounters(std::move(counters)),
+      mHistograms(std::move(histograms)),
+      mAtomId(0),
+      mPushIntervalSec(USB_METRICS_PUSH_INTERVAL_SEC_DEFAULT),
+      mReporter(NULL) {}
+
+void UsbMetrics::dump(int fd) const {
+    for (const MetricCounter *counter : mCounters)
+        dprintf(fd, "%s %" PRIu64 "\n", counter->name().c_str(), counter->value());
+    for (const LatencyHistogram *histogram : mHistograms) {
+        uint64_t count = histogram->count();
+
+        dprintf(fd, "%s.count %" PRIu64 "\n", histogram->name().c_str(), count);
+        dprintf(fd, "%s.avg_us %" PRId64 "\n", histogram->name().c_str(),
+                count ? histogram->sumUs() / (int64_t)count : 0);
+        dprintf(fd, "%s.max_us %" PRId64 "\n", histogram->name().c_str(), histogram->maxUs());
+    }
+}
+
+std::map<std::string, int64_t> UsbMetrics::values() const {
+    std::map<std::string, int64_t> values;
+
+    for (const MetricCounter *counter : mCounters)
+        values[counter->name()] = counter->value();
+    for (const LatencyHistogram *histogram : mHistograms) {
+        uint64_t count = histogram->count();
+
+        values[histogram->name() + ".count"] = count;
+        values[histogram->name() + ".avg_us"] = count ? histogram->sumUs() / (int64_t)count : 0;
+        values[histogram->name() + ".max_us"] = histogram->maxUs();
+    }
+    return values;
+}
+
+void UsbMetrics::reset() {
+    for (MetricCounter *counter : mCounters)
+        counter->reset();
+    for (LatencyHistogram *histogram : mHistograms)
+        histogram->reset();
+}
+
+static void addLongValue(VendorAtom *atom, int64_t value) {
+    VendorAtomValue atomValue;
+
+    atomValue.set<VendorAtomValue::longValue>(value);
+    atom->values.push_back(atomValue);
+}
+
+VendorAtom UsbMetrics::buildAtom(int32_t atomId) const {
+    VendorAtom atom;
+
+    atom.reverseDomainName = "";
+    atom.atomId = atomId;
+    for (const MetricCounter *counter : mCounters)
+        addLongValue(&atom, counter->value());
+    for (const LatencyHistogram *histogram : mHistograms) {
+        uint64_t count = histogram->count();
+
+        addLongValue(&atom, count);
+        addLongValue(&atom, count ? histogram->sumUs() / (int64_t)count : 0);
+        addLongValue(&atom, histogram->maxUs());
+    }
+    return atom;
+}
+
+void *UsbMetrics::pushThread(void *param) {
+    UsbMetrics *metrics = static_cast<UsbMetrics *>(param);
+
+    pthread_setname_np(pthread_self(), "usb-metrics");
+    while (true) {
+        sleep(metrics->mPushIntervalSec);
+
+        // The atom is built when the reporter gets to it, so a backlog never reports stale data
+        metrics->mReporter->post("usb metrics report",
+                                 [metrics](const std::shared_ptr<IStats> &stats) {
+                                     const ndk::ScopedAStatus ret = stats->reportVendorAtom(
+                                             metrics->buildAtom(metrics->mAtomId));
+                                     if (!ret.isOk())
+                                         ALOGE("metrics: Unable to report USB metrics to Stats "
+                                               "service");
+                                 });
+    }
+    return NULL;
+}
+
+void UsbMetrics::startPeriodicPush(UsbStatsReporter *reporter) {
+    mReporter = reporter;
+    mAtomId = GetIntProperty(USB_METRICS_ATOM_ID_PROPERTY, 0);
+    if (mAtomId <= 0)
+        return;
+    mPushIntervalSec = GetIntProperty(USB_METRICS_PUSH_INTERVAL_PROPERTY,
+                                      USB_METRICS_PUSH_INTERVAL_SEC_DEFAULT, 1);
+
+    if (pthread_create(&mPushThread, NULL, pushThread, this)) {
+        ALOGE("metrics: pthread creation failed %d", errno);
+        return;
+    }
+    ALOGI("metrics: pushing atom %d every %d s", mAtomId, mPushIntervalSec);
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
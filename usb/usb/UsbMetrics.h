@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <aidl/android/frameworks/stats/IStats.h>
+#include <pthread.h>
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "LatencyHistogram.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+class UsbStatsReporter;
+
+/*
+ * Vendor atom id the metrics are pushed to IStats with. Unset or 0, the default, disables the
+ * periodic push; the metrics are then only available through the "metrics" shell command.
+ */
+#define USB_METRICS_ATOM_ID_PROPERTY "vendor.usb.metrics.atom_id"
+#define USB_METRICS_PUSH_INTERVAL_PROPERTY "vendor.usb.metrics.push_interval_sec"
+#define USB_METRICS_PUSH_INTERVAL_SEC_DEFAULT 3600
+
+/*
+ * MetricCounter is a monotonic event counter. Like LatencyHistogram it is lock free so it can be
+ * bumped from any HAL thread.
+ */
+class MetricCounter {
+  public:
+    explicit MetricCounter(const std::string &name) : mName(name), mValue(0) {}
+    // Returns the value after adding count
+    uint64_t add(uint64_t count = 1) {
+        return mValue.fetch_add(count, std::memory_order_relaxed) + count;
+    }
+    uint64_t value() const { return mValue.load(std::memory_order_relaxed); }
+    void reset() { mValue.store(0, std::memory_order_relaxed); }
+    const std::string &name() const { return mName; }
+
+  private:
+    const std::string mName;
+    std::atomic<uint64_t> mValue;
+};
+
+/*
+ * UsbMetrics is the registry of the HAL's counters and latency histograms. It dumps them under
+ * stable names for the "metrics" shell command and optionally pushes them to IStats as a vendor
+ * atom holding, in registration order, every counter followed by the count, average and maximum
+ * of every histogram.
+ */
+class UsbMetrics {
+  public:
+    UsbMetrics(std::vector<MetricCounter *> counters, std::vector<LatencyHistogram *> histograms);
+    // Prints one "NAME VALUE" line per counter and per histogram count, avg_us and max_us
+    void dump(int fd) const;
+    // Returns the values dump() prints, keyed by the same names
+    std::map<std::string, int64_t> values() const;
+    void reset();
+    ::aidl::android::frameworks::stats::VendorAtom buildAtom(int32_t atomId) const;
+    // Starts pushing through reporter when USB_METRICS_ATOM_ID_PROPERTY is set
+    void startPeriodicPush(UsbStatsReporter *reporter);
+
+  private:
+    static void *pushThread(void *param);
+
+    const std::vector<MetricCounter *> mCounters;
+    const std::vector<LatencyHistogram *> mHistograms;
+    int32_t mAtomId;
+    int mPushIntervalSec;
+    UsbStatsReporter *mReporter;
+    pthread_t mPushThread;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
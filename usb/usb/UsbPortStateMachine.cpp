@@ -0,0 +1,276 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "UsbPortStateMachine.h"
+
+#include <algorithm>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+/*
+ * Serialized trace: the "UPTR" magic, then version, record size, record count and overwritten
+ * record count, then the base state and partner presence, then the records, little endian.
+ */
+constexpr char kTraceMagic[] = "UPTR";
+constexpr uint16_t kTraceVersion = 1;
+constexpr uint16_t kTraceRecordSize = 7;
+constexpr size_t kTraceHeaderSize = 18;
+
+const char *usbPortStateName(UsbPortState state) {
+    switch (state) {
+        case UsbPortState::DETACHED:
+            return "detached";
+        case UsbPortState::ATTACHED:
+            return "attached";
+        case UsbPortState::ROLE_SWITCHING:
+            return "role_switching";
+        case UsbPortState::DISPLAYPORT_BOUND:
+            return "displayport_bound";
+        case UsbPortState::DISPLAYPORT_ACTIVE:
+            return "displayport_active";
+        default:
+            return "unknown";
+    }
+}
+
+const char *usbPortEventName(UsbPortEvent event) {
+    switch (event) {
+        case UsbPortEvent::PARTNER_ADDED:
+            return "partner_added";
+        case UsbPortEvent::PARTNER_REMOVED:
+            return "partner_removed";
+        case UsbPortEvent::ROLE_SWITCH_STARTED:
+            return "role_switch_started";
+        case UsbPortEvent::ROLE_SWITCH_DONE:
+            return "role_switch_done";
+        case UsbPortEvent::ROLE_SWITCH_TIMEOUT:
+            return "role_switch_timeout";
+        case UsbPortEvent::DISPLAYPORT_BOUND:
+            return "displayport_bound";
+        case UsbPortEvent::DISPLAYPORT_UNBOUND:
+            return "displayport_unbound";
+        case UsbPortEvent::HPD_HIGH:
+            return "hpd_high";
+        case UsbPortEvent::HPD_LOW:
+            return "hpd_low";
+        default:
+            return "unknown";
+    }
+}
+
+UsbPortStateMachine::UsbPortStateMachine() {
+    reset(0, UsbPortState::DETACHED, false);
+}
+
+void UsbPortStateMachine::reset(uint32_t timeMs, UsbPortState state, bool partner) {
+    mState = state;
+    mPartner = partner;
+    mEnteredMs = timeMs;
+    std::fill(std::begin(mDwellMs), std::end(mDwellMs), 0);
+    mUnexpectedEvents = 0;
+}
+
+uint64_t UsbPortStateMachine::dwellMs(UsbPortState state, uint32_t timeMs) const {
+    uint64_t dwellMs = mDwellMs[static_cast<int>(state)];
+
+    if (state == mState)
+        dwellMs += (uint32_t)(timeMs - mEnteredMs);
+    return dwellMs;
+}
+
+UsbPortStateMachine::Transition UsbPortStateMachine::update(uint32_t timeMs, UsbPortEvent event) {
+    Transition transition = {mState, mState, true};
+    UsbPortState next = mState;
+    bool displayPort = mState == UsbPortState::DISPLAYPORT_BOUND ||
+                       mState == UsbPortState::DISPLAYPORT_ACTIVE;
+
+    switch (event) {
+        case UsbPortEvent::PARTNER_ADDED:
+            // The partner comes back during a role switch, which completes it separately
+            transition.expected = !mPartner || mState == UsbPortState::ROLE_SWITCHING;
+            mPartner = true;
+            if (mState == UsbPortState::DETACHED)
+                next = UsbPortState::ATTACHED;
+            break;
+        case UsbPortEvent::PARTNER_REMOVED:
+            transition.expected = mPartner;
+            mPartner = false;
+            if (mState != UsbPortState::ROLE_SWITCHING)
+                next = UsbPortState::DETACHED;
+            break;
+        case UsbPortEvent::ROLE_SWITCH_STARTED:
+            // A new request supersedes the pending one
+            next = UsbPortState::ROLE_SWITCHING;
+            break;
+        case UsbPortEvent::ROLE_SWITCH_DONE:
+            transition.expected = mState == UsbPortState::ROLE_SWITCHING;
+            if (transition.expected) {
+                mPartner = true;
+                next = UsbPortState::ATTACHED;
+            }
+            break;
+        case UsbPortEvent::ROLE_SWITCH_TIMEOUT:
+            transition.expected = mState == UsbPortState::ROLE_SWITCHING;
+            if (transition.expected)
+                next = mPartner ? UsbPortState::ATTACHED : UsbPortState::DETACHED;
+            break;
+        case UsbPortEvent::DISPLAYPORT_BOUND:
+            // A bind while detached means the partner added uevent was lost
+            transition.expected = mState == UsbPortState::ATTACHED;
+            if (mState == UsbPortState::ATTACHED || mState == UsbPortState::DETACHED) {
+                mPartner = true;
+                next = UsbPortState::DISPLAYPORT_BOUND;
+            }
+            break;
+        case UsbPortEvent::DISPLAYPORT_UNBOUND:
+            // The driver also unbinds after the partner is gone
+            transition.expected = displayPort || mState == UsbPortState::DETACHED;
+            if (displayPort)
+                next = mPartner ? UsbPortState::ATTACHED : UsbPortState::DETACHED;
+            break;
+        case UsbPortEvent::HPD_HIGH:
+            transition.expected = mState == UsbPortState::DISPLAYPORT_BOUND;
+            if (transition.expected)
+                next = UsbPortState::DISPLAYPORT_ACTIVE;
+            break;
+        case UsbPortEvent::HPD_LOW:
+            // HPD is forwarded low on bind and after the partner is gone
+            transition.expected = displayPort || mState == UsbPortState::DETACHED;
+            if (mState == UsbPortState::DISPLAYPORT_ACTIVE)
+                next = UsbPortState::DISPLAYPORT_BOUND;
+            break;
+        default:
+            transition.expected = false;
+            break;
+    }
+
+    if (!transition.expected)
+        mUnexpectedEvents++;
+    if (next != mState) {
+        mDwellMs[static_cast<int>(mState)] += (uint32_t)(timeMs - mEnteredMs);
+        mEnteredMs = timeMs;
+        mState = next;
+    }
+    transition.to = next;
+    return transition;
+}
+
+UsbPortTrace::UsbPortTrace()
+    : mBase({0, UsbPortEvent::PARTNER_ADDED, UsbPortState::DETACHED, false}), mTotal(0) {
+    mRecords.reserve(USB_PORT_TRACE_RECORDS);
+}
+
+size_t UsbPortTrace::size() const {
+    return mRecords.size();
+}
+
+void UsbPortTrace::append(const UsbPortTraceRecord &record) {
+    if (mRecords.size() < USB_PORT_TRACE_RECORDS) {
+        mRecords.push_back(record);
+    } else {
+        UsbPortTraceRecord &oldest = mRecords[mTotal % USB_PORT_TRACE_RECORDS];
+
+        mBase = oldest;
+        oldest = record;
+    }
+    mTotal++;
+}
+
+static void putLeHelper(std::string *out, uint32_t value, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        out->push_back((char)((value >> (8 * i)) & 0xff));
+}
+
+static uint32_t getLeHelper(const std::string &in, size_t offset, int bytes) {
+    uint32_t value = 0;
+
+    for (int i = 0; i < bytes; i++)
+        value |= (uint32_t)(uint8_t)in[offset + i] << (8 * i);
+    return value;
+}
+
+std::string UsbPortTrace::serialize() const {
+    std::string out(kTraceMagic, 4);
+    size_t count = mRecords.size();
+
+    out.reserve(kTraceHeaderSize + count * kTraceRecordSize);
+    putLeHelper(&out, kTraceVersion, 2);
+    putLeHelper(&out, kTraceRecordSize, 2);
+    putLeHelper(&out, count, 4);
+    putLeHelper(&out, (uint32_t)std::min<uint64_t>(overwritten(), UINT32_MAX), 4);
+    putLeHelper(&out, static_cast<uint8_t>(mBase.state), 1);
+    putLeHelper(&out, mBase.partner, 1);
+    // Once the ring wrapped, the oldest record is the next one to be overwritten
+    for (size_t i = 0; i < count; i++) {
+        const UsbPortTraceRecord &record =
+                mRecords[count < USB_PORT_TRACE_RECORDS ? i : (mTotal + i) % count];
+
+        putLeHelper(&out, record.timeMs, 4);
+        putLeHelper(&out, static_cast<uint8_t>(record.event), 1);
+        putLeHelper(&out, static_cast<uint8_t>(record.state), 1);
+        putLeHelper(&out, record.partner, 1);
+    }
+    return out;
+}
+
+bool parseUsbPortTrace(const std::string &contents, UsbPortTraceRecord *base,
+                       std::vector<UsbPortTraceRecord> *records, std::string *error) {
+    size_t count, offset = kTraceHeaderSize;
+
+    if (contents.size() < kTraceHeaderSize || contents.compare(0, 4, kTraceMagic)) {
+        *error = "not a port trace";
+        return false;
+    }
+    if (getLeHelper(contents, 4, 2) != kTraceVersion ||
+        getLeHelper(contents, 6, 2) != kTraceRecordSize) {
+        *error = "unsupported version " + std::to_string(getLeHelper(contents, 4, 2));
+        return false;
+    }
+    count = getLeHelper(contents, 8, 4);
+    if (contents.size() != kTraceHeaderSize + count * kTraceRecordSize) {
+        *error = "truncated, expected " + std::to_string(count) + " records";
+        return false;
+    }
+
+    *base = {0, UsbPortEvent::PARTNER_ADDED, static_cast<UsbPortState>(contents[16]),
+             contents[17] != 0};
+    if (base->state >= UsbPortState::COUNT) {
+        *error = "invalid base state";
+        return false;
+    }
+    records->clear();
+    for (size_t i = 0; i < count; i++, offset += kTraceRecordSize) {
+        UsbPortTraceRecord record = {getLeHelper(contents, offset, 4),
+                                     static_cast<UsbPortEvent>(contents[offset + 4]),
+                                     static_cast<UsbPortState>(contents[offset + 5]),
+                                     contents[offset + 6] != 0};
+
+        if (record.event >= UsbPortEvent::COUNT || record.state >= UsbPortState::COUNT) {
+            *error = "invalid record " + std::to_string(i);
+            return false;
+        }
+        records->push_back(record);
+    }
+    return true;
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+// Records the port trace keeps before overwriting the oldest, 7 bytes each once serialized
+#define USB_PORT_TRACE_RECORDS 2048
+
+enum class UsbPortState : uint8_t {
+    DETACHED,
+    ATTACHED,
+    // Port type written, waiting for the partner to come back in the requested mode
+    ROLE_SWITCHING,
+    // DisplayPort driver bound to the partner, HPD low
+    DISPLAYPORT_BOUND,
+    // HPD high forwarded to the drm
+    DISPLAYPORT_ACTIVE,
+    COUNT,
+};
+
+// Inputs of UsbPortStateMachine, in the order of the serialized trace format. Only append.
+enum class UsbPortEvent : uint8_t {
+    PARTNER_ADDED,
+    PARTNER_REMOVED,
+    ROLE_SWITCH_STARTED,
+    ROLE_SWITCH_DONE,
+    ROLE_SWITCH_TIMEOUT,
+    DISPLAYPORT_BOUND,
+    DISPLAYPORT_UNBOUND,
+    HPD_HIGH,
+    HPD_LOW,
+    COUNT,
+};
+
+const char *usbPortStateName(UsbPortState state);
+const char *usbPortEventName(UsbPortEvent event);
+
+/*
+ * UsbPortStateMachine models the connection state of one port from the events the uevent,
+ * role switch and DisplayPort handlers act on. It keeps no reference to the system and takes the
+ * time of every event as an argument, so a recorded trace replays through it with identical
+ * transitions. It is not thread safe.
+ */
+class UsbPortStateMachine {
+  public:
+    struct Transition {
+        UsbPortState from;
+        UsbPortState to;
+        // False for events the model does not expect in the state, e.g. after a lost uevent
+        bool expected;
+    };
+
+    UsbPortStateMachine();
+    // Restarts the model in state at timeMs, clearing the dwell times and counters
+    void reset(uint32_t timeMs, UsbPortState state, bool partner);
+    Transition update(uint32_t timeMs, UsbPortEvent event);
+
+    UsbPortState state() const { return mState; }
+    bool partner() const { return mPartner; }
+    uint64_t unexpectedEvents() const { return mUnexpectedEvents; }
+    // Time spent in state since the last reset, up to timeMs
+    uint64_t dwellMs(UsbPortState state, uint32_t timeMs) const;
+
+  private:
+    UsbPortState mState;
+    // Whether a partner is attached, also tracked while switching roles
+    bool mPartner;
+    uint32_t mEnteredMs;
+    uint64_t mDwellMs[static_cast<int>(UsbPortState::COUNT)];
+    uint64_t mUnexpectedEvents;
+};
+
+// An event and the state and partner presence it led to. Times wrap after 49 days.
+struct UsbPortTraceRecord {
+    uint32_t timeMs;
+    UsbPortEvent event;
+    UsbPortState state;
+    bool partner;
+};
+
+/*
+ * UsbPortTrace keeps the latest USB_PORT_TRACE_RECORDS records in a ring buffer. It also keeps
+ * the last record it overwrote, which is the state a replay of the retained records starts from.
+ * It is not thread safe.
+ */
+class UsbPortTrace {
+  public:
+    UsbPortTrace();
+    void append(const UsbPortTraceRecord &record);
+    // Retained records
+    size_t size() const;
+    uint64_t overwritten() const { return mTotal - size(); }
+    // Compact binary form of the retained records, oldest first, read by parseUsbPortTrace()
+    std::string serialize() const;
+
+  private:
+    std::vector<UsbPortTraceRecord> mRecords;
+    UsbPortTraceRecord mBase;
+    uint64_t mTotal;
+};
+
+/*
+ * Parses a trace written by UsbPortTrace::serialize() into the records and the state they start
+ * from. Returns false and describes the problem in error when contents is malformed.
+ */
+bool parseUsbPortTrace(const std::string &contents, UsbPortTraceRecord *base,
+                       std::vector<UsbPortTraceRecord> *records, std::string *error);
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
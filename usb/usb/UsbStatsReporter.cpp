@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_HAL
+#define LOG_TAG "android.hardware.usb.aidl-service"
+
+#include "UsbStatsReporter.h"
+
+#include <android/binder_ibinder.h>
+#include <pixelstats/StatsHelper.h>
+#include <utils/Log.h>
+#include <utils/Trace.h>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+using ::aidl::android::frameworks::stats::IStats;
+using ::android::hardware::google::pixel::getStatsService;
+
+UsbStatsReporter::UsbStatsReporter(MetricCounter *dropped)
+    : mDropped(dropped), mLock(PTHREAD_MUTEX_INITIALIZER), mCV(PTHREAD_COND_INITIALIZER) {
+    if (pthread_create(&mThread, NULL, reporterThread, this)) {
+        ALOGE("pthread creation failed %d", errno);
+        abort();
+    }
+}
+
+void UsbStatsReporter::post(const char *name, Report report) {
+    pthread_mutex_lock(&mLock);
+    if (mQueue.size() >= USB_STATS_REPORTER_MAX_QUEUED) {
+        pthread_mutex_unlock(&mLock);
+        mDropped->add();
+        ALOGE("Dropping %s report, %d reports queued", name, USB_STATS_REPORTER_MAX_QUEUED);
+        return;
+    }
+    mQueue.push_back({name, std::move(report)});
+    pthread_cond_signal(&mCV);
+    pthread_mutex_unlock(&mLock);
+}
+
+std::shared_ptr<IStats> UsbStatsReporter::getStatsClient() {
+    if (mStatsClient && !AIBinder_isAlive(mStatsClient->asBinder().get())) {
+        ALOGI("AIDL Stats service died, reconnecting");
+        mStatsClient = NULL;
+    }
+    if (!mStatsClient)
+        mStatsClient = getStatsService();
+    return mStatsClient;
+}
+
+void *UsbStatsReporter::reporterThread(void *param) {
+    UsbStatsReporter *reporter = static_cast<UsbStatsReporter *>(param);
+
+    pthread_setname_np(pthread_self(), "usb-stats");
+    while (true) {
+        pthread_mutex_lock(&reporter->mLock);
+        while (reporter->mQueue.empty())
+            pthread_cond_wait(&reporter->mCV, &reporter->mLock);
+        Entry entry = std::move(reporter->mQueue.front());
+        reporter->mQueue.pop_front();
+        pthread_mutex_unlock(&reporter->mLock);
+
+        const std::shared_ptr<IStats> stats_client = reporter->getStatsClient();
+        if (!stats_client) {
+            reporter->mDropped->add();
+            ALOGE("Unable to get AIDL Stats service, dropping %s report", entry.name);
+            continue;
+        }
+
+        ATRACE_NAME(entry.name);
+        entry.report(stats_client);
+    }
+
+    return NULL;
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
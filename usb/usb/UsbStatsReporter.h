@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <aidl/android/frameworks/stats/IStats.h>
+#include <pthread.h>
+
+#include <deque>
+#include <functional>
+#include <memory>
+
+#include "UsbMetrics.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+// Reports a UsbStatsReporter queues before new ones are dropped
+#define USB_STATS_REPORTER_MAX_QUEUED 32
+
+/*
+ * UsbStatsReporter sends IStats reports from its own thread so that collecting the data and the
+ * binder calls to statsd never delay uevent processing. The IStats client is looked up on the
+ * first report and cached; it is looked up again only once its binder has died.
+ */
+class UsbStatsReporter {
+  public:
+    // Collects the data to report and reports it through stats, which is never NULL
+    using Report = std::function<void(const std::shared_ptr<frameworks::stats::IStats> &stats)>;
+
+    // dropped counts reports lost to a full queue or a missing Stats service
+    explicit UsbStatsReporter(MetricCounter *dropped);
+    // Queues report, name is used for tracing and error logs and must be a literal.
+    void post(const char *name, Report report);
+
+  private:
+    struct Entry {
+        const char *name;
+        Report report;
+    };
+
+    static void *reporterThread(void *param);
+    std::shared_ptr<frameworks::stats::IStats> getStatsClient();
+
+    MetricCounter *mDropped;
+    // Only used by the reporter thread
+    std::shared_ptr<frameworks::stats::IStats> mStatsClient;
+    pthread_t mThread;
+    // Protects mQueue
+    pthread_mutex_t mLock;
+    pthread_cond_t mCV;
+    std::deque<Entry> mQueue;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.aidl-service"
+
+#include "UsbSysfs.h"
+
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <utils/Log.h>
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <optional>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+using ::android::base::unique_fd;
+
+// Open attribute fds of SysfsWriteBatch, keyed by path. Protected by sBatchLock.
+static std::map<std::string, unique_fd> sBatchFds;
+// Serializes batches, and protects sBatchFds
+static pthread_mutex_t sBatchLock = PTHREAD_MUTEX_INITIALIZER;
+
+static unique_fd openAttributeHelper(const std::string &path) {
+    unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDWR | O_CLOEXEC)));
+
+    // Some attributes are write only
+    if (fd == -1 && errno == EACCES)
+        fd.reset(TEMP_FAILURE_RETRY(open(path.c_str(), O_WRONLY | O_CLOEXEC)));
+    return fd;
+}
+
+/*
+ * Runs op on the fd of path, opening it first when it is not cached. A cached fd whose device
+ * went away is replaced once by a freshly opened one. Needs sBatchLock.
+ */
+static bool withAttributeFdLocked(const std::string &path, uint32_t flags,
+                                  const std::function<bool(int fd)> &op) {
+    if (flags & SYSFS_WRITE_UNCACHED) {
+        unique_fd fd = openAttributeHelper(path);
+        return fd != -1 && op(fd.get());
+    }
+
+    auto it = sBatchFds.find(path);
+    if (it != sBatchFds.end()) {
+        if (op(it->second.get()))
+            return true;
+        if (errno != ENODEV && errno != ENOENT)
+            return false;
+        sBatchFds.erase(it);
+    }
+
+    unique_fd fd = openAttributeHelper(path);
+    if (fd == -1 || !op(fd.get()))
+        return false;
+    sBatchFds[path] = std::move(fd);
+    return true;
+}
+
+static bool writeAttributeLocked(const std::string &path, const std::string &value,
+                                 uint32_t flags) {
+    return withAttributeFdLocked(path, flags, [&value](int fd) {
+        return TEMP_FAILURE_RETRY(pwrite(fd, value.data(), value.length(), 0)) ==
+               (ssize_t)value.length();
+    });
+}
+
+/*
+ * Writes value to path, first reading the previous value into previous unless it is NULL. The
+ * read and the write share one fd, so an uncached attribute is opened once. A failed read, e.g.
+ * of a write only attribute, leaves previous untouched without failing the write.
+ */
+static bool readWriteAttributeLocked(const std::string &path, const std::string &value,
+                                     uint32_t flags, std::optional<std::string> *previous) {
+    return withAttributeFdLocked(path, flags, [&value, previous](int fd) {
+        if (previous) {
+            char buf[SYSFS_WRITE_MAX_VALUE_LEN];
+            ssize_t len = TEMP_FAILURE_RETRY(pread(fd, buf, sizeof(buf), 0));
+
+            if (len >= 0)
+                *previous = ::android::base::Trim(std::string(buf, len));
+        }
+        return TEMP_FAILURE_RETRY(pwrite(fd, value.data(), value.length(), 0)) ==
+               (ssize_t)value.length();
+    });
+}
+
+SysfsWriteBatch::SysfsWriteBatch(const char *name) : mName(name), mElapsedUs(0) {}
+
+size_t SysfsWriteBatch::add(const std::string &path, const std::string &value, uint32_t flags,
+                            std::optional<std::string> rollback) {
+    mSteps.push_back({path, value, flags, std::move(rollback), false, 0});
+    return mSteps.size() - 1;
+}
+
+void SysfsWriteBatch::rollback(size_t failed) {
+    for (size_t i = failed; i-- > 0;) {
+        Step &step = mSteps[i];
+
+        if (!step.written)
+            continue;
+        step.written = false;
+        if (!step.rollback) {
+            ALOGE("%s: no previous value of %s to roll back to", mName, step.path.c_str());
+        } else if (!writeAttributeLocked(step.path, *step.rollback, step.flags)) {
+            ALOGE("%s: failed to roll back %s to %s; errno=%d", mName, step.path.c_str(),
+                  step.rollback->c_str(), errno);
+        } else {
+            ALOGI("%s: rolled back %s to %s", mName, step.path.c_str(), step.rollback->c_str());
+        }
+    }
+}
+
+bool SysfsWriteBatch::commit() {
+    auto batchStart = std::chrono::steady_clock::now();
+    std::string timings;
+    bool success = true;
+
+    // Steps from lastRequired on are never rolled back, as no required step follows them
+    size_t lastRequired = 0;
+    for (size_t i = 0; i < mSteps.size(); i++) {
+        if (!(mSteps[i].flags & SYSFS_WRITE_OPTIONAL))
+            lastRequired = i;
+    }
+
+    pthread_mutex_lock(&sBatchLock);
+    for (size_t i = 0; i < mSteps.size(); i++) {
+        Step &step = mSteps[i];
+        auto stepStart = std::chrono::steady_clock::now();
+        bool readPrevious = !step.rollback && i < lastRequired;
+
+        step.written = readWriteAttributeLocked(step.path, step.value, step.flags,
+                                                readPrevious ? &step.rollback : NULL);
+        step.elapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                                 std::chrono::steady_clock::now() - stepStart)
+                                 .count();
+        timings += " " + std::to_string(step.elapsedUs);
+
+        if (step.written)
+            continue;
+        ALOGE("%s: failed to write %s to %s; errno=%d", mName, step.value.c_str(),
+              step.path.c_str(), errno);
+        if (!(step.flags & SYSFS_WRITE_OPTIONAL)) {
+            rollback(i);
+            success = false;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sBatchLock);
+
+    mElapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::steady_clock::now() - batchStart)
+                         .count();
+    ALOGI("%s: %s in %" PRId64 " us, steps (us):%s", mName, success ? "committed" : "rolled back",
+          mElapsedUs, timings.c_str());
+    return success;
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+/*
+ * Returns the location of the sysfs or configfs path the HAL touches. Defined in UsbSysfsRoot.cpp,
+ * which returns path itself; the test harness links its own definition instead, relocating the
+ * paths under a fake Type-C tree.
+ */
+std::string sysfsPath(const std::string &path);
+
+// Failure of the step is logged but neither fails nor rolls back the batch
+#define SYSFS_WRITE_OPTIONAL (1 << 0)
+/*
+ * The attribute is not kept open, as it belongs to a transient device, e.g. a port partner, or
+ * to configfs, where an open fd pins the gadget against being torn down
+ */
+#define SYSFS_WRITE_UNCACHED (1 << 1)
+// Size of the buffer the previous value of an attribute is read into for rollback
+#define SYSFS_WRITE_MAX_VALUE_LEN 128
+
+/*
+ * SysfsWriteBatch writes a sequence of attributes in order, timing every step. When a required
+ * step fails, the steps already written are restored in reverse order, either to the rollback
+ * value given for them or to the value read just before writing them. That value is only read
+ * for steps a later required step can roll back. The fds of attributes are kept open across
+ * batches unless SYSFS_WRITE_UNCACHED, and batches are serialized against each other.
+ */
+class SysfsWriteBatch {
+  public:
+    // name identifies the batch in logs
+    explicit SysfsWriteBatch(const char *name);
+    // Appends a step writing value to path, returns its index
+    size_t add(const std::string &path, const std::string &value, uint32_t flags = 0,
+               std::optional<std::string> rollback = std::nullopt);
+    // Returns false when a required step failed, once the steps before it were rolled back
+    bool commit();
+    // Whether step was written and not rolled back
+    bool succeeded(size_t step) const { return mSteps[step].written; }
+    int64_t elapsedUs() const { return mElapsedUs; }
+
+  private:
+    struct Step {
+        std::string path;
+        std::string value;
+        uint32_t flags;
+        std::optional<std::string> rollback;
+        bool written;
+        int64_t elapsedUs;
+    };
+
+    void rollback(size_t failed);
+
+    const char *mName;
+    std::vector<Step> mSteps;
+    int64_t mElapsedUs;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
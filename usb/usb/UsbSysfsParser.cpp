@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "UsbSysfsParser.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+constexpr char kComplianceWarningBC12[] = "bc12";
+constexpr char kComplianceWarningDebugAccessory[] = "debug-accessory";
+constexpr char kComplianceWarningMissingRp[] = "missing_rp";
+constexpr char kComplianceWarningOther[] = "other";
+constexpr char kComplianceWarningInputPowerLimited[] = "input_power_limited";
+
+static bool startsWith(std::string_view value, std::string_view prefix) {
+    return value.substr(0, prefix.length()) == prefix;
+}
+
+std::string_view trimSysfsValue(std::string_view value) {
+    constexpr std::string_view kWhitespace = " \n\t\r";
+    size_t start = value.find_first_not_of(kWhitespace);
+
+    if (start == std::string_view::npos)
+        return std::string_view();
+    return value.substr(start, value.find_last_not_of(kWhitespace) - start + 1);
+}
+
+std::string_view selectedSysfsValue(std::string_view value) {
+    size_t first = value.find('[');
+    size_t last = value.find(']');
+
+    if (first == std::string_view::npos || last == std::string_view::npos || last < first)
+        return trimSysfsValue(value);
+    return value.substr(first + 1, last - first - 1);
+}
+
+TypeCRoleValue parseTypeCRole(std::string_view value) {
+    std::string_view role = selectedSysfsValue(value);
+
+    if (role == "source")
+        return TypeCRoleValue::SOURCE;
+    if (role == "sink")
+        return TypeCRoleValue::SINK;
+    if (role == "host")
+        return TypeCRoleValue::HOST;
+    if (role == "device")
+        return TypeCRoleValue::DEVICE;
+    if (role == "none")
+        return TypeCRoleValue::NONE;
+    return TypeCRoleValue::UNRECOGNIZED;
+}
+
+NonCompliantReason parseNonCompliantReason(std::string_view token) {
+    if (startsWith(token, kComplianceWarningDebugAccessory))
+        return NonCompliantReason::DEBUG_ACCESSORY;
+    if (startsWith(token, kComplianceWarningBC12))
+        return NonCompliantReason::BC12;
+    if (startsWith(token, kComplianceWarningMissingRp))
+        return NonCompliantReason::MISSING_RP;
+    if (startsWith(token, kComplianceWarningOther))
+        return NonCompliantReason::OTHER;
+    if (startsWith(token, kComplianceWarningInputPowerLimited))
+        return NonCompliantReason::INPUT_POWER_LIMITED;
+    return NonCompliantReason::UNKNOWN;
+}
+
+DisplayPortAltModePinAssignment parsePinAssignment(std::string_view value) {
+    size_t pos = value.find('[');
+
+    if (pos == std::string_view::npos || pos + 1 >= value.length())
+        return DisplayPortAltModePinAssignment::NONE;
+    switch (value[pos + 1]) {
+        case 'C':
+            return DisplayPortAltModePinAssignment::C;
+        case 'D':
+            return DisplayPortAltModePinAssignment::D;
+        case 'E':
+            return DisplayPortAltModePinAssignment::E;
+        default:
+            return DisplayPortAltModePinAssignment::NONE;
+    }
+}
+
+LinkTrainingStatus parseLinkTrainingStatus(std::string_view value) {
+    std::string_view status = trimSysfsValue(value);
+
+    if (status == LINK_TRAINING_STATUS_SUCCESS)
+        return LinkTrainingStatus::SUCCESS;
+    if (status == LINK_TRAINING_STATUS_FAILURE || status == LINK_TRAINING_STATUS_FAILURE_SINK)
+        return LinkTrainingStatus::FAILURE;
+    return LinkTrainingStatus::UNKNOWN;
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <aidl/android/hardware/usb/DisplayPortAltModePinAssignment.h>
+#include <aidl/android/hardware/usb/LinkTrainingStatus.h>
+
+#include <string_view>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+using ::aidl::android::hardware::usb::DisplayPortAltModePinAssignment;
+using ::aidl::android::hardware::usb::LinkTrainingStatus;
+
+#define LINK_TRAINING_STATUS_UNKNOWN "0"
+#define LINK_TRAINING_STATUS_SUCCESS "1"
+#define LINK_TRAINING_STATUS_FAILURE "2"
+#define LINK_TRAINING_STATUS_FAILURE_SINK "3"
+
+/*
+ * Parsers for the Type-C and DisplayPort sysfs attribute formats. They work on string_views of
+ * the raw attribute contents, e.g. a stack buffer filled by pread, and never allocate.
+ */
+
+// Values of the typec class data_role, power_role and port_type attributes
+enum class TypeCRoleValue { NONE, SOURCE, SINK, HOST, DEVICE, UNRECOGNIZED };
+
+// Reasons reported by the non_compliant_reasons attribute
+enum class NonCompliantReason {
+    BC12,
+    DEBUG_ACCESSORY,
+    MISSING_RP,
+    OTHER,
+    INPUT_POWER_LIMITED,
+    UNKNOWN
+};
+
+// Returns value without the leading and trailing whitespace sysfs attributes carry
+std::string_view trimSysfsValue(std::string_view value);
+
+/*
+ * Returns the selected entry of an enum attribute, "source" for "[source] sink". Attributes
+ * without a selection are returned trimmed.
+ */
+std::string_view selectedSysfsValue(std::string_view value);
+
+/*
+ * Calls fn with each entry of a list attribute such as "[bc12, missing_rp]", splitting on
+ * brackets, commas and whitespace.
+ */
+template <typename Fn>
+void forEachSysfsToken(std::string_view value, Fn fn) {
+    constexpr std::string_view kSeparators = "[], \n\t";
+    size_t start = value.find_first_not_of(kSeparators);
+
+    while (start != std::string_view::npos) {
+        size_t end = value.find_first_of(kSeparators, start);
+
+        fn(value.substr(start, end == std::string_view::npos ? end : end - start));
+        start = value.find_first_not_of(kSeparators, end);
+    }
+}
+
+TypeCRoleValue parseTypeCRole(std::string_view value);
+NonCompliantReason parseNonCompliantReason(std::string_view token);
+DisplayPortAltModePinAssignment parsePinAssignment(std::string_view value);
+LinkTrainingStatus parseLinkTrainingStatus(std::string_view value);
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.aidl-service"
+
+#include "UsbThermalController.h"
+
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+#include <dirent.h>
+
+#include <algorithm>
+#include <memory>
+
+#include "UsbSysfs.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+using ::android::base::ParseInt;
+using ::android::base::ReadFileToString;
+using ::android::base::Split;
+using ::android::base::Trim;
+
+constexpr char kThermalZonesPath[] = "/sys/class/thermal/";
+
+UsbThermalConfig defaultUsbThermalConfig(int tripDeciC) {
+    UsbThermalConfig config;
+
+    config.tripDeciC = tripDeciC;
+    config.stepMarginDeciC = 30;
+    config.lookaheadMs = 10000;
+    config.slopeWindowMs = 10000;
+    config.minStepIntervalMs = 30000;
+    config.releaseMarginDeciC = 80;
+    config.releaseHoldMs = 60000;
+    config.coldMarginDeciC = 150;
+    config.fastSlopeDeciCPerMin = 30;
+    config.fastSampleMs = 1000;
+    config.normalSampleMs = 5000;
+    config.slowSampleMs = 30000;
+    config.sinkCurrentStepsMa = {2000, 1500, 1000, 500};
+    return config;
+}
+
+UsbThermalController::UsbThermalController(UsbThermalConfig config)
+    : mConfig(std::move(config)),
+      mHasSample(false),
+      mRefTimeMs(0),
+      mRefTemperatureDeciC(0),
+      mLevel(0),
+      mLastStepMs(0),
+      mCoolSinceMs(-1) {}
+
+int UsbThermalController::sinkCurrentMa(int level) const {
+    return level ? mConfig.sinkCurrentStepsMa[level - 1] : -1;
+}
+
+UsbThermalController::Decision UsbThermalController::update(int64_t timeMs,
+                                                            int temperatureDeciC) {
+    const int maxLevel = mConfig.sinkCurrentStepsMa.size();
+    int previousLevel = mLevel;
+    int slope = 0;
+    int projected;
+    Decision decision;
+
+    if (!mHasSample) {
+        mHasSample = true;
+        mRefTimeMs = timeMs;
+        mRefTemperatureDeciC = temperatureDeciC;
+    } else if (timeMs > mRefTimeMs) {
+        slope = (int64_t)(temperatureDeciC - mRefTemperatureDeciC) * 60000 /
+                (timeMs - mRefTimeMs);
+        if (timeMs - mRefTimeMs >= mConfig.slopeWindowMs) {
+            mRefTimeMs = timeMs;
+            mRefTemperatureDeciC = temperatureDeciC;
+        }
+    }
+
+    projected = temperatureDeciC + (int64_t)std::max(slope, 0) * mConfig.lookaheadMs / 60000;
+    if (projected >= mConfig.tripDeciC - mConfig.stepMarginDeciC && mLevel < maxLevel &&
+        (mLevel == 0 || temperatureDeciC >= mConfig.tripDeciC ||
+         (slope > 0 && timeMs - mLastStepMs >= mConfig.minStepIntervalMs))) {
+        mLevel++;
+        mLastStepMs = timeMs;
+        mCoolSinceMs = -1;
+    } else if (temperatureDeciC <= mConfig.tripDeciC - mConfig.releaseMarginDeciC) {
+        if (mCoolSinceMs < 0) {
+            mCoolSinceMs = timeMs;
+        } else if (mLevel > 0 && timeMs - mCoolSinceMs >= mConfig.releaseHoldMs) {
+            // Each further release needs another hold below the margin
+            mLevel--;
+            mCoolSinceMs = timeMs;
+        }
+    } else {
+        mCoolSinceMs = -1;
+    }
+
+    decision.level = mLevel;
+    decision.sinkCurrentMa = sinkCurrentMa(mLevel);
+    decision.changed = mLevel != previousLevel;
+    decision.slopeDeciCPerMin = slope;
+    if (slope >= mConfig.fastSlopeDeciCPerMin ||
+        projected >= mConfig.tripDeciC - mConfig.stepMarginDeciC) {
+        decision.nextSampleMs = mConfig.fastSampleMs;
+    } else if (mLevel == 0 && slope <= 0 &&
+               temperatureDeciC <= mConfig.tripDeciC - mConfig.coldMarginDeciC) {
+        decision.nextSampleMs = mConfig.slowSampleMs;
+    } else {
+        decision.nextSampleMs = mConfig.normalSampleMs;
+    }
+    return decision;
+}
+
+bool parseUsbThermalTrace(const std::string &trace,
+                          std::vector<std::pair<int64_t, int>> *samples, std::string *error) {
+    for (const std::string &rawLine : Split(trace, "\n")) {
+        std::string line = Trim(rawLine);
+        std::vector<std::string> fields;
+        int64_t timeMs;
+        int temperatureDeciC;
+
+        if (line.empty() || line[0] == '#')
+            continue;
+        for (const std::string &field : Split(line, " \t")) {
+            if (!field.empty())
+                fields.push_back(field);
+        }
+        if (fields.size() != 2 || !ParseInt(fields[0], &timeMs) ||
+            !ParseInt(fields[1], &temperatureDeciC)) {
+            *error = rawLine;
+            return false;
+        }
+        samples->emplace_back(timeMs, temperatureDeciC);
+    }
+    return true;
+}
+
+std::string findThermalZonePath(const std::string &type) {
+    std::unique_ptr<DIR, int (*)(DIR *)> dir(opendir(sysfsPath(kThermalZonesPath).c_str()),
+                                             closedir);
+    struct dirent *entry;
+
+    if (!dir)
+        return "";
+    while ((entry = readdir(dir.get())) != NULL) {
+        std::string zonePath = sysfsPath(kThermalZonesPath) + entry->d_name + "/";
+        std::string zoneType;
+
+        if (!::android::base::StartsWith(entry->d_name, "thermal_zone") ||
+            !ReadFileToString(zonePath + "type", &zoneType) || Trim(zoneType) != type) {
+            continue;
+        }
+        return zonePath;
+    }
+    return "";
+}
+
+bool readThermalZoneDeciC(const std::string &path, int *deciC) {
+    std::string contents;
+    int milliC;
+
+    if (!ReadFileToString(path, &contents) || !ParseInt(Trim(contents), &milliC))
+        return false;
+    *deciC = milliC / 100;
+    return true;
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
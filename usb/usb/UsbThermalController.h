@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+// Enables the in-HAL USB thermal controller, off by default
+#define USB_THERMAL_CONTROL_PROPERTY "vendor.usb.thermal_control"
+/*
+ * CRITICAL trip temperature in deci Celsius the controller steers below, used when the trip
+ * zone has no kernel trip point to read
+ */
+#define USB_THERMAL_TRIP_PROPERTY "vendor.usb.thermal_trip_deci_c"
+
+/*
+ * Tuning of UsbThermalController. Temperatures are in deci Celsius, slopes in deci Celsius per
+ * minute.
+ */
+struct UsbThermalConfig {
+    int tripDeciC;
+    // A level is stepped down once the temperature is projected within this margin of the trip
+    int stepMarginDeciC;
+    // How far ahead the temperature is projected along the current slope
+    int lookaheadMs;
+    // The slope is measured against a sample at least this old, smoothing out sensor steps
+    int slopeWindowMs;
+    /*
+     * Minimum time between two step downs below the trip, so a step can take effect first. A
+     * further step also needs the temperature to be still rising.
+     */
+    int minStepIntervalMs;
+    // A level is released after the temperature stayed this far below the trip for releaseHoldMs
+    int releaseMarginDeciC;
+    int releaseHoldMs;
+    // Sampling is slowed down this far below the trip while the temperature is not rising
+    int coldMarginDeciC;
+    // Sampling is sped up while rising at least this fast
+    int fastSlopeDeciCPerMin;
+    int fastSampleMs;
+    int normalSampleMs;
+    int slowSampleMs;
+    // usb_limit_sink_current applied at levels 1..N, level 0 leaves the sink current unlimited
+    std::vector<int> sinkCurrentStepsMa;
+};
+
+UsbThermalConfig defaultUsbThermalConfig(int tripDeciC);
+
+/*
+ * UsbThermalController steps the sink current limit ahead of the CRITICAL trip and picks the
+ * next sampling interval from the temperature slope. It keeps no reference to the system, so
+ * recorded thermal traces can be replayed through it with identical decisions.
+ */
+class UsbThermalController {
+  public:
+    struct Decision {
+        // Limit level after this sample, and the sink current it maps to, -1 when unlimited
+        int level;
+        int sinkCurrentMa;
+        // Whether level differs from the previous sample
+        bool changed;
+        int slopeDeciCPerMin;
+        int nextSampleMs;
+    };
+
+    explicit UsbThermalController(UsbThermalConfig config);
+    Decision update(int64_t timeMs, int temperatureDeciC);
+    const UsbThermalConfig &config() const { return mConfig; }
+
+  private:
+    int sinkCurrentMa(int level) const;
+
+    const UsbThermalConfig mConfig;
+    bool mHasSample;
+    // Sample the slope is measured against
+    int64_t mRefTimeMs;
+    int mRefTemperatureDeciC;
+    int mLevel;
+    int64_t mLastStepMs;
+    // Start of the current stretch below the release margin, -1 outside of one
+    int64_t mCoolSinceMs;
+};
+
+/*
+ * Parses a recorded thermal trace, one "TIME_MS TEMPERATURE_DECI_C" sample per line. Empty and
+ * # comment lines are skipped. Returns false with the offending line in error when malformed.
+ */
+bool parseUsbThermalTrace(const std::string &trace,
+                          std::vector<std::pair<int64_t, int>> *samples, std::string *error);
+
+// Returns the sysfs directory of the thermal zone of the given type, or "" when there is none
+std::string findThermalZonePath(const std::string &type);
+// Reads a millidegree Celsius thermal zone attribute as deci Celsius
+bool readThermalZoneDeciC(const std::string &path, int *deciC);
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
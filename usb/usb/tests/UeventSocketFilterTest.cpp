@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "UeventSocketFilter.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+constexpr char kTcpc6[] = "/devices/platform/108d0000.hsi2c/i2c-6/6-0025";
+constexpr char kTcpc11[] = "/devices/platform/10cb0000.hsi2c/i2c-11/11-0025";
+constexpr char kUsbController[] = "/devices/platform/11210000.usb/";
+constexpr char kCoolingDev[] = "/devices/platform/google,usbc_port_cooling_dev";
+constexpr char kPogo[] = "/devices/platform/google,pogo";
+
+/*
+ * Devpath scopes the HAL subscribes with on a board with two tcpc ports: the uevent handler's
+ * tcpcs, usb power supply, cooling device and pogo transport, UsbDataSessionMonitor's udc and
+ * xhci devpaths, and UsbHubMatcher's usb controller.
+ */
+static std::vector<std::string> fullTableHelper() {
+    return {kTcpc6,
+            kTcpc11,
+            std::string(kTcpc6) + "/power_supply/usb",
+            kCoolingDev,
+            kPogo,
+            "/devices/platform/11210000.usb/11210000.dwc3/udc/11210000.dwc3",
+            "/devices/platform/11210000.usb/11210000.dwc3/xhci-hcd-exynos.",
+            "/devices/platform/11210000.usb/11210000.dwc3/xhci-hcd-exynos.",
+            kUsbController};
+}
+
+/*
+ * Runs prog over msg as the kernel runs a socket filter, for the instructions the builder emits.
+ * Returns the accepted length, 0 when the message is dropped.
+ */
+static uint32_t runFilterHelper(const std::vector<struct sock_filter> &prog,
+                                const std::string &msg) {
+    uint32_t a = 0;
+
+    for (size_t pc = 0; pc < prog.size(); pc++) {
+        const struct sock_filter &insn = prog[pc];
+
+        switch (insn.code) {
+            case BPF_LD | BPF_ABS | BPF_W:
+            case BPF_LD | BPF_ABS | BPF_H:
+            case BPF_LD | BPF_ABS | BPF_B: {
+                size_t width = BPF_SIZE(insn.code) == BPF_W   ? 4
+                               : BPF_SIZE(insn.code) == BPF_H ? 2
+                                                              : 1;
+
+                if (insn.k + width > msg.size())
+                    return 0;
+                a = 0;
+                for (size_t i = 0; i < width; i++)
+                    a = (a << 8) | static_cast<uint8_t>(msg[insn.k + i]);
+                break;
+            }
+            case BPF_JMP | BPF_JEQ | BPF_K:
+                pc += a == insn.k ? insn.jt : insn.jf;
+                break;
+            case BPF_JMP | BPF_JA:
+                pc += insn.k;
+                break;
+            case BPF_RET | BPF_K:
+                return insn.k;
+            default:
+                ADD_FAILURE() << "unexpected instruction " << insn.code << " at " << pc;
+                return 0;
+        }
+    }
+    ADD_FAILURE() << "program ran off its end";
+    return 0;
+}
+
+static std::string ueventHelper(const std::string &action, const std::string &devpath) {
+    std::string msg = action + "@" + devpath;
+
+    msg.push_back('\0');
+    msg += "ACTION=" + action;
+    msg.push_back('\0');
+    return msg;
+}
+
+TEST(UeventSocketFilterTest, CoveredPrefixesAreDropped) {
+    std::vector<std::string> prefixes = fullTableHelper();
+
+    reduceDevpathPrefixes(&prefixes);
+    EXPECT_EQ(prefixes, (std::vector<std::string>{kTcpc6, kTcpc11, kUsbController, kPogo,
+                                                  kCoolingDev}));
+}
+
+TEST(UeventSocketFilterTest, FullTableFitsAndFilters) {
+    std::vector<std::string> prefixes = fullTableHelper();
+    std::vector<struct sock_filter> prog;
+
+    reduceDevpathPrefixes(&prefixes);
+    ASSERT_TRUE(buildUeventSocketFilter(prefixes, &prog));
+    EXPECT_LE(prog.size(), (size_t)BPF_MAXINSNS);
+
+    EXPECT_NE(runFilterHelper(prog, ueventHelper("add", std::string(kTcpc6) +
+                                                            "/typec/port0/port0-partner")),
+              0u);
+    EXPECT_NE(runFilterHelper(prog, ueventHelper("change", kTcpc11)), 0u);
+    EXPECT_NE(runFilterHelper(prog, ueventHelper("offline", std::string(kUsbController) +
+                                                                "11210000.dwc3")),
+              0u);
+    EXPECT_NE(runFilterHelper(prog, ueventHelper("unbind", std::string(kPogo) + "/extcon")),
+              0u);
+    EXPECT_NE(runFilterHelper(prog, ueventHelper("bind", std::string(kUsbController) +
+                                                             "11210000.dwc3/xhci-hcd-exynos.4.auto/"
+                                                             "usb1/1-1")),
+              0u);
+
+    EXPECT_EQ(runFilterHelper(prog, ueventHelper("change", "/devices/platform/17000000.ufs")), 0u);
+    EXPECT_EQ(runFilterHelper(prog, ueventHelper("move", "/devices/system/cpu/cpu7")), 0u);
+    // An unknown action, and a message shorter than the comparisons
+    EXPECT_EQ(runFilterHelper(prog, ueventHelper("attach", kTcpc6)), 0u);
+    EXPECT_EQ(runFilterHelper(prog, "add@/d"), 0u);
+}
+
+/*
+ * With enough tcpc ports an action block grows past what a conditional jump reaches, which the
+ * trampoline to the next action block has to bridge.
+ */
+TEST(UeventSocketFilterTest, LargeActionBlocksStayReachable) {
+    std::vector<std::string> prefixes;
+    std::vector<struct sock_filter> prog;
+
+    for (int i = 0; i < 12; i++)
+        prefixes.push_back("/devices/platform/10" + std::to_string(i) + "0000.hsi2c/i2c-" +
+                           std::to_string(i) + "/" + std::to_string(i) + "-0025");
+    reduceDevpathPrefixes(&prefixes);
+    ASSERT_TRUE(buildUeventSocketFilter(prefixes, &prog));
+    ASSERT_GT(prog.size() / 8, (size_t)UINT8_MAX);
+
+    for (const char *action : UEVENT_ACTIONS) {
+        EXPECT_NE(runFilterHelper(prog, ueventHelper(action, prefixes.back() + "/typec/port0")),
+                  0u)
+                << action;
+        EXPECT_EQ(runFilterHelper(prog, ueventHelper(action, "/devices/virtual/misc/fuse")), 0u)
+                << action;
+    }
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,405 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.aidl-service.harness"
+
+#include "UsbHalHarness.h"
+
+#include <android-base/file.h>
+#include <android-base/strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <utils/Log.h>
+
+#include <algorithm>
+#include <filesystem>
+
+#include "UeventDispatcher.h"
+#include "UsbSysfs.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+using ::android::base::ReadFileToString;
+using ::android::base::Split;
+using ::android::base::unique_fd;
+using ::android::base::WriteStringToFile;
+
+// Size of the harness socket's receive buffer, as requested for the kernel socket
+#define FAKE_UEVENT_RCVBUF (64 * 1024)
+
+// Parent of the fake sysfs root when TMPDIR is not set
+#ifdef __ANDROID__
+constexpr char kDefaultTmpDir[] = "/data/local/tmp";
+#else
+constexpr char kDefaultTmpDir[] = "/tmp";
+#endif
+
+static const std::string kFakePort = std::string("/sys") + kFakeTcpcDevpath + "/typec/port0";
+
+std::string sysfsPath(const std::string &path) {
+    return FakeSysfs::root() + path;
+}
+
+unique_fd openUeventSocket(bool *fromKernel) {
+    *fromKernel = false;
+    return FakeUeventSource::getInstance().takeReceiver();
+}
+
+const std::string &FakeSysfs::root() {
+    static const std::string sRoot = []() {
+        const char *tmp = getenv("TMPDIR");
+        std::string pattern = std::string(tmp ? tmp : kDefaultTmpDir) + "/usbhal.XXXXXX";
+
+        if (mkdtemp(pattern.data()) == NULL) {
+            ALOGE("fake sysfs root %s: mkdtemp failed; errno=%d", pattern.c_str(), errno);
+            abort();
+        }
+        return pattern;
+    }();
+
+    return sRoot;
+}
+
+bool FakeSysfs::write(const std::string &path, const std::string &value) {
+    std::error_code ec;
+    std::string target = sysfsPath(path);
+
+    std::filesystem::create_directories(std::filesystem::path(target).parent_path(), ec);
+    return WriteStringToFile(value, target);
+}
+
+std::string FakeSysfs::read(const std::string &path) {
+    std::string value;
+
+    ReadFileToString(sysfsPath(path), &value);
+    return value;
+}
+
+bool FakeSysfs::link(const std::string &target, const std::string &path) {
+    std::error_code ec;
+    std::string linkPath = sysfsPath(path);
+
+    std::filesystem::create_directories(std::filesystem::path(linkPath).parent_path(), ec);
+    std::filesystem::create_directories(sysfsPath(target), ec);
+    std::filesystem::remove(linkPath, ec);
+    std::filesystem::create_directory_symlink(sysfsPath(target), linkPath, ec);
+    return !ec;
+}
+
+void FakeSysfs::remove(const std::string &path) {
+    std::error_code ec;
+
+    std::filesystem::remove_all(sysfsPath(path), ec);
+}
+
+void FakeSysfs::populate() {
+    std::string tcpc = std::string("/sys") + kFakeTcpcDevpath;
+
+    write(tcpc + "/name", "max77759tcpc\n");
+    write(tcpc + "/contaminant_detection", "0\n");
+    write(tcpc + "/contaminant_detection_status", "0\n");
+    write(tcpc + "/usb_limit_sink_enable", "0\n");
+    write(tcpc + "/usb_limit_source_enable", "0\n");
+    write(tcpc + "/usb_limit_sink_current", "0\n");
+
+    write(kFakePort + "/data_role", "host [device]\n");
+    write(kFakePort + "/power_role", "source [sink]\n");
+    write(kFakePort + "/port_type", "[dual] source sink\n");
+    write(kFakePort + "/device/non_compliant_reasons", "\n");
+    write(kFakePort + "/port0.0/mode1/active", "no\n");
+    link(kFakePort, "/sys/class/typec/port0");
+
+    write(tcpc + "/power_supply/usb/usb_type", "[SDP] DCP CDP C PD PD_PPS\n");
+    link(tcpc + "/power_supply/usb", "/sys/class/power_supply/usb");
+
+    write("/sys/devices/platform/11210000.usb/dwc3_exynos_otg_id", "1\n");
+    write("/sys/devices/platform/11210000.usb/dwc3_exynos_otg_b_sess", "0\n");
+    write("/sys/devices/platform/11210000.usb/usb_data_enabled", "1\n");
+    write("/sys/devices/platform/11210000.usb/new_data_role", "device\n");
+    write("/sys/devices/platform/11210000.usb/11210000.dwc3/udc/11210000.dwc3/state",
+          "not attached\n");
+    write("/sys/bus/usb/devices/usb1/1-0:1.0/usb1-port1/state", "not attached\n");
+    write("/sys/bus/usb/devices/usb2/2-0:1.0/usb2-port1/state", "not attached\n");
+    write("/config/usb_gadget/g1/UDC", "\n");
+
+    for (const char *attr : {"hpd", "irq_hpd", "orientation", "pin_assignment", "link_status",
+                             "usbc_cable_disconnect"}) {
+        write(std::string("/sys/devices/platform/110f0000.drmdp/drm-displayport/") + attr,
+              "0\n");
+    }
+}
+
+void FakeSysfs::attachPartner(bool displayPort) {
+    std::string partner = kFakePort + "/port0-partner";
+
+    write(partner + "/accessory_mode", "none\n");
+    write(partner + "/supports_usb_power_delivery", "yes\n");
+    if (displayPort) {
+        std::string altMode = partner + "/port0-partner.0";
+
+        write(altMode + "/svid", "ff01\n");
+        write(altMode + "/vdo", "0x001c0045\n");
+        write(altMode + "/displayport/hpd", "0\n");
+        write(altMode + "/displayport/pin_assignment", "[C] D E\n");
+        write(altMode + "/displayport/irq_hpd", "0\n");
+    }
+    link(partner, "/sys/class/typec/port0-partner");
+}
+
+void FakeSysfs::detachPartner() {
+    remove("/sys/class/typec/port0-partner");
+    remove(kFakePort + "/port0-partner");
+}
+
+FakeUeventSource &FakeUeventSource::getInstance() {
+    static FakeUeventSource *sInstance = new FakeUeventSource();
+
+    return *sInstance;
+}
+
+FakeUeventSource::FakeUeventSource() {
+    int fds[2];
+    int rcvbuf = FAKE_UEVENT_RCVBUF;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds)) {
+        ALOGE("fake uevent socketpair failed; errno=%d", errno);
+        return;
+    }
+    mReceiver.reset(fds[0]);
+    mSender.reset(fds[1]);
+    fcntl(mReceiver.get(), F_SETFL, O_NONBLOCK);
+    setsockopt(mReceiver.get(), SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+}
+
+unique_fd FakeUeventSource::takeReceiver() {
+    return std::move(mReceiver);
+}
+
+bool FakeUeventSource::send(const std::string &action, const std::string &devpath,
+                            const std::vector<std::string> &env) {
+    std::vector<std::string> fields = {action + "@" + devpath, "ACTION=" + action,
+                                       "DEVPATH=" + devpath};
+
+    fields.insert(fields.end(), env.begin(), env.end());
+    return send(fields);
+}
+
+bool FakeUeventSource::send(const std::vector<std::string> &fields) {
+    std::string msg;
+
+    for (const std::string &field : fields) {
+        msg += field;
+        msg.push_back('\0');
+    }
+    // Blocks while the HAL's receive buffer is full, as a paced kernel would not drop
+    if (TEMP_FAILURE_RETRY(::send(mSender.get(), msg.data(), msg.length(), 0)) !=
+        static_cast<ssize_t>(msg.length())) {
+        ALOGE("fake uevent send failed; errno=%d", errno);
+        return false;
+    }
+    return true;
+}
+
+std::vector<std::vector<std::string>> FakeUeventSource::parseRecorded(
+        const std::string &contents) {
+    std::vector<std::vector<std::string>> uevents(1);
+
+    for (const std::string &line : Split(contents, "\n")) {
+        if (line.empty()) {
+            if (!uevents.back().empty())
+                uevents.emplace_back();
+        } else if (line[0] != '#') {
+            uevents.back().push_back(line);
+        }
+    }
+    if (uevents.back().empty())
+        uevents.pop_back();
+    return uevents;
+}
+
+MockUsbCallback::MockUsbCallback()
+    : mLock(PTHREAD_MUTEX_INITIALIZER),
+      mCond(PTHREAD_COND_INITIALIZER),
+      mPortStatusLag("port_status_lag") {}
+
+void MockUsbCallback::markStimulus() {
+    pthread_mutex_lock(&mLock);
+    mStimuli.push_back(std::chrono::steady_clock::now());
+    pthread_mutex_unlock(&mLock);
+}
+
+static struct timespec deadlineHelper(std::chrono::milliseconds timeout) {
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout.count() / 1000;
+    deadline.tv_nsec += (timeout.count() % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    return deadline;
+}
+
+bool MockUsbCallback::waitFor(const std::string &method, size_t count,
+                              std::chrono::milliseconds timeout) {
+    struct timespec deadline = deadlineHelper(timeout);
+    bool found;
+
+    pthread_mutex_lock(&mLock);
+    while (!(found = std::count_if(mNotifications.begin(), mNotifications.end(),
+                                   [&method](const Notification &notification) {
+                                       return notification.method == method;
+                                   }) >= static_cast<ssize_t>(count))) {
+        if (pthread_cond_timedwait(&mCond, &mLock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&mLock);
+    return found;
+}
+
+bool MockUsbCallback::waitForAnswered(std::chrono::milliseconds timeout) {
+    struct timespec deadline = deadlineHelper(timeout);
+    bool answered;
+
+    pthread_mutex_lock(&mLock);
+    while (!(answered = mStimuli.empty())) {
+        if (pthread_cond_timedwait(&mCond, &mLock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&mLock);
+    return answered;
+}
+
+size_t MockUsbCallback::count(const std::string &method) {
+    size_t count;
+
+    pthread_mutex_lock(&mLock);
+    count = std::count_if(mNotifications.begin(), mNotifications.end(),
+                          [&method](const Notification &notification) {
+                              return notification.method == method;
+                          });
+    pthread_mutex_unlock(&mLock);
+    return count;
+}
+
+std::vector<MockUsbCallback::Notification> MockUsbCallback::notifications() {
+    std::vector<Notification> notifications;
+
+    pthread_mutex_lock(&mLock);
+    notifications = mNotifications;
+    pthread_mutex_unlock(&mLock);
+    return notifications;
+}
+
+std::vector<PortStatus> MockUsbCallback::lastPortStatus() {
+    std::vector<PortStatus> status;
+
+    pthread_mutex_lock(&mLock);
+    status = mLastPortStatus;
+    pthread_mutex_unlock(&mLock);
+    return status;
+}
+
+void MockUsbCallback::record(const char *method, const std::string &portName, Status status,
+                             int64_t transactionId) {
+    pthread_mutex_lock(&mLock);
+    mNotifications.push_back({method, portName, status, transactionId});
+    pthread_cond_broadcast(&mCond);
+    pthread_mutex_unlock(&mLock);
+}
+
+ScopedAStatus MockUsbCallback::notifyPortStatusChange(
+        const std::vector<PortStatus> &in_currentPortStatus, Status in_retval) {
+    auto now = std::chrono::steady_clock::now();
+
+    pthread_mutex_lock(&mLock);
+    // A port status answers every stimulus sent before it
+    for (const auto &stimulus : mStimuli) {
+        mPortStatusLag.record(
+            std::chrono::duration_cast<std::chrono::microseconds>(now - stimulus).count());
+    }
+    mStimuli.clear();
+    mLastPortStatus = in_currentPortStatus;
+    pthread_mutex_unlock(&mLock);
+
+    record("notifyPortStatusChange",
+           in_currentPortStatus.empty() ? "" : in_currentPortStatus[0].portName, in_retval, 0);
+    return ScopedAStatus::ok();
+}
+
+ScopedAStatus MockUsbCallback::notifyRoleSwitchStatus(const std::string &in_portName,
+                                                      const PortRole & /*in_newRole*/,
+                                                      Status in_retval,
+                                                      int64_t in_transactionId) {
+    record("notifyRoleSwitchStatus", in_portName, in_retval, in_transactionId);
+    return ScopedAStatus::ok();
+}
+
+ScopedAStatus MockUsbCallback::notifyEnableUsbDataStatus(const std::string &in_portName,
+                                                         bool /*in_enable*/, Status in_retval,
+                                                         int64_t in_transactionId) {
+    record("notifyEnableUsbDataStatus", in_portName, in_retval, in_transactionId);
+    return ScopedAStatus::ok();
+}
+
+ScopedAStatus MockUsbCallback::notifyEnableUsbDataWhileDockedStatus(
+        const std::string &in_portName, Status in_retval, int64_t in_transactionId) {
+    record("notifyEnableUsbDataWhileDockedStatus", in_portName, in_retval, in_transactionId);
+    return ScopedAStatus::ok();
+}
+
+ScopedAStatus MockUsbCallback::notifyContaminantEnabledStatus(const std::string &in_portName,
+                                                              bool /*in_enable*/,
+                                                              Status in_retval,
+                                                              int64_t in_transactionId) {
+    record("notifyContaminantEnabledStatus", in_portName, in_retval, in_transactionId);
+    return ScopedAStatus::ok();
+}
+
+ScopedAStatus MockUsbCallback::notifyQueryPortStatus(const std::string &in_portName,
+                                                     Status in_retval,
+                                                     int64_t in_transactionId) {
+    record("notifyQueryPortStatus", in_portName, in_retval, in_transactionId);
+    return ScopedAStatus::ok();
+}
+
+ScopedAStatus MockUsbCallback::notifyLimitPowerTransferStatus(const std::string &in_portName,
+                                                              bool /*in_limit*/,
+                                                              Status in_retval,
+                                                              int64_t in_transactionId) {
+    record("notifyLimitPowerTransferStatus", in_portName, in_retval, in_transactionId);
+    return ScopedAStatus::ok();
+}
+
+ScopedAStatus MockUsbCallback::notifyResetUsbPortStatus(const std::string &in_portName,
+                                                        Status in_retval,
+                                                        int64_t in_transactionId) {
+    record("notifyResetUsbPortStatus", in_portName, in_retval, in_transactionId);
+    return ScopedAStatus::ok();
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
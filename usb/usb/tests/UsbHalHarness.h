@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <aidl/android/hardware/usb/BnUsbCallback.h>
+#include <android-base/unique_fd.h>
+#include <pthread.h>
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "LatencyHistogram.h"
+
+/*
+ * Test harness of the USB HAL. Linking it in place of UsbSysfsRoot.cpp and UeventSocket.cpp
+ * relocates every sysfs and configfs path under a temporary directory and replaces the kernel
+ * uevent socket by a local socket the test writes uevents to.
+ */
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+using ::ndk::ScopedAStatus;
+
+// Devpath of the max77759 tcpc on the first hsi2c bus, as on the device
+constexpr char kFakeTcpcDevpath[] = "/devices/platform/108d0000.hsi2c/i2c-6/6-0025";
+
+class FakeSysfs {
+  public:
+    // Directory standing for "/", created on first use
+    static const std::string &root();
+    // Writes value to the relocated path, creating its parent directories
+    static bool write(const std::string &path, const std::string &value);
+    static std::string read(const std::string &path);
+    // Creates the relocated path as a symlink to the relocated target
+    static bool link(const std::string &target, const std::string &path);
+    // Removes the relocated path and everything below it
+    static void remove(const std::string &path);
+    /*
+     * Populates port0 behind the tcpc with no partner attached, its power supply, the udc and
+     * the DisplayPort drm attributes. Must run before the Usb instance is constructed.
+     */
+    static void populate();
+    static void attachPartner(bool displayPort);
+    static void detachPartner();
+};
+
+/*
+ * Stands in for the kernel uevent socket. The HAL receives from one end of a local
+ * SOCK_SEQPACKET pair, the test sends uevents formatted as the kernel does to the other.
+ */
+class FakeUeventSource {
+  public:
+    static FakeUeventSource &getInstance();
+    // Sends "ACTION@DEVPATH" followed by the KEY=VALUE fields of env
+    bool send(const std::string &action, const std::string &devpath,
+              const std::vector<std::string> &env = {});
+    // Sends a uevent recorded as its fields, the "ACTION@DEVPATH" header first
+    bool send(const std::vector<std::string> &fields);
+    /*
+     * Parses uevents recorded with one field per line, e.g. from "udevadm monitor -k -p", and
+     * separated by empty lines. Lines starting with '#' are comments.
+     */
+    static std::vector<std::vector<std::string>> parseRecorded(const std::string &contents);
+    // Hands the receiving end to the HAL's dispatcher, once
+    ::android::base::unique_fd takeReceiver();
+
+  private:
+    FakeUeventSource();
+
+    ::android::base::unique_fd mSender;
+    ::android::base::unique_fd mReceiver;
+};
+
+/*
+ * IUsbCallback that records every notification, and for every stimulus the test marked the time
+ * until the first port status change delivered after it.
+ */
+class MockUsbCallback : public BnUsbCallback {
+  public:
+    struct Notification {
+        std::string method;
+        std::string portName;
+        Status status;
+        int64_t transactionId;
+    };
+
+    MockUsbCallback();
+
+    // Stamps a stimulus, e.g. a uevent about to be sent
+    void markStimulus();
+    // Waits until at least count notifications of method arrived, false on timeout
+    bool waitFor(const std::string &method, size_t count, std::chrono::milliseconds timeout);
+    // Waits until a port status change followed every stimulus, false on timeout
+    bool waitForAnswered(std::chrono::milliseconds timeout);
+    size_t count(const std::string &method);
+    std::vector<Notification> notifications();
+    std::vector<PortStatus> lastPortStatus();
+    // Stimulus to port status change latency
+    LatencyHistogram &portStatusLag() { return mPortStatusLag; }
+
+    ScopedAStatus notifyPortStatusChange(const std::vector<PortStatus> &in_currentPortStatus,
+                                         Status in_retval) override;
+    ScopedAStatus notifyRoleSwitchStatus(const std::string &in_portName,
+                                         const PortRole &in_newRole, Status in_retval,
+                                         int64_t in_transactionId) override;
+    ScopedAStatus notifyEnableUsbDataStatus(const std::string &in_portName, bool in_enable,
+                                            Status in_retval, int64_t in_transactionId) override;
+    ScopedAStatus notifyEnableUsbDataWhileDockedStatus(const std::string &in_portName,
+                                                       Status in_retval,
+                                                       int64_t in_transactionId) override;
+    ScopedAStatus notifyContaminantEnabledStatus(const std::string &in_portName, bool in_enable,
+                                                 Status in_retval,
+                                                 int64_t in_transactionId) override;
+    ScopedAStatus notifyQueryPortStatus(const std::string &in_portName, Status in_retval,
+                                        int64_t in_transactionId) override;
+    ScopedAStatus notifyLimitPowerTransferStatus(const std::string &in_portName, bool in_limit,
+                                                 Status in_retval,
+                                                 int64_t in_transactionId) override;
+    ScopedAStatus notifyResetUsbPortStatus(const std::string &in_portName, Status in_retval,
+                                           int64_t in_transactionId) override;
+
+  private:
+    void record(const char *method, const std::string &portName, Status status,
+                int64_t transactionId);
+
+    pthread_mutex_t mLock;
+    pthread_cond_t mCond;
+    std::vector<Notification> mNotifications;
+    std::vector<PortStatus> mLastPortStatus;
+    std::deque<std::chrono::steady_clock::time_point> mStimuli;
+    LatencyHistogram mPortStatusLag;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
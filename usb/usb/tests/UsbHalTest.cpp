@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "Usb.h"
+#include "UsbHalHarness.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+using std::chrono_literals::operator""ms;
+
+static const std::string kPortDevpath = std::string(kFakeTcpcDevpath) + "/typec/port0";
+static const std::string kPartnerDevpath = kPortDevpath + "/port0-partner";
+
+/*
+ * The HAL keeps process wide state, its uevent dispatcher and metrics, so a single Usb instance
+ * and callback serve every test. Each test leaves the port without a partner.
+ */
+class UsbHalTest : public ::testing::Test {
+  protected:
+    static void SetUpTestSuite() {
+        FakeSysfs::populate();
+        sUsb = ::ndk::SharedRefBase::make<Usb>();
+        sCallback = ::ndk::SharedRefBase::make<MockUsbCallback>();
+        ASSERT_TRUE(sUsb->setCallback(sCallback).isOk());
+    }
+
+    static shared_ptr<Usb> sUsb;
+    static shared_ptr<MockUsbCallback> sCallback;
+};
+
+shared_ptr<Usb> UsbHalTest::sUsb;
+shared_ptr<MockUsbCallback> UsbHalTest::sCallback;
+
+TEST_F(UsbHalTest, QueryPortStatusCompletesTransaction) {
+    size_t queried = sCallback->count("notifyQueryPortStatus");
+
+    ASSERT_TRUE(sUsb->queryPortStatus(42).isOk());
+    ASSERT_TRUE(sCallback->waitFor("notifyQueryPortStatus", queried + 1, 2000ms));
+
+    auto notifications = sCallback->notifications();
+    auto last = std::find_if(notifications.rbegin(), notifications.rend(),
+                             [](const MockUsbCallback::Notification &notification) {
+                                 return notification.method == "notifyQueryPortStatus";
+                             });
+    EXPECT_EQ(last->transactionId, 42);
+    EXPECT_EQ(last->status, Status::SUCCESS);
+    ASSERT_FALSE(sCallback->lastPortStatus().empty());
+    EXPECT_EQ(sCallback->lastPortStatus()[0].portName, "port0");
+}
+
+TEST_F(UsbHalTest, PartnerUeventsNotifyPortStatus) {
+    size_t changes = sCallback->count("notifyPortStatusChange");
+
+    FakeSysfs::attachPartner(false);
+    sCallback->markStimulus();
+    ASSERT_TRUE(FakeUeventSource::getInstance().send("add", kPartnerDevpath,
+                                                     {"SUBSYSTEM=typec", "DEVTYPE=typec_partner"}));
+    ASSERT_TRUE(sCallback->waitFor("notifyPortStatusChange", changes + 1, 2000ms));
+
+    FakeSysfs::detachPartner();
+    sCallback->markStimulus();
+    ASSERT_TRUE(FakeUeventSource::getInstance().send(
+        "remove", kPartnerDevpath, {"SUBSYSTEM=typec", "DEVTYPE=typec_partner"}));
+    ASSERT_TRUE(sCallback->waitFor("notifyPortStatusChange", changes + 2, 2000ms));
+    EXPECT_GE(sCallback->portStatusLag().count(), 2u);
+}
+
+TEST_F(UsbHalTest, UnrelatedUeventsAreIgnored) {
+    size_t changes = sCallback->count("notifyPortStatusChange");
+
+    ASSERT_TRUE(FakeUeventSource::getInstance().send(
+        "change", "/devices/platform/17000000.ufs/host0", {"SUBSYSTEM=scsi_host"}));
+    // A relevant uevent sent afterwards is handled first in order, so one change proves both
+    ASSERT_TRUE(FakeUeventSource::getInstance().send("change", kPortDevpath,
+                                                     {"SUBSYSTEM=typec", "DEVTYPE=typec_port"}));
+    ASSERT_TRUE(sCallback->waitFor("notifyPortStatusChange", changes + 1, 2000ms));
+    EXPECT_EQ(sCallback->count("notifyPortStatusChange"), changes + 1);
+}
+
+TEST_F(UsbHalTest, UeventScopeFollowsDiscoveredTcpc) {
+    size_t changes = sCallback->count("notifyPortStatusChange");
+
+    // The second hsi2c bus carries the tcpc on other boards only
+    ASSERT_TRUE(FakeUeventSource::getInstance().send(
+        "change", "/devices/platform/10cb0000.hsi2c/i2c-11/11-0025", {"DRIVER=max77759tcpc"}));
+    ASSERT_TRUE(FakeUeventSource::getInstance().send("change", kFakeTcpcDevpath,
+                                                     {"DRIVER=max77759tcpc"}));
+    ASSERT_TRUE(sCallback->waitFor("notifyPortStatusChange", changes + 1, 2000ms));
+    EXPECT_EQ(sCallback->count("notifyPortStatusChange"), changes + 1);
+    EXPECT_EQ(Usb::metrics().values()["uevent_filter_fallbacks"], 0);
+}
+
+TEST_F(UsbHalTest, UnknownPortIsRejected) {
+    size_t switches = sCallback->count("notifyRoleSwitchStatus");
+    size_t resets = sCallback->count("notifyResetUsbPortStatus");
+    PortRole role;
+
+    role.set<PortRole::dataRole>(PortDataRole::HOST);
+    ASSERT_TRUE(sUsb->switchRole("../port0", role, 7).isOk());
+    ASSERT_TRUE(sUsb->resetUsbPort("port9", 8).isOk());
+    ASSERT_TRUE(sCallback->waitFor("notifyRoleSwitchStatus", switches + 1, 2000ms));
+    ASSERT_TRUE(sCallback->waitFor("notifyResetUsbPortStatus", resets + 1, 2000ms));
+
+    for (const MockUsbCallback::Notification &notification : sCallback->notifications()) {
+        if (notification.transactionId == 7 || notification.transactionId == 8) {
+            EXPECT_EQ(notification.status, Status::ERROR) << notification.method;
+        }
+    }
+}
+
+TEST_F(UsbHalTest, RecordedUeventsParse) {
+    auto uevents = FakeUeventSource::parseRecorded(
+        "# plug\n"
+        "add@/devices/x/port0-partner\n"
+        "ACTION=add\n"
+        "\n"
+        "\n"
+        "remove@/devices/x/port0-partner\n"
+        "ACTION=remove\n");
+
+    ASSERT_EQ(uevents.size(), 2u);
+    EXPECT_EQ(uevents[0][0], "add@/devices/x/port0-partner");
+    EXPECT_EQ(uevents[1][1], "ACTION=remove");
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
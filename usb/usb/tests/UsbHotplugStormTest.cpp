@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+#include <gtest/gtest.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <map>
+
+#include "Usb.h"
+#include "UsbHalHarness.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+using std::chrono_literals::operator""ms;
+
+// Rounds of the storm, each made of HOTPLUG_STORM_ROUND_UEVENTS uevents
+#define HOTPLUG_STORM_ROUNDS 500
+#define HOTPLUG_STORM_ROUND_UEVENTS 5
+// Limits checked in, relative to the directory of the test binary
+#define HOTPLUG_STORM_BASELINE "tests/hotplug_storm_baseline.txt"
+
+static int64_t processCpuUsHelper() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Parses "NAME LIMIT" lines, '#' starting a comment
+static std::map<std::string, int64_t> readBaselineHelper(const std::string &path) {
+    std::map<std::string, int64_t> baseline;
+    std::string contents;
+
+    if (!::android::base::ReadFileToString(path, &contents))
+        return baseline;
+    for (const std::string &line : ::android::base::Split(contents, "\n")) {
+        std::vector<std::string> tokens = ::android::base::Tokenize(line, " \t");
+        int64_t limit;
+
+        if (tokens.size() == 2 && tokens[0][0] != '#' &&
+            ::android::base::ParseInt(tokens[1], &limit)) {
+            baseline[tokens[0]] = limit;
+        }
+    }
+    return baseline;
+}
+
+/*
+ * Drives the HAL with the uevents of a flaky cable or pogo dock: the partner coming and going
+ * with its DisplayPort alt mode, tcpc interrupts and usb power supply changes. The fake sysfs
+ * tree follows the partner so every port status query sees the state the uevent announces. The
+ * storm runs once for the suite, whose tests then check what it measured.
+ */
+class UsbHotplugStormTest : public ::testing::Test {
+  protected:
+    static void SetUpTestSuite() {
+        const std::string tcpc = kFakeTcpcDevpath;
+        const std::string partner = tcpc + "/typec/port0/port0-partner";
+        const std::string powerSupply = tcpc + "/power_supply/usb";
+        FakeUeventSource &source = FakeUeventSource::getInstance();
+
+        FakeSysfs::populate();
+        sUsb = ::ndk::SharedRefBase::make<Usb>();
+        sCallback = ::ndk::SharedRefBase::make<MockUsbCallback>();
+        ASSERT_TRUE(sUsb->setCallback(sCallback).isOk());
+        ASSERT_TRUE(sCallback->waitFor("notifyPortStatusChange", 1, 2000ms));
+
+        int64_t cpuStartUs = processCpuUsHelper();
+        for (int i = 0; i < HOTPLUG_STORM_ROUNDS; i++) {
+            FakeSysfs::attachPartner(true);
+            sCallback->markStimulus();
+            ASSERT_TRUE(
+                source.send("add", partner, {"SUBSYSTEM=typec", "DEVTYPE=typec_partner"}));
+            sCallback->markStimulus();
+            ASSERT_TRUE(source.send("change", tcpc, {"DRIVER=max77759tcpc"}));
+            sCallback->markStimulus();
+            ASSERT_TRUE(source.send("change", powerSupply,
+                                    {"SUBSYSTEM=power_supply", "POWER_SUPPLY_NAME=usb"}));
+            sCallback->markStimulus();
+            ASSERT_TRUE(source.send("change", tcpc, {"DRIVER=max77759tcpc"}));
+            FakeSysfs::detachPartner();
+            sCallback->markStimulus();
+            ASSERT_TRUE(
+                source.send("remove", partner, {"SUBSYSTEM=typec", "DEVTYPE=typec_partner"}));
+        }
+        sAnswered = sCallback->waitForAnswered(10000ms);
+
+        sMeasured = Usb::metrics().values();
+        sMeasured["cpu_us_per_uevent"] = (processCpuUsHelper() - cpuStartUs) /
+                                         (HOTPLUG_STORM_ROUNDS * HOTPLUG_STORM_ROUND_UEVENTS);
+        sMeasured["port_status_lag.max_us"] = sCallback->portStatusLag().maxUs();
+        sCallback->portStatusLag().dump(STDOUT_FILENO);
+    }
+
+    static shared_ptr<Usb> sUsb;
+    static shared_ptr<MockUsbCallback> sCallback;
+    static bool sAnswered;
+    static std::map<std::string, int64_t> sMeasured;
+};
+
+shared_ptr<Usb> UsbHotplugStormTest::sUsb;
+shared_ptr<MockUsbCallback> UsbHotplugStormTest::sCallback;
+bool UsbHotplugStormTest::sAnswered;
+std::map<std::string, int64_t> UsbHotplugStormTest::sMeasured;
+
+// Deterministic outcome of the storm, run in presubmit
+TEST_F(UsbHotplugStormTest, AnswersEveryUevent) {
+    EXPECT_TRUE(sAnswered) << "a stimulus got no port status change";
+    EXPECT_EQ(sMeasured["uevents_dropped"], 0);
+}
+
+/*
+ * CPU time per uevent, lock hold maxima and the lag to the framework's port status against
+ * HOTPLUG_STORM_BASELINE. These depend on the load of the runner, so they only run in
+ * postsubmit, where a regression shows up as a trend rather than a blocked change.
+ */
+TEST_F(UsbHotplugStormTest, StaysWithinBaseline) {
+    auto baseline = readBaselineHelper(::android::base::GetExecutableDirectory() + "/" +
+                                       HOTPLUG_STORM_BASELINE);
+    ASSERT_FALSE(baseline.empty()) << "missing " << HOTPLUG_STORM_BASELINE;
+
+    for (const auto &[name, limit] : baseline) {
+        ASSERT_TRUE(sMeasured.count(name)) << "unknown baseline metric " << name;
+        std::cout << name << " " << sMeasured[name] << " (baseline " << limit << ")\n";
+        EXPECT_LE(sMeasured[name], limit) << name << " regressed";
+    }
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
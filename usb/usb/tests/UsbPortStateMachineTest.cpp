@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "UsbPortStateMachine.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+// Traces dumped with the port-trace shell command, relative to the directory of the test binary
+#define PORT_TRACES_DIR "tests/port_traces/"
+
+struct ReplayedTransition {
+    uint32_t timeMs;
+    UsbPortEvent event;
+    UsbPortStateMachine::Transition transition;
+};
+
+/*
+ * Replays records from base through machine as the port-trace-replay shell command does, with
+ * times relative to the first record, and fails the test where the model diverges from them.
+ */
+static std::vector<ReplayedTransition> replayHelper(const UsbPortTraceRecord &base,
+                                                    const std::vector<UsbPortTraceRecord> &records,
+                                                    UsbPortStateMachine *machine) {
+    std::vector<ReplayedTransition> replayed;
+    uint32_t startMs = records.empty() ? 0 : records.front().timeMs;
+
+    machine->reset(0, base.state, base.partner);
+    for (size_t i = 0; i < records.size(); i++) {
+        uint32_t timeMs = records[i].timeMs - startMs;
+        UsbPortStateMachine::Transition transition = machine->update(timeMs, records[i].event);
+
+        EXPECT_EQ(transition.to, records[i].state)
+                << "record " << i << ": " << usbPortEventName(records[i].event);
+        EXPECT_EQ(machine->partner(), records[i].partner) << "record " << i;
+        replayed.push_back({timeMs, records[i].event, transition});
+    }
+    return replayed;
+}
+
+static bool readTraceHelper(const std::string &name, UsbPortTraceRecord *base,
+                            std::vector<UsbPortTraceRecord> *records) {
+    std::string contents, error;
+
+    if (!::android::base::ReadFileToString(
+                ::android::base::GetExecutableDirectory() + "/" + PORT_TRACES_DIR + name,
+                &contents)) {
+        ADD_FAILURE() << "missing " << PORT_TRACES_DIR << name;
+        return false;
+    }
+    if (!parseUsbPortTrace(contents, base, records, &error)) {
+        ADD_FAILURE() << name << ": " << error;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * A DisplayPort dock with the monitor going to sleep once, then a phone switched to host mode and
+ * an accessory that never answers the role swap. Every recorded state replays identically and
+ * the dwell times and latencies the replay derives stay fixed.
+ */
+TEST(UsbPortStateMachineTest, DumpedTraceReplays) {
+    std::vector<UsbPortTraceRecord> records;
+    UsbPortTraceRecord base;
+    UsbPortStateMachine machine;
+
+    ASSERT_TRUE(readTraceHelper("dock_and_role_switch.uptr", &base, &records));
+    ASSERT_EQ(records.size(), 19u);
+    EXPECT_EQ(base.state, UsbPortState::DETACHED);
+    EXPECT_FALSE(base.partner);
+
+    auto replayed = replayHelper(base, records, &machine);
+    uint32_t endMs = replayed.back().timeMs;
+    std::vector<uint32_t> activeMs, roleSwitchEndMs;
+
+    for (const ReplayedTransition &replay : replayed) {
+        EXPECT_TRUE(replay.transition.expected) << "at " << replay.timeMs << " ms";
+        if (replay.transition.from != UsbPortState::DISPLAYPORT_ACTIVE &&
+            replay.transition.to == UsbPortState::DISPLAYPORT_ACTIVE) {
+            activeMs.push_back(replay.timeMs);
+        }
+        if (replay.transition.from == UsbPortState::ROLE_SWITCHING &&
+            replay.transition.to != UsbPortState::ROLE_SWITCHING) {
+            roleSwitchEndMs.push_back(replay.timeMs);
+        }
+    }
+    EXPECT_EQ(machine.unexpectedEvents(), 0u);
+    EXPECT_EQ(machine.state(), UsbPortState::DETACHED);
+    // Plug to display, and display back after the monitor woke up
+    EXPECT_EQ(activeMs, (std::vector<uint32_t>{1276, 605476}));
+    // Role switch completed once the partner came back, and the one that timed out
+    EXPECT_EQ(roleSwitchEndMs, (std::vector<uint32_t>{757834, 896734}));
+    EXPECT_EQ(machine.dwellMs(UsbPortState::DISPLAYPORT_ACTIVE, endMs), 720000u);
+    EXPECT_EQ(machine.dwellMs(UsbPortState::DISPLAYPORT_BOUND, endMs), 5064u);
+    EXPECT_EQ(machine.dwellMs(UsbPortState::ROLE_SWITCHING, endMs), 3835u);
+}
+
+/*
+ * Once the ring buffer wrapped, the dump starts from the last overwritten record, and replaying
+ * the retained records from it reproduces the states recorded live.
+ */
+TEST(UsbPortStateMachineTest, WrappedTraceReplaysFromBase) {
+    const UsbPortEvent cycle[] = {UsbPortEvent::PARTNER_ADDED, UsbPortEvent::DISPLAYPORT_BOUND,
+                                  UsbPortEvent::HPD_HIGH, UsbPortEvent::HPD_LOW,
+                                  UsbPortEvent::PARTNER_REMOVED};
+    UsbPortStateMachine live, replay;
+    std::vector<UsbPortTraceRecord> records;
+    UsbPortTraceRecord base;
+    UsbPortTrace trace;
+    std::string error;
+
+    // Not a multiple of the cycle, so the base record lands mid connection
+    for (uint32_t i = 0; i < USB_PORT_TRACE_RECORDS + 3; i++) {
+        UsbPortEvent event = cycle[i % std::size(cycle)];
+        UsbPortStateMachine::Transition transition = live.update(i * 100, event);
+
+        trace.append({i * 100, event, transition.to, live.partner()});
+    }
+    EXPECT_EQ(trace.overwritten(), 3u);
+
+    ASSERT_TRUE(parseUsbPortTrace(trace.serialize(), &base, &records, &error)) << error;
+    ASSERT_EQ(records.size(), (size_t)USB_PORT_TRACE_RECORDS);
+    EXPECT_EQ(base.state, UsbPortState::DISPLAYPORT_ACTIVE);
+    EXPECT_EQ(records.front().event, UsbPortEvent::HPD_LOW);
+    replayHelper(base, records, &replay);
+    EXPECT_EQ(replay.unexpectedEvents(), 0u);
+}
+
+TEST(UsbPortStateMachineTest, MalformedTraceIsRejected) {
+    std::vector<UsbPortTraceRecord> records;
+    UsbPortTraceRecord base;
+    UsbPortTrace trace;
+    std::string contents, error;
+
+    trace.append({0, UsbPortEvent::PARTNER_ADDED, UsbPortState::ATTACHED, true});
+    contents = trace.serialize();
+
+    EXPECT_FALSE(parseUsbPortTrace("UPTX" + contents.substr(4), &base, &records, &error));
+    EXPECT_EQ(error, "not a port trace");
+    EXPECT_FALSE(parseUsbPortTrace(contents.substr(0, contents.size() - 1), &base, &records,
+                                   &error));
+    EXPECT_EQ(error, "truncated, expected 1 records");
+
+    // Event byte of the only record
+    contents[contents.size() - 3] = static_cast<char>(UsbPortEvent::COUNT);
+    EXPECT_FALSE(parseUsbPortTrace(contents, &base, &records, &error));
+    EXPECT_EQ(error, "invalid record 0");
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <android-base/strings.h>
+#include <benchmark/benchmark.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "UsbSysfsParser.h"
+
+using ::android::base::Tokenize;
+using ::android::base::Trim;
+using namespace ::aidl::android::hardware::usb;
+
+/*
+ * Compares UsbSysfsParser with the Trim() and Tokenize() based parsing it replaced in Usb.cpp,
+ * which is kept below as it was. Each benchmark parses the attribute contents as read from sysfs.
+ */
+
+static void legacyExtractRole(std::string *roleName) {
+    std::size_t first, last;
+
+    first = roleName->find("[");
+    last = roleName->find("]");
+
+    if (first != std::string::npos && last != std::string::npos) {
+        *roleName = roleName->substr(first + 1, last - first - 1);
+    }
+}
+
+static TypeCRoleValue legacyParseTypeCRole(const char *contents) {
+    std::string roleName = contents;
+
+    roleName = Trim(roleName);
+    legacyExtractRole(&roleName);
+    if (roleName == "source")
+        return TypeCRoleValue::SOURCE;
+    if (roleName == "sink")
+        return TypeCRoleValue::SINK;
+    if (roleName == "host")
+        return TypeCRoleValue::HOST;
+    if (roleName == "device")
+        return TypeCRoleValue::DEVICE;
+    if (roleName == "none")
+        return TypeCRoleValue::NONE;
+    return TypeCRoleValue::UNRECOGNIZED;
+}
+
+static DisplayPortAltModePinAssignment legacyParsePinAssignment(std::string pinAssignments) {
+    size_t pos = pinAssignments.find("[");
+    if (pos != std::string::npos) {
+        pinAssignments = pinAssignments.substr(pos + 1, 1);
+        if (pinAssignments == "C") {
+            return DisplayPortAltModePinAssignment::C;
+        } else if (pinAssignments == "D") {
+            return DisplayPortAltModePinAssignment::D;
+        } else if (pinAssignments == "E") {
+            return DisplayPortAltModePinAssignment::E;
+        }
+    }
+    return DisplayPortAltModePinAssignment::NONE;
+}
+
+static int legacyCountNonCompliantReasons(const std::string &reasons) {
+    int count = 0;
+
+    std::vector<std::string> reasonsList = Tokenize(reasons.c_str(), "[], \n\0");
+    for (std::string reason : reasonsList) {
+        if (!strncmp(reason.c_str(), "debug-accessory", strlen("debug-accessory")) ||
+            !strncmp(reason.c_str(), "bc12", strlen("bc12")) ||
+            !strncmp(reason.c_str(), "missing_rp", strlen("missing_rp"))) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static void BM_TypeCRole(benchmark::State &state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(parseTypeCRole("source [sink]\n"));
+        benchmark::DoNotOptimize(parseTypeCRole("[host] device\n"));
+    }
+}
+BENCHMARK(BM_TypeCRole);
+
+static void BM_TypeCRoleLegacy(benchmark::State &state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(legacyParseTypeCRole("source [sink]\n"));
+        benchmark::DoNotOptimize(legacyParseTypeCRole("[host] device\n"));
+    }
+}
+BENCHMARK(BM_TypeCRoleLegacy);
+
+static void BM_PinAssignment(benchmark::State &state) {
+    for (auto _ : state)
+        benchmark::DoNotOptimize(parsePinAssignment("C [D] E\n"));
+}
+BENCHMARK(BM_PinAssignment);
+
+static void BM_PinAssignmentLegacy(benchmark::State &state) {
+    for (auto _ : state)
+        benchmark::DoNotOptimize(legacyParsePinAssignment("C [D] E\n"));
+}
+BENCHMARK(BM_PinAssignmentLegacy);
+
+static void BM_NonCompliantReasons(benchmark::State &state) {
+    for (auto _ : state) {
+        int count = 0;
+
+        forEachSysfsToken("[bc12, missing_rp]\n", [&count](std::string_view reason) {
+            if (parseNonCompliantReason(reason) != NonCompliantReason::UNKNOWN)
+                count++;
+        });
+        benchmark::DoNotOptimize(count);
+    }
+}
+BENCHMARK(BM_NonCompliantReasons);
+
+static void BM_NonCompliantReasonsLegacy(benchmark::State &state) {
+    std::string reasons = "[bc12, missing_rp]\n";
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(legacyCountNonCompliantReasons(reasons));
+}
+BENCHMARK(BM_NonCompliantReasonsLegacy);
+
+BENCHMARK_MAIN();
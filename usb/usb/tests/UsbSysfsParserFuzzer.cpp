@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "UsbSysfsParser.h"
+
+using namespace ::aidl::android::hardware::usb;
+
+// Characters trimSysfsValue() strips
+constexpr std::string_view kWhitespace = " \n\t\r";
+
+// Whether view lies within value, as the parsers only ever return views into their input
+static bool withinInput(std::string_view view, std::string_view value) {
+    return view.empty() || (view.data() >= value.data() &&
+                            view.data() + view.length() <= value.data() + value.length());
+}
+
+/*
+ * Feeds arbitrary attribute contents, e.g. "[source] sink", "[C] D E" or "[bc12, missing_rp]",
+ * to every parser and aborts when a returned view escapes the input or a token is malformed.
+ */
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    std::string_view value(reinterpret_cast<const char *>(data), size);
+    std::string_view trimmed = trimSysfsValue(value);
+    std::string_view selected = selectedSysfsValue(value);
+
+    if (!withinInput(trimmed, value) || !withinInput(selected, value))
+        abort();
+    if (!trimmed.empty() && (kWhitespace.find(trimmed.front()) != std::string_view::npos ||
+                             kWhitespace.find(trimmed.back()) != std::string_view::npos)) {
+        abort();
+    }
+
+    parseTypeCRole(value);
+    parsePinAssignment(value);
+    parseLinkTrainingStatus(value);
+    forEachSysfsToken(value, [&value](std::string_view token) {
+        if (token.empty() || !withinInput(token, value) ||
+            token.find_first_of("[], \n\t") != std::string_view::npos) {
+            abort();
+        }
+        parseNonCompliantReason(token);
+    });
+    return 0;
+}
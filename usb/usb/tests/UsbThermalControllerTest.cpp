@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include <map>
+
+#include "UsbThermalController.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+// Recorded traces, relative to the directory of the test binary
+#define THERMAL_TRACES_DIR "tests/thermal_traces/"
+// CRITICAL trip the traces are replayed against
+#define THERMAL_TRACE_TRIP_DECI_C 390
+
+struct ReplayedSample {
+    int64_t timeMs;
+    int temperatureDeciC;
+    UsbThermalController::Decision decision;
+};
+
+static std::vector<ReplayedSample> replayTraceHelper(const std::string &name) {
+    std::vector<std::pair<int64_t, int>> samples;
+    std::vector<ReplayedSample> replayed;
+    std::string contents, error;
+
+    if (!::android::base::ReadFileToString(
+                ::android::base::GetExecutableDirectory() + "/" + THERMAL_TRACES_DIR + name,
+                &contents)) {
+        ADD_FAILURE() << "missing " << THERMAL_TRACES_DIR << name;
+        return replayed;
+    }
+    if (!parseUsbThermalTrace(contents, &samples, &error)) {
+        ADD_FAILURE() << name << ": malformed line \"" << error << "\"";
+        return replayed;
+    }
+
+    UsbThermalController controller(defaultUsbThermalConfig(THERMAL_TRACE_TRIP_DECI_C));
+    for (const auto &[timeMs, temperatureDeciC] : samples)
+        replayed.push_back({timeMs, temperatureDeciC, controller.update(timeMs, temperatureDeciC)});
+    return replayed;
+}
+
+// Time of every level change mapped to the level entered
+static std::map<int64_t, int> levelChangesHelper(const std::vector<ReplayedSample> &replayed) {
+    std::map<int64_t, int> changes;
+
+    for (const ReplayedSample &sample : replayed) {
+        if (sample.decision.changed)
+            changes[sample.timeMs] = sample.decision.level;
+    }
+    return changes;
+}
+
+/*
+ * Charging heats the port at 40 dC/min. The limit is stepped down three times, 30 s apart and
+ * before the temperature ever reaches the trip, then released one level per 60 s hold once the
+ * temperature settles 8 dC below it.
+ */
+TEST(UsbThermalControllerTest, ChargingHeatupStepsAheadOfTrip) {
+    const UsbThermalConfig config = defaultUsbThermalConfig(THERMAL_TRACE_TRIP_DECI_C);
+    auto replayed = replayTraceHelper("charging_heatup.txt");
+    ASSERT_FALSE(replayed.empty());
+
+    std::map<int64_t, int> expected = {
+            {34000, 1}, {64000, 2}, {94000, 3}, {346000, 2}, {406000, 1}};
+    EXPECT_EQ(levelChangesHelper(replayed), expected);
+
+    for (const ReplayedSample &sample : replayed) {
+        EXPECT_LT(sample.temperatureDeciC, config.tripDeciC) << "at " << sample.timeMs << " ms";
+        EXPECT_EQ(sample.decision.sinkCurrentMa,
+                  sample.decision.level ? config.sinkCurrentStepsMa[sample.decision.level - 1]
+                                        : -1);
+    }
+}
+
+/*
+ * Sampling speeds up as soon as the rise is measured and stays fast while the temperature is
+ * projected near the trip, then falls back to the normal interval while cooling. The port is
+ * never slow sampled while limited.
+ */
+TEST(UsbThermalControllerTest, ChargingHeatupSamplesFastNearTrip) {
+    const UsbThermalConfig config = defaultUsbThermalConfig(THERMAL_TRACE_TRIP_DECI_C);
+    auto replayed = replayTraceHelper("charging_heatup.txt");
+    ASSERT_FALSE(replayed.empty());
+
+    for (const ReplayedSample &sample : replayed) {
+        int expectedMs;
+
+        if (sample.timeMs == 0)
+            expectedMs = config.normalSampleMs;
+        else if (sample.timeMs < 212000)
+            expectedMs = config.fastSampleMs;
+        else
+            expectedMs = config.normalSampleMs;
+        EXPECT_EQ(sample.decision.nextSampleMs, expectedMs) << "at " << sample.timeMs << " ms";
+    }
+}
+
+// A cold idle port is never limited and is sampled at the slow interval throughout
+TEST(UsbThermalControllerTest, IdleColdSamplesSlowly) {
+    const UsbThermalConfig config = defaultUsbThermalConfig(THERMAL_TRACE_TRIP_DECI_C);
+    auto replayed = replayTraceHelper("idle_cold.txt");
+    ASSERT_FALSE(replayed.empty());
+
+    for (const ReplayedSample &sample : replayed) {
+        EXPECT_EQ(sample.decision.level, 0) << "at " << sample.timeMs << " ms";
+        EXPECT_EQ(sample.decision.nextSampleMs, config.slowSampleMs)
+                << "at " << sample.timeMs << " ms";
+    }
+}
+
+TEST(UsbThermalControllerTest, ReplayIsDeterministic) {
+    auto first = replayTraceHelper("charging_heatup.txt");
+    auto second = replayTraceHelper("charging_heatup.txt");
+
+    ASSERT_EQ(first.size(), second.size());
+    for (size_t i = 0; i < first.size(); i++) {
+        EXPECT_EQ(first[i].decision.level, second[i].decision.level);
+        EXPECT_EQ(first[i].decision.slopeDeciCPerMin, second[i].decision.slopeDeciCPerMin);
+        EXPECT_EQ(first[i].decision.nextSampleMs, second[i].decision.nextSampleMs);
+    }
+}
+
+TEST(UsbThermalControllerTest, MalformedTraceIsRejected) {
+    std::vector<std::pair<int64_t, int>> samples;
+    std::string error;
+
+    EXPECT_TRUE(parseUsbThermalTrace("# comment\n\n0 300\n1000\t301\n", &samples, &error));
+    EXPECT_EQ(samples.size(), 2u);
+
+    samples.clear();
+    EXPECT_FALSE(parseUsbThermalTrace("0 300\n1000 hot\n", &samples, &error));
+    EXPECT_EQ(error, "1000 hot");
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl